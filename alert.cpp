@@ -20,8 +20,10 @@
 #include "alert.hpp"
 #include "config.hpp"
 #include <iostream>
+#include <mutex>
 
 int log_lvl;
+static std::mutex log_lock; // movers, crawlers and the daemon all log
 
 std::string errors[NUM_ERRORS] = {
   "Error loading configuration file.",
@@ -30,14 +32,33 @@ std::string errors[NUM_ERRORS] = {
   "No tiers defined in config file.",
   "Only one tier defined in config file, two or more are needed.",
   "WATERMARK must be a positive integer between 0 and 100.",
-  "Error setting extended attribute."
+  "Error setting extended attribute.",
+  "THREADS must be a positive integer.",
+  "EXCLUDE_REGEX is not a valid regular expression.",
+  "IO_URING_DEPTH must be a positive integer.",
+  "DAEMON_INTERVAL and AGE_INTERVAL must be positive integers (seconds).",
+  "MOVE_THREADS must be a positive integer.",
+  "VERIFY must be off, sampled or full.",
+  "HASH must be xxh3 or xxh64.",
+  "SCORE must be shift, decay, hybrid or density.",
+  "HALF_LIFE must be a positive integer (seconds).",
+  "MIN_WATERMARK must not be above MAX_WATERMARK.",
+  "MOVE_BUDGET (bytes, with an optional K, M, G or T suffix) and MOVE_BUDGET_FILES must be positive.",
+  "STREAMING needs every tier to use the same SCORE.",
+  "UNIT_DIR must be relative to the tier directories, UNIT_MAX_FILES and UNIT_MAX_SIZE must be positive.",
+  "STREAMING cannot place directories as units (UNIT_DIR, UNIT_MAX_FILES, UNIT_MAX_SIZE).",
+  "IO_PRIORITY must be idle or a best-effort level from 0 (highest) to 7.",
+  "EXPEDITE_SIZE must be a size in bytes, with an optional K, M, G or T suffix.",
+  "NODE must be <n>/<count> with n below count and count below 1024, NODE_DEPTH at least 1, and LEASE_DIR an existing directory."
 };
 
 void error(enum Error error){
+  std::lock_guard<std::mutex> guard(log_lock);
   std::cerr << errors[error] << std::endl;
 }
 
 void Log(std::string msg, int lvl){
   if(log_lvl < lvl) return;
+  std::lock_guard<std::mutex> guard(log_lock);
   std::cout << msg << std::endl;
 }
@@ -25,8 +25,12 @@
 
 extern int log_lvl;
 
-#define NUM_ERRORS 7
-enum Error{LOAD_CONF, TIER_DNE, NO_FIRST_TIER, NO_TIERS, ONE_TIER, WATERMARK_ERR, SETX};
+#define NUM_ERRORS 24
+enum Error{LOAD_CONF, TIER_DNE, NO_FIRST_TIER, NO_TIERS, ONE_TIER, WATERMARK_ERR, SETX, THREADS_ERR, EXCLUDE_ERR,
+  URING_DEPTH_ERR, INTERVAL_ERR, MOVE_THREADS_ERR, VERIFY_ERR, HASH_ERR,
+  SCORE_ERR, HALF_LIFE_ERR, WATERMARK_BAND_ERR, MOVE_BUDGET_ERR, STREAMING_SCORE_ERR,
+  UNIT_ERR, STREAMING_UNIT_ERR, IO_PRIORITY_ERR, EXPEDITE_ERR,
+  NODE_ERR};
 
 void error(enum Error error);
 
@@ -0,0 +1,386 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Benchmark for the phases of a tiering run. Generates a synthetic tree
+ * in two or more tier directories, writes a config for it, and times each
+ * TierEngine phase on its own, reporting files/s, bytes/s, system calls
+ * per file and peak RSS. Run through `make bench BENCH_ARGS="..."`.
+ */
+
+#include "crawl.hpp"
+#include "config.hpp"
+#include "xattr.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+struct BenchOptions{
+  fs::path root;
+  std::vector<fs::path> tiers;
+  size_t files;
+  size_t files_per_dir;
+  size_t fanout;
+  std::string size_dist;
+  long long size_a;
+  long long size_b;
+  std::string xattrs;
+  int accessed; // % of files read since their xattrs were written
+  int watermark;
+  int runs;
+  bool fill;
+  bool index;
+  std::string tmpfs; // size of a tmpfs to mount on root, empty for none
+  bool keep;
+  unsigned seed;
+};
+
+class SyscallCounter{
+  /*
+   * Counts system calls entered by this process and by threads started
+   * after it, through the raw_syscalls:sys_enter tracepoint. A thread's
+   * calls are added once it exits, so read it between phases. Needs
+   * tracefs and root (or CAP_PERFMON); ok() is false otherwise.
+   */
+private:
+  int fd;
+public:
+  SyscallCounter(){
+    fd = -1;
+    const char *ids[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+      "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+    for(const char *path : ids){
+      std::ifstream f(path);
+      long long id;
+      if(!(f >> id)) continue;
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_TRACEPOINT;
+      attr.config = id;
+      attr.inherit = 1;
+      attr.sample_period = 0;
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+      if(fd != -1) break;
+    }
+  }
+  ~SyscallCounter(){
+    if(fd != -1) close(fd);
+  }
+  bool ok(void) const{ return fd != -1; }
+  long long read_count(void) const{
+    uint64_t count = 0;
+    if(fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+  }
+};
+
+static void usage(const char *prog){
+  std::cerr << "Usage: " << prog << " [options]\n"
+  "  --root DIR          where the tiers are generated, defaults to a new directory in /tmp\n"
+  "  --tmpfs SIZE        mount a tmpfs of SIZE on the root first (needs root)\n"
+  "  --tier DIR          use DIR as the next tier instead of ROOT/tN, may be repeated\n"
+  "  --files N           files generated in the first tier's tree, default 100000\n"
+  "  --files-per-dir N   default 64\n"
+  "  --fanout N          subdirectories per directory, default 16\n"
+  "  --size DIST         fixed:SIZE, uniform:MIN-MAX or lognormal:MEDIAN, default fixed:4K\n"
+  "  --fill              write the file contents instead of leaving them sparse\n"
+  "  --xattrs STATE      none, legacy or packed, default none\n"
+  "  --accessed PCT      % of files accessed since their xattrs were written, default 10\n"
+  "  --watermark PCT     first tier's WATERMARK, default 50\n"
+  "  --index             keep a metadata index between runs\n"
+  "  --runs N            tiering runs over the same tree, default 2\n"
+  "  --seed N            random seed, default 1\n"
+  "  --keep              do not delete the tree afterwards\n";
+}
+
+static bool parse_dist(const std::string &str, BenchOptions &opt){
+  size_t colon = str.find(':');
+  if(colon == std::string::npos) return false;
+  opt.size_dist = str.substr(0, colon);
+  std::string arg = str.substr(colon + 1);
+  if(opt.size_dist == "uniform"){
+    size_t dash = arg.find('-');
+    if(dash == std::string::npos) return false;
+    opt.size_a = parse_size(arg.substr(0, dash));
+    opt.size_b = parse_size(arg.substr(dash + 1));
+    return opt.size_a >= 0 && opt.size_b >= opt.size_a;
+  }
+  if(opt.size_dist != "fixed" && opt.size_dist != "lognormal") return false;
+  opt.size_a = opt.size_b = parse_size(arg);
+  return opt.size_a >= 0;
+}
+
+static int64_t draw_size(const BenchOptions &opt, std::mt19937_64 &rng){
+  if(opt.size_dist == "uniform")
+    return std::uniform_int_distribution<long long>(opt.size_a, opt.size_b)(rng);
+  if(opt.size_dist == "lognormal") // sigma of 2 spans a few bytes to hundreds of times the median
+    return (int64_t)std::lognormal_distribution<double>(log((double)opt.size_a + 1), 2.0)(rng);
+  return opt.size_a;
+}
+
+static bool make_file(const fs::path &path, int64_t size, const BenchOptions &opt, bool accessed, std::vector<char> &buff){
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd == -1){
+    std::cerr << "Cannot create " << path.string() << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  bool ok = true;
+  if(!opt.fill){
+    ok = ftruncate(fd, size) == 0;
+  }else{
+    for(int64_t done = 0; ok && done < size; ){
+      ssize_t n = write(fd, buff.data(), (size - done < (int64_t)buff.size())? size - done : buff.size());
+      ok = n > 0;
+      done += n;
+    }
+  }
+  if(!ok){
+    std::cerr << "Cannot fill " << path.string() << ": " << strerror(errno) << std::endl;
+    close(fd);
+    return false;
+  }
+  struct stat info;
+  fstat(fd, &info);
+  // an access since the last run shows as atime past the recorded one
+  int64_t last_atime = (accessed)? info.st_atime - 60 : info.st_atime;
+  uint64_t priority = TOP_PRIORITY_BIT >> 4;
+  if(opt.xattrs == "packed"){
+    std::string value = pack_meta(last_atime, priority, info.st_atime, NULL);
+    fsetxattr(fd, META_XATTR, value.data(), value.size(), 0);
+  }else if(opt.xattrs == "legacy"){
+    fsetxattr(fd, LEGACY_ATIME_XATTR, &last_atime, sizeof(last_atime), 0);
+    fsetxattr(fd, LEGACY_PRIORITY_XATTR, &priority, sizeof(priority), 0);
+    fsetxattr(fd, LEGACY_PIN_XATTR, "", 0, 0);
+  }
+  close(fd);
+  return true;
+}
+
+static bool generate(const BenchOptions &opt, int64_t &total_bytes){
+  /*
+   * Breadth-first tree of fanout subdirectories per level with
+   * files_per_dir files in each, all in the first tier, so the first
+   * run has everything past the watermark to move.
+   */
+  std::mt19937_64 rng(opt.seed);
+  std::uniform_int_distribution<int> pct(0, 99);
+  std::vector<char> buff(COPY_BUFF_SZ);
+  for(char &c : buff)
+    c = (char)rng();
+  std::vector<fs::path> dirs(1, opt.tiers.front());
+  total_bytes = 0;
+  size_t made = 0;
+  for(size_t d = 0; made < opt.files; d++){
+    for(size_t i = 0; i < opt.files_per_dir && made < opt.files; i++, made++){
+      int64_t size = draw_size(opt, rng);
+      if(!make_file(dirs[d] / ("f" + std::to_string(i)), size, opt, pct(rng) < opt.accessed, buff)) return false;
+      total_bytes += size;
+    }
+    for(size_t s = 0; s < opt.fanout && made + (dirs.size() - d - 1) * opt.files_per_dir < opt.files; s++){
+      dirs.push_back(dirs[d] / ("d" + std::to_string(s)));
+      create_directory(dirs.back());
+    }
+  }
+  return true;
+}
+
+static fs::path write_config(const BenchOptions &opt){
+  fs::path path = opt.root / "bench.conf";
+  std::ofstream f(path.string());
+  f << "[Global]\nLOG_LEVEL=0\n";
+  f << "INDEX_PATH=" << ((opt.index)? (opt.root / "index").string() : "none") << "\n";
+  for(size_t t = 0; t < opt.tiers.size(); t++){
+    f << "\n[Tier " << t + 1 << "]\nDIR=" << opt.tiers[t].string() << "\n";
+    f << "WATERMARK=" << ((t + 1 < opt.tiers.size())? opt.watermark : 100) << "\n";
+  }
+  return path;
+}
+
+static void report(const char *phase, double seconds, size_t files, int64_t bytes, long long calls, bool counted){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  bool timed = seconds >= 1e-6; // skipped phases take no measurable time
+  printf("%-15s %9.3f s", phase, seconds);
+  if(timed)
+    printf(" %12.0f files/s", files / seconds);
+  else
+    printf(" %20s", "");
+  if(bytes >= 0 && timed)
+    printf(" %10.1f MiB/s", bytes / seconds / (1 << 20));
+  else
+    printf(" %16s", "");
+  if(counted && files)
+    printf(" %8.2f syscalls/file", (double)calls / files);
+  else
+    printf(" %22s", "");
+  printf(" %8ld MiB peak RSS\n", usage.ru_maxrss / 1024);
+}
+
+static void run_once(const fs::path &config_path, int run){
+  typedef std::chrono::steady_clock clock;
+  SyscallCounter syscalls;
+  TierEngine engine(config_path);
+  const FileTable &files = engine.file_table();
+  int64_t moved_bytes = 0;
+  long long before = syscalls.read_count();
+  clock::time_point start = clock::now();
+  printf("run %d\n", run);
+  auto phase = [&](const char *name, const std::function<void()> &fn, const std::function<size_t()> &count,
+  const std::function<int64_t()> &bytes){
+    clock::time_point t0 = clock::now();
+    fn();
+    double seconds = std::chrono::duration<double>(clock::now() - t0).count();
+    long long after = syscalls.read_count();
+    report(name, seconds, count(), bytes(), after - before, syscalls.ok());
+    before = after;
+  };
+  auto all_files = [&]{ return files.count(); };
+  auto no_bytes = []{ return (int64_t)-1; };
+  phase("launch_crawlers", [&]{ engine.launch_crawlers(); }, all_files, no_bytes);
+  phase("sort", [&]{ engine.sort(); }, all_files, no_bytes);
+  phase("simulate_tier", [&]{ engine.simulate_tier(); }, all_files, no_bytes);
+  phase("plan_moves", [&]{ engine.plan_moves(); moved_bytes = engine.move_plan().bytes(files); },
+    [&]{ return engine.move_plan().moves.size(); }, no_bytes);
+  size_t moves = engine.move_plan().moves.size();
+  phase("move_files", [&]{ engine.move_files(); }, [&]{ return moves; }, [&]{ return moved_bytes; });
+  phase("write_xattrs", [&]{ engine.write_xattrs(); engine.wait_for_xattrs(); }, all_files, no_bytes);
+  phase("update_index", [&]{ engine.update_index(); }, all_files, no_bytes);
+  double seconds = std::chrono::duration<double>(clock::now() - start).count();
+  printf("%-15s %9.3f s, %zu files, %zu moves\n", "total", seconds, files.count(), moves);
+}
+
+int main(int argc, char *argv[]){
+  BenchOptions opt;
+  opt.files = 100000;
+  opt.files_per_dir = 64;
+  opt.fanout = 16;
+  opt.size_dist = "fixed";
+  opt.size_a = opt.size_b = 4096;
+  opt.xattrs = "none";
+  opt.accessed = 10;
+  opt.watermark = 50;
+  opt.runs = 2;
+  opt.fill = opt.index = opt.keep = false;
+  opt.seed = 1;
+  for(int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    try{
+      if(arg == "--root" && has_value) opt.root = argv[++i];
+      else if(arg == "--tmpfs" && has_value) opt.tmpfs = argv[++i];
+      else if(arg == "--tier" && has_value) opt.tiers.push_back(argv[++i]);
+      else if(arg == "--files" && has_value) opt.files = std::stoul(argv[++i]);
+      else if(arg == "--files-per-dir" && has_value) opt.files_per_dir = std::stoul(argv[++i]);
+      else if(arg == "--fanout" && has_value) opt.fanout = std::stoul(argv[++i]);
+      else if(arg == "--size" && has_value){
+        if(!parse_dist(argv[++i], opt)) throw std::invalid_argument(arg);
+      }
+      else if(arg == "--fill") opt.fill = true;
+      else if(arg == "--xattrs" && has_value) opt.xattrs = argv[++i];
+      else if(arg == "--accessed" && has_value) opt.accessed = std::stoi(argv[++i]);
+      else if(arg == "--watermark" && has_value) opt.watermark = std::stoi(argv[++i]);
+      else if(arg == "--index") opt.index = true;
+      else if(arg == "--runs" && has_value) opt.runs = std::stoi(argv[++i]);
+      else if(arg == "--seed" && has_value) opt.seed = std::stoul(argv[++i]);
+      else if(arg == "--keep") opt.keep = true;
+      else throw std::invalid_argument(arg);
+    }catch(std::logic_error &){
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(opt.files_per_dir == 0 || (opt.xattrs != "none" && opt.xattrs != "legacy" && opt.xattrs != "packed")){
+    usage(argv[0]);
+    return 1;
+  }
+  bool made_root = opt.root.empty();
+  if(made_root){
+    char tmpl[] = "/tmp/autotier-bench.XXXXXX";
+    if(!mkdtemp(tmpl)){
+      perror("mkdtemp");
+      return 1;
+    }
+    opt.root = tmpl;
+  }
+  create_directories(opt.root);
+  if(!opt.tmpfs.empty() && mount("tmpfs", opt.root.c_str(), "tmpfs", 0, ("size=" + opt.tmpfs).c_str()) == -1){
+    perror("mount tmpfs");
+    return 1;
+  }
+  bool own_tiers = opt.tiers.empty();
+  if(own_tiers){
+    opt.tiers.push_back(opt.root / "t1");
+    opt.tiers.push_back(opt.root / "t2");
+  }
+  if(opt.tiers.size() < 2){
+    std::cerr << "At least two tiers are needed." << std::endl;
+    return 1;
+  }
+  for(const fs::path &t : opt.tiers){
+    // everything in the tiers is deleted afterwards, so only start from empty ones
+    create_directories(t);
+    if(!is_empty(t)){
+      std::cerr << t.string() << " is not empty." << std::endl;
+      return 1;
+    }
+  }
+
+  typedef std::chrono::steady_clock clock;
+  clock::time_point t0 = clock::now();
+  int64_t total_bytes;
+  bool generated = generate(opt, total_bytes);
+  fs::path config_path = write_config(opt);
+  if(generated){
+    printf("generated %zu files, %lld bytes (%s, xattrs %s) in %.3f s\n", opt.files, (long long)total_bytes,
+      opt.size_dist.c_str(), opt.xattrs.c_str(), std::chrono::duration<double>(clock::now() - t0).count());
+    if(!SyscallCounter().ok())
+      printf("syscall counts unavailable: mount tracefs on /sys/kernel/tracing and run as root\n");
+    for(int run = 1; run <= opt.runs; run++)
+      run_once(config_path, run);
+  }
+
+  if(!opt.keep){
+    for(const fs::path &t : opt.tiers){
+      if(own_tiers){
+        remove_all(t);
+        continue;
+      }
+      for(fs::directory_iterator e(t); e != fs::directory_iterator(); ++e)
+        remove_all(e->path());
+    }
+    remove(config_path);
+    remove(opt.root / "index");
+    if(!opt.tmpfs.empty()) umount(opt.root.c_str());
+    if(made_root) remove(opt.root);
+  }
+  return (generated)? 0 : 1;
+}
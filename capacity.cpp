@@ -0,0 +1,150 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "capacity.hpp"
+#include "crawl.hpp"
+#include "cluster.hpp"
+#include <algorithm>
+#include <sys/statvfs.h>
+
+void Capacity::probe(const std::vector<Tier> &tiers){
+  // tiers on the same filesystem share one pool, and its space
+  std::lock_guard<std::mutex> guard(lock);
+  pools.clear();
+  tier_pool.clear();
+  max_percent.clear();
+  dirs.clear();
+  tier_reserved.clear();
+  counted = false;
+  for(const Tier &t : tiers){
+    struct statvfs info;
+    struct stat dir_info;
+    Pool pool = {0, false, 0, 0, 0, 0};
+    if(statvfs(t.dir.c_str(), &info) == 0 && stat(t.dir.c_str(), &dir_info) == 0){
+      pool.dev = dir_info.st_dev;
+      pool.size = (int64_t)(info.f_blocks - info.f_bfree + info.f_bavail) * info.f_frsize;
+      pool.used = (int64_t)(info.f_blocks - info.f_bfree) * info.f_frsize;
+    }
+    size_t p;
+    for(p = 0; p < pools.size() && (pools[p].dev != pool.dev || pool.size == 0); p++);
+    if(p == pools.size()) pools.push_back(pool);
+    pools[p].shared |= t.shared == 1;
+    tier_pool.push_back(p);
+    max_percent.push_back(t.max_watermark);
+    dirs.push_back(t.dir);
+    tier_reserved.push_back(0);
+  }
+  // a new pass starts with nothing in flight
+  if(lease && lease->lock_space()){
+    for(size_t t = 0; t < tiers.size(); t++)
+      if(pools[tier_pool[t]].shared) lease->publish(t, 0);
+    lease->unlock_space();
+  }
+}
+
+void Capacity::count(uint16_t tier, int64_t bytes){
+  // a crawled file, as opposed to everything else using the space
+  std::lock_guard<std::mutex> guard(lock);
+  pools[tier_pool[tier]].tiered += bytes;
+}
+
+int64_t Capacity::limit(uint16_t tier, int percent) const{
+  /*
+   * Bytes of crawled files the tier can hold at percent of its
+   * filesystem. Before the crawl has been counted nothing is known to
+   * be other data, so this is an upper bound.
+   */
+  std::lock_guard<std::mutex> guard(lock);
+  const Pool &pool = pools[tier_pool[tier]];
+  if(pool.size == 0) return ERR;
+  int64_t other = (counted)? std::max<int64_t>(pool.used - pool.tiered, 0) : 0;
+  return pool.size * percent / 100 - other;
+}
+
+int64_t Capacity::total_used() const{
+  // everything in use on the tiers' filesystems, each counted once
+  std::lock_guard<std::mutex> guard(lock);
+  int64_t total = 0;
+  for(const Pool &pool : pools)
+    total += pool.used + pool.reserved;
+  return total;
+}
+
+bool Capacity::reserve(uint16_t from, uint16_t to, int64_t bytes){
+  // a rename within a filesystem takes no space
+  if(same_pool(from, to)) return true;
+  std::lock_guard<std::mutex> guard(lock);
+  Pool &pool = pools[tier_pool[to]];
+  if(pool.shared) return reserve_shared(to, bytes);
+  if(pool.used + pool.reserved + bytes > pool.size * max_percent[to] / 100) return false;
+  pool.reserved += bytes;
+  return true;
+}
+
+bool Capacity::reserve_shared(uint16_t to, int64_t bytes){
+  /*
+   * Called with the lock held. What statvfs reports already includes
+   * whatever part of the copies in flight, ours or other nodes', has
+   * been written, so this errs towards stopping early.
+   */
+  Pool &pool = pools[tier_pool[to]];
+  bool coordinated = lease && lease->lock_space();
+  struct statvfs info;
+  if(statvfs(dirs[to].c_str(), &info) == 0)
+    pool.used = (int64_t)(info.f_blocks - info.f_bfree) * info.f_frsize;
+  int64_t elsewhere = 0;
+  if(coordinated)
+    for(size_t t = 0; t < tier_pool.size(); t++)
+      if(tier_pool[t] == tier_pool[to]) elsewhere += lease->reserved_elsewhere(t);
+  bool fits = pool.used + pool.reserved + elsewhere + bytes <= pool.size * max_percent[to] / 100;
+  if(fits){
+    pool.reserved += bytes;
+    tier_reserved[to] += bytes;
+    if(coordinated) lease->publish(to, tier_reserved[to]);
+  }
+  if(coordinated) lease->unlock_space();
+  return fits;
+}
+
+void Capacity::release(uint16_t from, uint16_t to, int64_t bytes, bool moved){
+  if(same_pool(from, to)) return;
+  std::lock_guard<std::mutex> guard(lock);
+  Pool &dst = pools[tier_pool[to]];
+  Pool &src = pools[tier_pool[from]];
+  dst.reserved -= bytes;
+  if(dst.shared){
+    tier_reserved[to] -= bytes;
+    if(lease && lease->lock_space()){
+      lease->publish(to, tier_reserved[to]);
+      lease->unlock_space();
+    }
+  }
+  if(!moved) return;
+  dst.used += bytes;
+  dst.tiered += bytes;
+  src.used -= bytes;
+  src.tiered -= bytes;
+}
+
+void Capacity::credit(uint16_t tier, int64_t bytes){
+  // a partial copy left by an interrupted move already holds this much of the file
+  std::lock_guard<std::mutex> guard(lock);
+  pools[tier_pool[tier]].used -= bytes;
+}
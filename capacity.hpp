@@ -0,0 +1,87 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+#include <sys/stat.h>
+namespace fs = boost::filesystem;
+
+class Tier; // forward declaration
+class NodeLease;
+
+inline int64_t allocated_size(const struct stat &info){
+  // what a file takes up on a tier: its blocks, or its whole size if it is sparse, since a copy may fill the holes
+  int64_t blocks = (int64_t)info.st_blocks * 512;
+  return (blocks > info.st_size)? blocks : info.st_size;
+}
+
+class Capacity{
+  /*
+   * Space on the tiers' filesystems as the planner and the movers see
+   * it. Each filesystem, told apart by st_dev like the movers' devices,
+   * is read once with statvfs; its size leaves out the blocks reserved
+   * for root, and what is in use there besides the crawled files (other
+   * data, or files excluded from tiering) is counted against every tier
+   * on it. Moves reserve space on their
+   * destination before they start and hand it back, or turn it into
+   * used space, when they end, all under one lock, so concurrent movers
+   * stop at the destination's MAX_WATERMARK instead of running past it.
+   *
+   * Other nodes fill a SHARED tier's filesystem as well, so there every
+   * reservation reads it again with statvfs and counts what the other
+   * nodes have reserved in the lease, which also keeps them from
+   * reserving at the same time.
+   */
+private:
+  struct Pool{
+    dev_t dev;
+    bool shared; // a tier on it is SHARED
+    int64_t size; // bytes usable without root
+    int64_t used; // allocated now, by anything
+    int64_t reserved; // for moves still copying in
+    int64_t tiered; // of used, allocated by crawled files
+  };
+  std::vector<Pool> pools;
+  std::vector<size_t> tier_pool; // tier index -> pools index
+  std::vector<int> max_percent;
+  std::vector<fs::path> dirs; // by tier, to read shared pools again
+  std::vector<int64_t> tier_reserved; // by tier, what this node publishes in the lease
+  NodeLease *lease;
+  bool counted;
+  mutable std::mutex lock;
+public:
+  Capacity() : lease(NULL), counted(false){}
+  void share(NodeLease *lease_){ lease = lease_; }
+  void probe(const std::vector<Tier> &tiers);
+  void count(uint16_t tier, int64_t bytes);
+  void counted_all(void){ counted = true; }
+  int64_t limit(uint16_t tier, int percent) const;
+  int64_t total_used(void) const;
+  bool same_pool(uint16_t a, uint16_t b) const{ return tier_pool[a] == tier_pool[b]; }
+  bool reserve(uint16_t from, uint16_t to, int64_t bytes);
+  void release(uint16_t from, uint16_t to, int64_t bytes, bool moved);
+  void credit(uint16_t tier, int64_t bytes);
+private:
+  bool reserve_shared(uint16_t to, int64_t bytes);
+};
@@ -0,0 +1,176 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cluster.hpp"
+#include "alert.hpp"
+#include "config.hpp"
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+
+uint32_t node_of(const char *name, uint32_t nodes){
+  // FNV-1a, so every node agrees on it whatever it was built with
+  uint64_t h = 14695981039346656037ULL;
+  for(const char *c = name; *c; c++){
+    h ^= (unsigned char)*c;
+    h *= 1099511628211ULL;
+  }
+  return h % nodes;
+}
+
+bool node_owns(const fs::path &rel, uint32_t node, uint32_t nodes, unsigned depth){
+  if(nodes < 2) return true;
+  fs::path share;
+  unsigned level = 0;
+  for(fs::path::const_iterator c = rel.begin(); c != rel.end() && level < depth; ++c, level++)
+    share /= *c;
+  return node_of(share.c_str(), nodes) == node;
+}
+
+bool shared_filesystem(const fs::path &dir){
+  static const unsigned long types[] = {
+    0x6969, // NFS
+    0x00c36400, // CephFS
+    0xff534d42, // CIFS
+    0xfe534d42, // SMB2
+    0x65735546, // FUSE, GlusterFS among others
+    0x47504653, // GPFS
+    0x0bd00bd0, // Lustre
+    0x01161970, // GFS2
+    0x7461636f // OCFS2
+  };
+  struct statfs info;
+  if(statfs(dir.c_str(), &info) != 0) return false;
+  for(unsigned long type : types)
+    if((unsigned long)info.f_type == type) return true;
+  return false;
+}
+
+static int lock_range(int fd, int cmd, short type, off_t start, off_t len, struct flock *out = NULL){
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = start;
+  lock.l_len = len;
+  int res = fcntl(fd, cmd, &lock);
+  if(out) *out = lock;
+  return res;
+}
+
+NodeLease::NodeLease(){
+  fd = ERR;
+  node = 0;
+  nodes = 1;
+}
+
+NodeLease::~NodeLease(){
+  release();
+}
+
+bool NodeLease::acquire(const fs::path &dir, uint32_t node_, uint32_t nodes_){
+  /*
+   * Open file description locks, so the lease belongs to this object
+   * and not to whichever thread took it. Ours are taken before the
+   * others are checked for, so of two nodes starting at once with
+   * different counts at least one sees the other.
+   */
+  release();
+  node = node_;
+  nodes = nodes_;
+  fs::path path = dir / LEASE_NAME;
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd == ERR){
+    Log("Cannot open lease " + path.string() + ": " + strerror(errno), 0);
+    return false;
+  }
+  std::string share = "node " + std::to_string(node) + " of " + std::to_string(nodes);
+  if(lock_range(fd, F_OFD_SETLK, F_RDLCK, nodes, 1) == ERR){
+    Log("Cannot lock " + path.string() + ": " + strerror(errno), 0);
+    release();
+    return false;
+  }
+  struct flock other;
+  if((lock_range(fd, F_OFD_GETLK, F_WRLCK, 1, nodes - 1, &other) == 0 && other.l_type != F_UNLCK)
+  || (lock_range(fd, F_OFD_GETLK, F_WRLCK, nodes + 1, MAX_NODES - nodes, &other) == 0 && other.l_type != F_UNLCK)){
+    Log("Another instance splits the tiers between " + std::to_string(other.l_start) + " nodes, not running as " + share + ".", 0);
+    release();
+    return false;
+  }
+  if(lock_range(fd, F_OFD_SETLK, F_WRLCK, MAX_NODES + 1 + node, 1) == ERR){
+    if(errno == EAGAIN || errno == EACCES)
+      Log("Another instance is already running as " + share + ".", 0);
+    else
+      Log("Cannot lock " + path.string() + ": " + strerror(errno), 0);
+    release();
+    return false;
+  }
+  // whatever a previous run of this node left reserved is gone with it
+  int64_t none[LEASE_MAX_TIERS] = {0};
+  if(pwrite(fd, none, sizeof(none), LEASE_SPACE_OFFSET + (off_t)node * sizeof(none)) != (ssize_t)sizeof(none))
+    Log("Cannot clear reservations in " + path.string() + ": " + strerror(errno), 1);
+  Log("Running as " + share + ".", 2);
+  return true;
+}
+
+void NodeLease::release(){
+  if(fd == ERR) return;
+  close(fd); // drops every lock taken through it
+  fd = ERR;
+}
+
+bool NodeLease::lock_space(){
+  // serialises nodes only, the caller keeps this process's threads apart
+  if(fd == ERR) return false;
+  while(lock_range(fd, F_OFD_SETLKW, F_WRLCK, 0, 1) == ERR){
+    if(errno == EINTR) continue;
+    Log(std::string("Cannot lock reservations: ") + strerror(errno), 1);
+    return false;
+  }
+  return true;
+}
+
+void NodeLease::unlock_space(){
+  lock_range(fd, F_OFD_SETLK, F_UNLCK, 0, 1);
+}
+
+int64_t NodeLease::reserved_elsewhere(uint16_t tier) const{
+  // what nodes still holding their share have reserved on tier
+  if(fd == ERR || tier >= LEASE_MAX_TIERS) return 0;
+  int64_t total = 0;
+  for(uint32_t n = 0; n < nodes; n++){
+    if(n == node) continue;
+    int64_t bytes = 0;
+    if(pread(fd, &bytes, sizeof(bytes), LEASE_SPACE_OFFSET + ((off_t)n * LEASE_MAX_TIERS + tier) * sizeof(bytes)) != (ssize_t)sizeof(bytes)
+    || bytes <= 0) continue;
+    struct flock holder;
+    if(lock_range(fd, F_OFD_GETLK, F_WRLCK, MAX_NODES + 1 + n, 1, &holder) == 0 && holder.l_type != F_UNLCK)
+      total += bytes;
+  }
+  return total;
+}
+
+void NodeLease::publish(uint16_t tier, int64_t bytes){
+  if(fd == ERR || tier >= LEASE_MAX_TIERS) return;
+  if(pwrite(fd, &bytes, sizeof(bytes), LEASE_SPACE_OFFSET + ((off_t)node * LEASE_MAX_TIERS + tier) * sizeof(bytes)) != (ssize_t)sizeof(bytes))
+    Log(std::string("Cannot record reservation: ") + strerror(errno), 1);
+}
@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <stdint.h>
+namespace fs = boost::filesystem;
+
+#define MAX_NODES 1024
+#define DEFAULT_NODE_DEPTH 2 // splits the usual single top level directory too
+#define LEASE_NAME ".autotier-nodes" // in LEASE_DIR, never tiered
+#define INDEX_SEGMENT_NAME ".autotier-index" // same, the default INDEX_PATH of shared tiers
+#define LEASE_SPACE_OFFSET 4096 // in the lease, each node's reserved bytes by tier
+#define LEASE_MAX_TIERS 64 // tiers past this are not coordinated
+
+uint32_t node_of(const char *name, uint32_t nodes);
+
+/*
+ * Several instances can share tiers by splitting the namespace between
+ * them: every entry NODE_DEPTH levels below the tier directories, file
+ * or directory, belongs to the node its relative path hashes to, and
+ * each node only crawls, places and moves what is under its own
+ * entries. Files less deep are split one by one, and the directories
+ * above the split are listed by every node.
+ */
+bool node_owns(const fs::path &rel, uint32_t node, uint32_t nodes, unsigned depth);
+
+/*
+ * Whether dir is on a network or cluster filesystem, which other nodes
+ * are likely to write to as well. The default for SHARED.
+ */
+bool shared_filesystem(const fs::path &dir);
+
+class NodeLease{
+  /*
+   * Held for as long as a node tiers its share, as POSIX record locks on
+   * one file in LEASE_DIR. A shared lock on byte `nodes` says how many
+   * nodes the namespace is split between, so instances that disagree on
+   * it do not run at once, and an exclusive lock past MAX_NODES claims
+   * the node's share. Locks go with the process, so a node that dies
+   * frees its share as soon as the filesystem notices; on CephFS or
+   * NFSv4 those locks hold across machines, which is what makes them a
+   * lease.
+   *
+   * Past LEASE_SPACE_OFFSET every node keeps the bytes its moves have
+   * reserved on each tier, so nodes filling the same SHARED tier see
+   * each other's copies in flight. They are read and written under an
+   * exclusive lock on byte 0, and only count while their node holds
+   * its share.
+   */
+private:
+  int fd;
+  uint32_t node;
+  uint32_t nodes;
+public:
+  NodeLease();
+  ~NodeLease();
+  bool acquire(const fs::path &dir, uint32_t node_, uint32_t nodes_);
+  void release(void);
+  bool lock_space(void);
+  void unlock_space(void);
+  int64_t reserved_elsewhere(uint16_t tier) const;
+  void publish(uint16_t tier, int64_t bytes);
+};
@@ -20,14 +20,45 @@
 #include "config.hpp"
 #include "alert.hpp"
 #include "crawl.hpp"
+#include <cctype>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <boost/filesystem.hpp>
 #include <regex>
+#include <thread>
+#include "uring.hpp"
+#include "index.hpp"
+#include "mover.hpp"
+#include "copy.hpp"
+#include "score.hpp"
 
 void Config::load(const fs::path &config_path, std::vector<Tier> &tiers){
   log_lvl = 1; // default to 1
+  num_threads = std::thread::hardware_concurrency(); // default to one per core
+  if(num_threads <= 0) num_threads = 1;
+  uring_depth = DEFAULT_URING_DEPTH;
+  move_threads = DEFAULT_MOVE_THREADS;
+  io_priority = IO_PRIORITY_UNSET;
+  expedite_size = DEFAULT_EXPEDITE_SIZE;
+  move_budget = 0;
+  move_budget_files = 0;
+  verify_mode = VERIFY_FULL;
+  hash_algo = HASH_XXH3;
+  score_model = SCORE_SHIFT;
+  half_life = DEFAULT_HALF_LIFE;
+  index_path = DEFAULT_INDEX_PATH;
+  streaming = false;
+  unit_dirs.clear();
+  unit_max_files = 0;
+  unit_max_size = 0;
+  node = 0;
+  nodes = 1;
+  node_depth = DEFAULT_NODE_DEPTH;
+  lease_dir.clear();
+  daemon_interval = DEFAULT_DAEMON_INTERVAL;
+  age_interval = DEFAULT_AGE_INTERVAL;
   std::fstream config_file(config_path.string(), std::ios::in);
   if(!config_file){
     if(!is_directory(config_path.parent_path())) create_directories(config_path.parent_path());
@@ -65,6 +96,38 @@ void Config::load(const fs::path &config_path, std::vector<Tier> &tiers){
         }catch(std::invalid_argument){
           tiers.back().watermark = ERR;
         }
+      }else if(key == "MIN_WATERMARK"){
+        try{
+          tiers.back().min_watermark = stoi(value);
+        }catch(std::invalid_argument &){
+          tiers.back().min_watermark = ERR;
+        }
+      }else if(key == "MAX_WATERMARK"){
+        try{
+          tiers.back().max_watermark = stoi(value);
+        }catch(std::invalid_argument &){
+          tiers.back().max_watermark = ERR;
+        }
+      }else if(key == "IO_URING"){
+        tiers.back().io_uring = parse_bool(value);
+      }else if(key == "SHARED"){
+        tiers.back().shared = parse_bool(value);
+      }else if(key == "VERIFY"){
+        tiers.back().verify_mode = parse_verify_mode(value);
+      }else if(key == "SCORE"){
+        tiers.back().score_model = parse_score_model(value);
+      }else if(key == "MOVE_THREADS"){
+        try{
+          tiers.back().move_threads = stoi(value);
+        }catch(std::invalid_argument &){
+          tiers.back().move_threads = ERR;
+        }
+      }else if(key == "IO_PRIORITY"){
+        tiers.back().io_priority = parse_io_priority(value);
+      }else if(key == "EXCLUDE"){
+        tiers.back().exclude.add_glob(value);
+      }else if(key == "EXCLUDE_REGEX"){
+        tiers.back().exclude.add_regex(value);
       } // else ignore
     }else{
       error(NO_FIRST_TIER);
@@ -72,11 +135,43 @@ void Config::load(const fs::path &config_path, std::vector<Tier> &tiers){
     }
   }
     
-  if(verify(tiers)){
+  // build each tier's matcher once here instead of per file while crawling
+  bool exclude_errors = false;
+  for(Tier &t : tiers){
+    if(t.verify_mode == VERIFY_UNSET) t.verify_mode = (enum VerifyMode)verify_mode;
+    if(t.score_model == SCORE_UNSET) t.score_model = (enum ScoreModel)score_model;
+    if(t.io_priority == IO_PRIORITY_UNSET) t.io_priority = io_priority;
+    // WATERMARK alone is a band of zero width
+    if(t.min_watermark == DISABLED) t.min_watermark = t.watermark;
+    if(t.max_watermark == DISABLED) t.max_watermark = t.watermark;
+    t.exclude.inherit(exclude);
+    if(!t.exclude.compile()){
+      std::cerr << t.id << ": ";
+      error(EXCLUDE_ERR);
+      exclude_errors = true;
+    }
+  }
+  
+  // shared tiers: coordinate on the last one, and keep the index where every node can read it
+  if(nodes > 1){
+    if(lease_dir.empty() && !tiers.empty()) lease_dir = tiers.back().dir;
+    if(index_path == DEFAULT_INDEX_PATH) index_path = lease_dir / INDEX_SEGMENT_NAME;
+  }
+  for(Tier &t : tiers)
+    if(t.shared == ERR) t.shared = nodes > 1 && shared_filesystem(t.dir);
+  
+  if(verify(tiers) || exclude_errors){
     error(LOAD_CONF);
     exit(1);
   }
   
+  // pick how data gets between each pair of tiers once instead of per file, see TierEngine::copy_method
+  for(Tier &src : tiers){
+    src.copy_to.clear();
+    for(Tier &dst : tiers)
+      src.copy_to.push_back((&src == &dst || same_filesystem(src.dir, dst.dir))? COPY_RENAME : COPY_UNPROBED);
+  }
+  
   if(log_lvl >= 2) dump(std::cout, tiers);
 }
 
@@ -106,6 +201,95 @@ int Config::load_global(std::fstream &config_file, std::string &id){
       }catch(std::invalid_argument){
         this->log_lvl = ERR;
       }
+    }else if(key == "THREADS"){
+      if(value.empty()) continue; // left blank, one per core
+      try{
+        this->num_threads = stoi(value);
+      }catch(std::invalid_argument &){
+        this->num_threads = ERR;
+      }
+    }else if(key == "IO_URING_DEPTH"){
+      try{
+        this->uring_depth = stoi(value);
+      }catch(std::invalid_argument &){
+        this->uring_depth = ERR;
+      }
+    }else if(key == "VERIFY"){
+      this->verify_mode = parse_verify_mode(value);
+    }else if(key == "HASH"){
+      this->hash_algo = parse_hash_algo(value);
+    }else if(key == "SCORE"){
+      this->score_model = parse_score_model(value);
+    }else if(key == "HALF_LIFE"){
+      try{
+        this->half_life = stoi(value);
+      }catch(std::invalid_argument &){
+        this->half_life = ERR;
+      }
+    }else if(key == "MOVE_THREADS"){
+      try{
+        this->move_threads = stoi(value);
+      }catch(std::invalid_argument &){
+        this->move_threads = ERR;
+      }
+    }else if(key == "IO_PRIORITY"){
+      this->io_priority = parse_io_priority(value);
+    }else if(key == "EXPEDITE_SIZE"){
+      this->expedite_size = parse_size(value);
+    }else if(key == "MOVE_BUDGET"){
+      this->move_budget = parse_size(value);
+    }else if(key == "MOVE_BUDGET_FILES"){
+      try{
+        this->move_budget_files = stol(value);
+      }catch(std::invalid_argument &){
+        this->move_budget_files = ERR;
+      }
+    }else if(key == "DAEMON_INTERVAL"){
+      try{
+        this->daemon_interval = stoi(value);
+      }catch(std::invalid_argument &){
+        this->daemon_interval = ERR;
+      }
+    }else if(key == "AGE_INTERVAL"){
+      try{
+        this->age_interval = stoi(value);
+      }catch(std::invalid_argument &){
+        this->age_interval = ERR;
+      }
+    }else if(key == "INDEX_PATH"){
+      this->index_path = (value == "none")? fs::path() : fs::path(value);
+    }else if(key == "METRICS_PATH"){
+      this->metrics_path = (value == "none")? fs::path() : fs::path(value);
+    }else if(key == "STREAMING"){
+      this->streaming = parse_bool(value);
+    }else if(key == "UNIT_DIR"){
+      this->unit_dirs.push_back(fs::path(value));
+    }else if(key == "UNIT_MAX_FILES"){
+      try{
+        this->unit_max_files = stol(value);
+      }catch(std::invalid_argument &){
+        this->unit_max_files = ERR;
+      }
+    }else if(key == "UNIT_MAX_SIZE"){
+      this->unit_max_size = parse_size(value);
+    }else if(key == "NODE"){
+      // <n>/<count>
+      char slash;
+      std::istringstream fields(value);
+      if(!(fields >> this->node >> slash >> this->nodes) || slash != '/' || !fields.eof())
+        this->node = this->nodes = ERR;
+    }else if(key == "NODE_DEPTH"){
+      try{
+        this->node_depth = stoi(value);
+      }catch(std::invalid_argument &){
+        this->node_depth = ERR;
+      }
+    }else if(key == "LEASE_DIR"){
+      this->lease_dir = value;
+    }else if(key == "EXCLUDE"){
+      this->exclude.add_glob(value);
+    }else if(key == "EXCLUDE_REGEX"){
+      this->exclude.add_regex(value);
     } // else if ...
   }
   // if here, EOF reached
@@ -121,16 +305,68 @@ void discard_comments(std::string &str){
   }
 }
 
+bool parse_bool(const std::string &value){
+  return (value == "1" || value == "true" || value == "yes" || value == "on");
+}
+
+long long parse_size(const std::string &value){
+  // bytes, with an optional K, M, G or T suffix (powers of 1024)
+  size_t end;
+  long long bytes;
+  try{
+    bytes = stoll(value, &end);
+  }catch(std::logic_error &){
+    return ERR;
+  }
+  std::string suffix = value.substr(end);
+  if(suffix.empty()) return bytes;
+  const char *units = "KMGT";
+  const char *unit = strchr(units, toupper(suffix[0]));
+  if(!unit || (suffix.length() > 1 && suffix.substr(1) != "B" && suffix.substr(1) != "iB")) return ERR;
+  for(const char *u = units; u <= unit; u++)
+    bytes *= 1024;
+  return bytes;
+}
+
 void Config::generate_config(std::fstream &file){
   file <<
   "# autotier config\n"
   "[Global]            # global settings\n"
   "LOG_LEVEL=1         # 0 = none, 1 = normal, 2 = debug\n"
+  "#THREADS=           # number of crawler threads, defaults to number of cores\n"
+  "#EXCLUDE=*.tmp      # glob of file names to never tier, may be repeated\n"
+  "#EXCLUDE_REGEX=     # regex of file names to never tier, may be repeated\n"
+  "#IO_URING_DEPTH=128 # requests in flight per crawler thread on IO_URING tiers\n"
+  "#MOVE_THREADS=2     # files moved at once per device\n"
+  "#IO_PRIORITY=       # I/O priority of moves: idle, or 0 (highest) to 7\n"
+  "#EXPEDITE_SIZE=1M   # recently read files up to this size are promoted first, 0 to disable\n"
+  "#MOVE_BUDGET=       # most bytes moved per run, e.g. 50G, unlimited if unset\n"
+  "#MOVE_BUDGET_FILES= # most files moved per run, unlimited if unset\n"
+  "#VERIFY=full        # check copies before removing the source: off, sampled or full\n"
+  "#HASH=xxh3          # checksum used to verify copies: xxh3 or xxh64\n"
+  "#SCORE=shift        # how files are ranked: shift, decay, hybrid or density\n"
+  "#HALF_LIFE=86400    # seconds for a decayed access count to halve\n"
+  "#INDEX_PATH=/var/lib/autotier/index # metadata index, none to always crawl fully\n"
+  "#METRICS_PATH=/var/lib/node_exporter/autotier.prom # Prometheus textfile\n"
+  "#STREAMING=false    # crawl twice instead of holding every file in memory\n"
+  "#UNIT_DIR=          # directory, relative to the tiers, placed as a whole, may be repeated\n"
+  "#UNIT_MAX_FILES=    # place directories with at most this many files as a whole\n"
+  "#UNIT_MAX_SIZE=     # ... and at most this many bytes, e.g. 1G\n"
+  "#NODE=0/1           # this instance's share of tiers shared by several, <n>/<count>\n"
+  "#LEASE_DIR=         # shared directory the instances coordinate in, defaults to the last tier\n"
+  "#DAEMON_INTERVAL=60 # --daemon: seconds between placement passes\n"
+  "#AGE_INTERVAL=1800  # --daemon: seconds between priority aging, like the timer period\n"
   "\n"
   "[Tier 1]\n"
   "DIR=                # full path to tier storage pool\n"
   "MAX_WATERMARK=      # % usage at which to tier down from tier\n"
   "MIN_WATERMARK=      # % usage at which to tier up into tier\n"
+  "#IO_URING=true      # batch stat/xattr reads with io_uring (slow or remote disks)\n"
+  "#SHARED=            # other nodes fill this tier's filesystem too, defaults to network filesystems with NODE set\n"
+  "#MOVE_THREADS=      # files moved at once on this tier's device, overrides [Global]\n"
+  "#IO_PRIORITY=       # for moves to or from this tier, overrides [Global]\n"
+  "#VERIFY=            # check for copies into this tier, overrides [Global]\n"
+  "#SCORE=             # how this tier picks its files, overrides [Global]\n"
   "# file age is calculated as (current time - file mtime), i.e. the amount\n"
   "# of time that has passed since the file was last modified.\n"
   "[Tier 2]\n"
@@ -143,6 +379,75 @@ void Config::generate_config(std::fstream &file){
 
 bool Config::verify(const std::vector<Tier> &tiers){
   bool errors = false;
+  if(num_threads == ERR || num_threads < 1){
+    error(THREADS_ERR);
+    errors = true;
+  }
+  if(uring_depth == ERR || uring_depth < 1){
+    error(URING_DEPTH_ERR);
+    errors = true;
+  }
+  if(verify_mode == VERIFY_INVALID){
+    error(VERIFY_ERR);
+    errors = true;
+  }
+  if(hash_algo == HASH_INVALID){
+    error(HASH_ERR);
+    errors = true;
+  }
+  if(score_model == SCORE_INVALID){
+    error(SCORE_ERR);
+    errors = true;
+  }
+  if(half_life == ERR || half_life < 1){
+    error(HALF_LIFE_ERR);
+    errors = true;
+  }
+  if(move_threads == ERR || move_threads < 1){
+    error(MOVE_THREADS_ERR);
+    errors = true;
+  }
+  if(move_budget < 0 || move_budget_files < 0){
+    error(MOVE_BUDGET_ERR);
+    errors = true;
+  }
+  if(io_priority == ERR){
+    error(IO_PRIORITY_ERR);
+    errors = true;
+  }
+  if(expedite_size < 0){
+    error(EXPEDITE_ERR);
+    errors = true;
+  }
+  if(daemon_interval == ERR || daemon_interval < 1 || age_interval == ERR || age_interval < 1){
+    error(INTERVAL_ERR);
+    errors = true;
+  }
+  if(streaming){
+    for(const Tier &t : tiers){
+      if(t.score_model != tiers.front().score_model){
+        error(STREAMING_SCORE_ERR);
+        errors = true;
+        break;
+      }
+    }
+  }
+  bool bad_unit = unit_max_files < 0 || unit_max_size < 0;
+  for(const fs::path &d : unit_dirs)
+    bad_unit = bad_unit || d.empty() || d.is_absolute();
+  if(bad_unit){
+    error(UNIT_ERR);
+    errors = true;
+  }
+  if(streaming && placing_units()){
+    error(STREAMING_UNIT_ERR);
+    errors = true;
+  }
+  if(nodes < 1 || nodes >= MAX_NODES || node < 0 || node >= nodes || node_depth < 1
+  || (nodes > 1 && !is_directory(lease_dir))){
+    error(NODE_ERR);
+    errors = true;
+  }
   if(tiers.empty()){
     error(NO_TIERS);
     errors = true;
@@ -156,10 +461,35 @@ bool Config::verify(const std::vector<Tier> &tiers){
       error(TIER_DNE);
       errors = true;
     }
-    if(t.watermark == ERR || t.watermark > 100 || t.watermark < 0){
+    if(t.verify_mode == VERIFY_INVALID){
+      std::cerr << t.id << ": ";
+      error(VERIFY_ERR);
+      errors = true;
+    }
+    if(t.score_model == SCORE_INVALID){
+      std::cerr << t.id << ": ";
+      error(SCORE_ERR);
+      errors = true;
+    }
+    if(t.move_threads == ERR || t.move_threads < 0){
+      std::cerr << t.id << ": ";
+      error(MOVE_THREADS_ERR);
+      errors = true;
+    }
+    if(t.io_priority == ERR){
+      std::cerr << t.id << ": ";
+      error(IO_PRIORITY_ERR);
+      errors = true;
+    }
+    if(t.min_watermark == ERR || t.min_watermark > 100 || t.min_watermark < 0
+    || t.max_watermark == ERR || t.max_watermark > 100 || t.max_watermark < 0){
       std::cerr << t.id << ": ";
       error(WATERMARK_ERR);
       errors = true;
+    }else if(t.min_watermark > t.max_watermark){
+      std::cerr << t.id << ": ";
+      error(WATERMARK_BAND_ERR);
+      errors = true;
     }
   }
   return errors;
@@ -168,11 +498,53 @@ bool Config::verify(const std::vector<Tier> &tiers){
 void Config::dump(std::ostream &os, const std::vector<Tier> &tiers) const{
   os << "[Global]" << std::endl;
   os << "LOG_LEVEL=" << this->log_lvl << std::endl;
+  os << "THREADS=" << this->num_threads << std::endl;
+  os << "IO_URING_DEPTH=" << this->uring_depth << std::endl;
+  os << "MOVE_THREADS=" << this->move_threads << std::endl;
+  if(this->io_priority != IO_PRIORITY_UNSET) os << "IO_PRIORITY=" << io_priority_name(this->io_priority) << std::endl;
+  os << "EXPEDITE_SIZE=" << this->expedite_size << std::endl;
+  if(this->move_budget) os << "MOVE_BUDGET=" << this->move_budget << std::endl;
+  if(this->move_budget_files) os << "MOVE_BUDGET_FILES=" << this->move_budget_files << std::endl;
+  os << "VERIFY=" << verify_mode_name((enum VerifyMode)this->verify_mode) << std::endl;
+  os << "HASH=" << hash_algo_name((enum HashAlgo)this->hash_algo);
+  if(this->hash_algo == HASH_XXH3) os << " # " << XXH3::kernel_name();
+  os << std::endl;
+  os << "SCORE=" << score_model_name((enum ScoreModel)this->score_model) << std::endl;
+  os << "HALF_LIFE=" << this->half_life << std::endl;
+  os << "DAEMON_INTERVAL=" << this->daemon_interval << std::endl;
+  os << "AGE_INTERVAL=" << this->age_interval << std::endl;
+  os << "INDEX_PATH=" << ((this->index_path.empty())? "none" : this->index_path.string()) << std::endl;
+  if(!this->metrics_path.empty()) os << "METRICS_PATH=" << this->metrics_path.string() << std::endl;
+  os << "STREAMING=" << ((this->streaming)? "true" : "false") << std::endl;
+  if(this->nodes > 1){
+    os << "NODE=" << this->node << "/" << this->nodes << std::endl;
+    os << "NODE_DEPTH=" << this->node_depth << std::endl;
+    os << "LEASE_DIR=" << this->lease_dir.string() << std::endl;
+  }
+  for(const fs::path &d : this->unit_dirs)
+    os << "UNIT_DIR=" << d.string() << std::endl;
+  if(this->unit_max_files) os << "UNIT_MAX_FILES=" << this->unit_max_files << std::endl;
+  if(this->unit_max_size) os << "UNIT_MAX_SIZE=" << this->unit_max_size << std::endl;
+  this->exclude.dump(os);
   os << std::endl;
   for(Tier t : tiers){
     os << "[" << t.id << "]" << std::endl;
     os << "DIR=" << t.dir.string() << std::endl;
-    os << "WATERMARK=" << t.watermark << std::endl;
+    if(t.min_watermark == t.max_watermark){
+      os << "WATERMARK=" << t.max_watermark << std::endl;
+    }else{
+      os << "MIN_WATERMARK=" << t.min_watermark << std::endl;
+      os << "MAX_WATERMARK=" << t.max_watermark << std::endl;
+    }
+    os << "IO_URING=" << ((t.io_uring)? "true" : "false") << std::endl;
+    if(t.shared == 1) os << "SHARED=true" << std::endl;
+    if(t.move_threads) os << "MOVE_THREADS=" << t.move_threads << std::endl;
+    if(t.io_priority != IO_PRIORITY_UNSET) os << "IO_PRIORITY=" << io_priority_name(t.io_priority) << std::endl;
+    os << "VERIFY=" << verify_mode_name(t.verify_mode) << std::endl;
+    os << "SCORE=" << score_model_name(t.score_model) << std::endl;
+    t.exclude.dump(os);
+    for(size_t i = 0; i < t.copy_to.size(); i++)
+      if(tiers[i].id != t.id) os << "# copies to " << tiers[i].id << " with " << copy_method_name(t.copy_to[i]) << std::endl;
     os << std::endl;
   }
 }
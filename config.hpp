@@ -19,11 +19,14 @@
 
 #pragma once
 
+#include "exclude.hpp"
 #include <iostream>
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
 #define DEFAULT_CONFIG_PATH "/etc/autotier.conf"
+#define DEFAULT_DAEMON_INTERVAL 60
+#define DEFAULT_AGE_INTERVAL 1800
 #define ERR -1
 #define DISABLED -999
 
@@ -35,9 +38,41 @@ private:
   bool verify(const std::vector<Tier> &tiers);
 public:
   int log_lvl;
+  int num_threads;
+  int uring_depth;
+  int move_threads; // concurrent moves per device
+  int io_priority; // IO_PRIORITY, default for tiers that do not set one
+  long long expedite_size; // promotions of recently read files up to this many bytes go first, 0 if disabled
+  long long move_budget; // bytes moved per run, 0 for no limit
+  long move_budget_files; // files moved per run, 0 for no limit
+  int verify_mode; // enum VerifyMode, default for tiers that do not set one
+  int hash_algo; // enum HashAlgo
+  int score_model; // enum ScoreModel, default for tiers that do not set one
+  int half_life; // seconds for a file's decayed access count to halve
+  fs::path index_path; // empty if disabled
+  fs::path metrics_path; // Prometheus textfile, empty if disabled
+  bool streaming; // crawl twice instead of keeping every file in memory
+  std::vector<fs::path> unit_dirs; // placed as a whole, relative to the tier directories
+  long unit_max_files; // directories with at most this many files are placed as a whole, 0 if disabled
+  long long unit_max_size; // same for bytes, 0 if disabled
+  int node; // this instance's share of the namespace, see node_of()
+  int nodes; // instances sharing the tiers, 1 if not shared
+  int node_depth; // levels below the tier directories at which the namespace is split, see node_owns()
+  fs::path lease_dir; // where they coordinate, defaults to the last tier
+  int daemon_interval; // seconds between placement passes in daemon mode
+  int age_interval; // seconds between priority aging in daemon mode
+  ExcludeMatcher exclude; // global patterns, inherited by every tier
   void load(const fs::path &config_path, std::vector<Tier> &tiers);
   int load_global(std::fstream &config_file, std::string &id);
   void dump(std::ostream &os, const std::vector<Tier> &tiers) const;
+  bool placing_units(void) const{ return !unit_dirs.empty() || unit_max_files || unit_max_size; }
+  // node n's segment of a shared index, or the whole index when the tiers are not shared
+  fs::path index_segment(int n) const{ return (nodes > 1)? fs::path(index_path.string() + "." + std::to_string(n)) : index_path; }
+  uint32_t split_depth(void) const{ return (nodes > 1)? node_depth : 0; }
 };
 
 void discard_comments(std::string &str);
+
+bool parse_bool(const std::string &value);
+
+long long parse_size(const std::string &value);
@@ -0,0 +1,352 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "copy.hpp"
+#include "alert.hpp"
+#include "config.hpp"
+#include "hash.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+static bool unsupported(int err){
+  // errors that mean "try the next method" rather than a failed copy
+  return err == EXDEV || err == EOPNOTSUPP || err == ENOTSUP || err == ENOSYS || err == EINVAL || err == ENOTTY;
+}
+
+static int copy_reflink(int src_fd, int dst_fd){
+  return (ioctl(dst_fd, FICLONE, src_fd) == ERR)? errno : 0;
+}
+
+static void drop_behind(int src_fd, int dst_fd, off_t offset, off_t len){
+  /*
+   * Once a chunk is copied neither side of it is read again, so its
+   * pages go before they push out what clients are using. The previous
+   * chunk's writeback is waited on, which also keeps dirty pages from
+   * piling up faster than the destination takes them.
+   */
+  posix_fadvise(src_fd, offset, len, POSIX_FADV_DONTNEED);
+  sync_file_range(dst_fd, offset, len, SYNC_FILE_RANGE_WRITE);
+  if(offset < COPY_CHUNK_SZ) return;
+  sync_file_range(dst_fd, offset - COPY_CHUNK_SZ, COPY_CHUNK_SZ,
+    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(dst_fd, offset - COPY_CHUNK_SZ, COPY_CHUNK_SZ, POSIX_FADV_DONTNEED);
+}
+
+static int copy_range(int src_fd, int dst_fd, off_t size){
+  // in-kernel copy, which the filesystem may offload to the device
+  off_t done = 0, chunk = 0;
+  while(done < size){
+    off_t want = COPY_CHUNK_SZ - (done - chunk);
+    ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, (size - done < want)? size - done : want, 0);
+    if(n == ERR){
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    if(n == 0) return ENODATA; // source shrank, a short copy must not replace it
+    done += n;
+    if(done - chunk == COPY_CHUNK_SZ){
+      drop_behind(src_fd, dst_fd, chunk, COPY_CHUNK_SZ);
+      chunk = done;
+    }
+  }
+  return 0;
+}
+
+static int copy_sendfile(int src_fd, int dst_fd, off_t size){
+  off_t done = 0, chunk = 0;
+  while(done < size){
+    off_t want = COPY_CHUNK_SZ - (done - chunk);
+    ssize_t n = sendfile(dst_fd, src_fd, NULL, (size - done < want)? size - done : want);
+    if(n == ERR){
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    if(n == 0) return ENODATA;
+    done += n;
+    if(done - chunk == COPY_CHUNK_SZ){
+      drop_behind(src_fd, dst_fd, chunk, COPY_CHUNK_SZ);
+      chunk = done;
+    }
+  }
+  return 0;
+}
+
+static int copy_buffered(int src_fd, int dst_fd, off_t size, TreeHash *hash){
+  /*
+   * Last resort, through one large aligned buffer. The destination is
+   * written with O_DIRECT when the filesystem allows it so a big move
+   * does not push the page cache out, and the source pages are dropped
+   * behind us for the same reason. The unaligned tail is written through
+   * the page cache. With a hash, the source is hashed as it goes by.
+   * Ending before size bytes means the source shrank since its fstat.
+   */
+  void *buff;
+  if(posix_memalign(&buff, COPY_ALIGN, COPY_BUFF_SZ) != 0) return ENOMEM;
+  int dst_flags = fcntl(dst_fd, F_GETFL);
+  bool direct = (fcntl(dst_fd, F_SETFL, dst_flags | O_DIRECT) != ERR);
+  off_t offset = 0;
+  int err = 0;
+  for(;;){
+    ssize_t n = read(src_fd, buff, COPY_BUFF_SZ);
+    if(n == ERR){
+      if(errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+    if(n == 0) break;
+    if(hash) hash->add(buff, n);
+    if(direct && n % COPY_ALIGN != 0){
+      fcntl(dst_fd, F_SETFL, dst_flags);
+      direct = false;
+    }
+    for(ssize_t w = 0; w < n; ){
+      ssize_t written = write(dst_fd, (char *)buff + w, n - w);
+      if(written == ERR && errno == EINVAL && direct){
+        // the filesystem accepted the flag but not the write
+        fcntl(dst_fd, F_SETFL, dst_flags);
+        direct = false;
+        continue;
+      }
+      if(written == ERR){
+        if(errno == EINTR) continue;
+        err = errno;
+        break;
+      }
+      w += written;
+    }
+    if(err) break;
+    posix_fadvise(src_fd, offset, n, POSIX_FADV_DONTNEED);
+    offset += n;
+  }
+  if(direct) fcntl(dst_fd, F_SETFL, dst_flags);
+  free(buff);
+  if(!err && offset < size) err = ENODATA; // source shrank
+  return err;
+}
+
+static int restart_copy(int src_fd, int dst_fd){
+  // a method that gave up part way leaves both offsets and the destination to start over
+  if(lseek(src_fd, 0, SEEK_SET) == ERR || lseek(dst_fd, 0, SEEK_SET) == ERR || ftruncate(dst_fd, 0) == ERR)
+    return errno;
+  return 0;
+}
+
+int sample_fds(int src_fd, int dst_fd, off_t size, enum HashAlgo algo, bool *match){
+  // the same chunks of both files, evenly spaced and always including the end
+  char *src_buff = new char[VERIFY_SAMPLE_SZ];
+  char *dst_buff = new char[VERIFY_SAMPLE_SZ];
+  Hasher src_hash(algo), dst_hash(algo);
+  off_t stride = size / VERIFY_SAMPLES;
+  int err = 0;
+  for(int i = 0; i <= VERIFY_SAMPLES && !err; i++){
+    off_t offset = (i == VERIFY_SAMPLES)? size - VERIFY_SAMPLE_SZ : stride * i;
+    if(offset < 0) offset = 0;
+    ssize_t src_n = pread(src_fd, src_buff, VERIFY_SAMPLE_SZ, offset);
+    ssize_t dst_n = pread(dst_fd, dst_buff, VERIFY_SAMPLE_SZ, offset);
+    if(src_n == ERR || dst_n == ERR){
+      err = errno;
+      break;
+    }
+    src_hash.add(src_buff, src_n);
+    dst_hash.add(dst_buff, dst_n);
+    if(src_n != dst_n) break;
+  }
+  delete [] src_buff;
+  delete [] dst_buff;
+  *match = (src_hash.hash() == dst_hash.hash());
+  return err;
+}
+
+bool copy_data(int src_fd, int dst_fd, const CopyOptions &options){
+  /*
+   * dst_fd must be open for reading too. A clone shares the source's
+   * blocks so there is nothing to verify; a full check needs the data to
+   * pass through us, so it turns the in-kernel copies into a buffered one.
+   * The source is read once, front to back, and nothing either file left
+   * in the page cache is kept once the copy is checked.
+   */
+  struct stat info;
+  if(fstat(src_fd, &info) == ERR) return false;
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_NOREUSE);
+  enum VerifyMode verify = options.verify;
+  TreeHash src_hash(options.hash);
+  bool hashed = false;
+  int err = ENOTSUP;
+  uint64_t start = (metrics.enabled)? metrics_now() : 0;
+  switch(options.method){
+  case COPY_RENAME: // the caller renames, anything else lands here
+  case COPY_UNPROBED:
+  case COPY_REFLINK:
+    if((err = copy_reflink(src_fd, dst_fd)) == 0){
+      verify = VERIFY_OFF;
+      break;
+    }
+    if(!unsupported(err)) break;
+    // fall through
+  case COPY_RANGE:
+    if(verify != VERIFY_FULL){
+      if((err = restart_copy(src_fd, dst_fd)) != 0) break;
+      if((err = copy_range(src_fd, dst_fd, info.st_size)) == 0 || !unsupported(err)) break;
+    }
+    // fall through
+  case COPY_SENDFILE:
+    if(verify != VERIFY_FULL){
+      if((err = restart_copy(src_fd, dst_fd)) != 0) break;
+      if((err = copy_sendfile(src_fd, dst_fd, info.st_size)) == 0 || !unsupported(err)) break;
+    }
+    // fall through
+  case COPY_BUFFERED:
+    if((err = restart_copy(src_fd, dst_fd)) != 0) break;
+    hashed = (verify == VERIFY_FULL);
+    err = copy_buffered(src_fd, dst_fd, info.st_size, (hashed)? &src_hash : NULL);
+    break;
+  }
+  if(err){
+    Log(std::string("Copy error: ") + strerror(err), 0);
+    metrics.copy_failures++;
+    return false;
+  }
+  metrics.bytes_copied += info.st_size;
+  if(metrics.enabled){
+    uint64_t copied = metrics_now();
+    metrics.copy_latency.observe(copied - start);
+    start = copied;
+  }
+  if(verify == VERIFY_OFF){
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+    return true;
+  }
+  // make sure the read back comes from the disk
+  if(fdatasync(dst_fd) == ERR){
+    Log(std::string("Copy error: ") + strerror(errno), 0);
+    metrics.copy_failures++;
+    return false;
+  }
+  posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+  bool match = false;
+  if(verify == VERIFY_FULL){
+    uint64_t dst_result = 0, src_result = 0;
+    err = hash_fd(dst_fd, options.hash, options.hash_threads, &dst_result);
+    if(!err && !hashed) err = hash_fd(src_fd, options.hash, options.hash_threads, &src_result);
+    if(hashed) src_result = src_hash.hash();
+    match = (src_result == dst_result);
+    std::stringstream ss;
+    ss << "SRC HASH: 0x" << std::hex << src_result << std::endl;
+    ss << "DST HASH: 0x" << std::hex << dst_result << std::endl;
+    Log(ss.str(),2);
+  }else{
+    err = sample_fds(src_fd, dst_fd, info.st_size, options.hash, &match);
+  }
+  if(metrics.enabled) metrics.verify_latency.observe(metrics_now() - start);
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+  posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+  if(err){
+    Log(std::string("Verify error: ") + strerror(err), 0);
+    metrics.copy_failures++;
+    return false;
+  }
+  if(!match){
+    Log("Copy does not match its source!", 0);
+    metrics.verify_failures++;
+  }
+  return match;
+}
+
+enum VerifyMode parse_verify_mode(const std::string &value){
+  if(value == "off") return VERIFY_OFF;
+  if(value == "sampled") return VERIFY_SAMPLED;
+  if(value == "full") return VERIFY_FULL;
+  return VERIFY_INVALID;
+}
+
+const char *verify_mode_name(enum VerifyMode mode){
+  switch(mode){
+  case VERIFY_OFF:
+    return "off";
+  case VERIFY_SAMPLED:
+    return "sampled";
+  case VERIFY_FULL:
+    return "full";
+  default:
+    return "invalid";
+  }
+}
+
+bool same_filesystem(const fs::path &a, const fs::path &b){
+  struct stat a_info, b_info;
+  return stat(a.c_str(), &a_info) == 0 && stat(b.c_str(), &b_info) == 0 && a_info.st_dev == b_info.st_dev;
+}
+
+enum CopyMethod probe_copy_method(const fs::path &src_dir, const fs::path &dst_dir){
+  if(same_filesystem(src_dir, dst_dir)) return COPY_RENAME;
+  enum CopyMethod method = COPY_BUFFERED;
+  std::string name = "/.autotier-probe." + std::to_string(getpid());
+  fs::path src_path = src_dir.string() + name, dst_path = dst_dir.string() + name;
+  int src_fd = open(src_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  int dst_fd = open(dst_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  char block[COPY_ALIGN];
+  memset(block, 0, sizeof(block));
+  if(src_fd != ERR && dst_fd != ERR && write(src_fd, block, sizeof(block)) == sizeof(block)){
+    off_t in = 0, out = 0;
+    if(copy_reflink(src_fd, dst_fd) == 0)
+      method = COPY_REFLINK;
+    else if(copy_file_range(src_fd, &in, dst_fd, &out, sizeof(block), 0) == sizeof(block))
+      method = COPY_RANGE;
+    else if(lseek(src_fd, 0, SEEK_SET) == 0 && sendfile(dst_fd, src_fd, NULL, sizeof(block)) == sizeof(block))
+      method = COPY_SENDFILE;
+  }
+  if(src_fd != ERR){
+    close(src_fd);
+    unlink(src_path.c_str());
+  }
+  if(dst_fd != ERR){
+    close(dst_fd);
+    unlink(dst_path.c_str());
+  }
+  return method;
+}
+
+const char *copy_method_name(enum CopyMethod method){
+  switch(method){
+  case COPY_RENAME:
+    return "rename";
+  case COPY_REFLINK:
+    return "reflink";
+  case COPY_RANGE:
+    return "copy_file_range";
+  case COPY_SENDFILE:
+    return "sendfile";
+  case COPY_UNPROBED:
+    return "a method probed on the first copy";
+  case COPY_BUFFERED:
+  default:
+    return "buffered";
+  }
+}
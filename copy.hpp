@@ -0,0 +1,69 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "hash.hpp"
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+#define COPY_BUFF_SZ (1 << 20) // also the O_DIRECT alignment granularity we rely on
+#define COPY_ALIGN 4096
+#define COPY_CHUNK_SZ (16 << 20) // in-kernel copies drop the pages behind them this often
+
+#define VERIFY_SAMPLES 16
+#define VERIFY_SAMPLE_SZ 65536
+
+enum CopyMethod{COPY_RENAME, COPY_REFLINK, COPY_RANGE, COPY_SENDFILE, COPY_BUFFERED, COPY_UNPROBED};
+
+/*
+ * How a copy is checked before the source is removed. FULL hashes the
+ * source while it is copied and reads the destination back once;
+ * SAMPLED compares VERIFY_SAMPLES chunks spread over both files.
+ */
+enum VerifyMode{VERIFY_OFF, VERIFY_SAMPLED, VERIFY_FULL, VERIFY_UNSET, VERIFY_INVALID};
+
+/*
+ * Cheapest way to get data from one tier to another, best first. Tiers
+ * on one filesystem are known to rename at config load; the others are
+ * COPY_UNPROBED until the first copy between them, since probing writes
+ * scratch files to both. At copy time a method that turns out not to
+ * work falls through to the next one.
+ */
+bool same_filesystem(const fs::path &a, const fs::path &b);
+enum CopyMethod probe_copy_method(const fs::path &src_dir, const fs::path &dst_dir);
+
+const char *copy_method_name(enum CopyMethod method);
+
+enum VerifyMode parse_verify_mode(const std::string &value);
+
+const char *verify_mode_name(enum VerifyMode mode);
+
+struct CopyOptions{
+  enum CopyMethod method;
+  enum VerifyMode verify;
+  enum HashAlgo hash;
+  int hash_threads; // files over TREE_CHUNK_SZ are read back on this many threads
+  int chunk_threads; // chunks of one resumable transfer copied at once
+};
+
+bool copy_data(int src_fd, int dst_fd, const CopyOptions &options);
+
+int sample_fds(int src_fd, int dst_fd, off_t size, enum HashAlgo algo, bool *match);
@@ -18,123 +18,500 @@
 */
 
 #include "crawl.hpp"
+#include "crawler.hpp"
 #include "config.hpp"
 #include "alert.hpp"
-#include "xxhash64.h"
-#include <iomanip>
+#include <cstring>
+#include <ctime>
 #include <regex>
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/statvfs.h>
 #include <utime.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <list>
 
 void TierEngine::begin(){
+  // bench/bench.cpp runs the same phases one at a time, keep them in step
   Log("autotier started.\n",1);
+  if(config.nodes > 1 && !lease.acquire(config.lease_dir, config.node, config.nodes)) return;
+  metrics.begin_run();
+  if(config.streaming){
+    stream();
+    Log("Tiering complete.\n",1);
+    return;
+  }
   launch_crawlers();
   sort();
   simulate_tier();
+  plan_moves();
   move_files();
+  write_xattrs();
+  update_index();
+  {
+    PhaseTimer timer(PHASE_XATTRS);
+    xattr_writer.wait();
+  }
+  save_metrics();
   Log("Tiering complete.\n",1);
 }
 
 void TierEngine::launch_crawlers(){
+  PhaseTimer timer(PHASE_CRAWL);
   Log("Gathering files.",2);
-  // get ordered list of files in each tier
-  for(std::vector<Tier>::iterator t = tiers.begin(); t != tiers.end(); ++t){
-    crawl(t->dir, &(*t));
+  // crawl all tiers at once, each worker gathers its own batch of files
+  fs::path index_path = config.index_segment(config.node);
+  if(!config.index_path.empty() && index.load(index_path)){
+    // a directory's entries there are only this node's as they were split then
+    if(index.split_as(config.node, config.nodes, config.split_depth())){
+      Log("Loaded metadata index " + index_path.string(), 2);
+    }else{
+      Log("Ignoring metadata index " + index_path.string() + ", written with a different NODE or NODE_DEPTH", 1);
+      index.unload();
+    }
+  }
+  Crawler crawler(&paths, config.num_threads, config.uring_depth, (config.index_path.empty())? NULL : &index);
+  crawler.set_partition(config.node, config.nodes, config.node_depth);
+  crawler.set_link_root(tiers.front().dir);
+  for(uint16_t t = 0; t < tiers.size(); t++){
+    crawler.push(tiers[t].dir, &tiers[t], t);
+  }
+  int64_t first_budget;
+  DemotedFiles demoted;
+  bool early = can_demote_early(first_budget);
+  if(early)
+    demote_while_crawling(crawler, first_budget, demoted);
+  else
+    crawler.launch();
+  uint32_t first = files.count();
+  crawler.collect(files, scanned);
+  for(uint32_t i = first; i < files.count(); i++)
+    metrics.files_crawled[files.tier[i]]++;
+  if(early)
+    settle_demoted(first, demoted);
+  else
+    count_accesses();
+}
+
+void TierEngine::count_accesses(){
+  // a file read since the last run has its top priority bit set
+  for(uint32_t i = 0; i < files.count(); i++)
+    if(files.priority[i] & TOP_PRIORITY_BIT)
+      files.heat[i] = heat_after_access(files.heat[i], files.atime[i], config.half_life);
+}
+
+int TierEngine::pinned_tier(const char *pin) const{
+  // a pin names its tier by id or by directory, anything else is not honored
+  if(!pin) return ERR;
+  for(size_t t = 0; t < tiers.size(); t++)
+    if(tiers[t].id == pin || tiers[t].dir.string() == pin) return t;
+  return ERR;
+}
+
+const char *TierEngine::pin_of(uint32_t i) const{
+  // a unit is pinned by the first of its files that is
+  uint32_t u = units.unit_of(i);
+  if(u == NO_UNIT) return files.pin_of(i);
+  const char *pin = NULL;
+  for(uint32_t k = units.first[u]; k < units.first[u + 1]; k++){
+    const char *p = files.pin_of(units.members[k]);
+    if(p && pinned_tier(p) != ERR) return p;
+    if(!pin) pin = p;
   }
+  return pin;
+}
+
+void TierEngine::find_units(){
+  units.clear();
+  weights.clear();
+  if(!config.placing_units()) return;
+  std::vector<bool> named;
+  for(const fs::path &d : config.unit_dirs){
+    uint32_t id = paths.add_path(d);
+    if(id >= named.size()) named.resize(id + 1, false);
+    named[id] = true;
+  }
+  std::vector<fs::path> tier_dirs;
+  for(const Tier &t : tiers)
+    tier_dirs.push_back(t.dir);
+  // a unit above the split between nodes would take other nodes' files with it
+  units.build(files, paths, named, config.unit_max_files, config.unit_max_size, tier_dirs,
+    (config.nodes > 1)? config.node_depth : 1);
+  if(units.empty()) return;
+  weights = files.alloc;
+  for(uint32_t u = 0; u < units.count(); u++)
+    weights[units.lead(u)] = units.alloc[u];
+  Log("Placing " + std::to_string(units.members.size()) + " files as " + std::to_string(units.count()) + " directories.",2);
 }
 
 void TierEngine::sort(){
-  Log("Sorting files.",2);
-  files.sort(
-    [](const File &a, const File &b){
-      return (a.priority == b.priority)? a.times.actime > b.times.actime : a.priority > b.priority;
+  /*
+   * Only builds the keys. simulate_tier orders as much of them as it
+   * needs to find each tier's boundary. Pinned files are not ranked,
+   * they go to their tier whatever their score. A unit gets one key,
+   * for its lead row.
+   */
+  PhaseTimer timer(PHASE_SORT);
+  Log("Ranking files.",2);
+  find_units();
+  order.clear();
+  order.reserve(files.count());
+  pinned.clear();
+  size_t unknown = 0;
+  for(uint32_t i = 0; i < files.count(); i++){
+    if(files.flags[i] & FILE_REMOVED) continue;
+    uint32_t u = units.unit_of(i);
+    if(u != NO_UNIT && units.lead(u) != i) continue;
+    if(!files.pins.empty()){
+      const char *pin = pin_of(i);
+      int t = pinned_tier(pin);
+      if(t != ERR){
+        pinned.emplace_back(i, t);
+        continue;
+      }
+      if(pin) unknown++;
     }
-  );
+    order.emplace_back(0, (u == NO_UNIT)? files.atime[i] : units.atime[u], i);
+  }
+  if(unknown) Log("Ignoring the pins of " + std::to_string(unknown) + " files, which name no tier.",1);
+  // demotions during the crawl must agree with the ranking they are part of
+  ranked_at = (demoted_at)? demoted_at : (sim_now)? sim_now : time(NULL);
+  demoted_at = 0;
+  rank(0, tiers.front().score_model);
 }
 
-void TierEngine::crawl(fs::path dir, Tier *tptr){
-  for(fs::directory_iterator itr{dir}; itr != fs::directory_iterator{}; *itr++){
-    if(is_directory(*itr)){
-      crawl(*itr, tptr);
-    }else if(!is_symlink(*itr) &&
-    !regex_match((*itr).path().filename().string(), std::regex("(^\\..*(\\.swp)$|^(\\.~lock\\.).*#$|^(~\\$))"))){
-      files.emplace_back(*itr, tptr);
-    }
+void TierEngine::rank(size_t first, enum ScoreModel model){
+  // rescores the files not placed yet for the tier about to take its share
+  for(size_t i = first; i < order.size(); i++){
+    uint32_t u = units.unit_of(order[i].index);
+    order[i].hi = ~((u == NO_UNIT)? file_score(model, files, order[i].index, config.half_life, ranked_at)
+      : units.score(model, files, u, config.half_life, ranked_at));
   }
 }
 
-void TierEngine::simulate_tier(){
+void TierEngine::measure_capacity(){
+  // the filesystems as they are now, and how much of them the crawled files take
+  capacity.probe(tiers);
+  for(uint32_t i = 0; i < files.count(); i++)
+    if(!(files.flags[i] & FILE_REMOVED)) capacity.count(files.tier[i], files.alloc[i]);
+  capacity.counted_all();
+}
+
+void TierEngine::simulate_tier(bool measure){
+  /*
+   * Same placement as walking the fully sorted list: each tier takes the
+   * hottest remaining files until the next one would reach its
+   * watermark, and that file opens the next tier. Files past the last
+   * tier's watermark are left where they are. A tier with a different
+   * SCORE than the one before it rescores what is left first.
+   *
+   * With MIN_WATERMARK below MAX_WATERMARK the cut is a band: files
+   * ranked above MIN_WATERMARK go to the tier, and files ranked between
+   * the two only stay if they are already there. The others are left
+   * for the next tier, so a file near the boundary does not flip tiers
+   * from one run to the next.
+   *
+   * Files are weighed by the space they take up, and a tier's share is
+   * what its watermark leaves once data that is not tiered is counted.
+   * Pinned files are taken out of their tier's share before any ranked
+   * file is. A unit is placed like a file as big as all of its files.
+   * A replayed trace passes measure false to keep the space as its
+   * earlier passes left it.
+   */
+  PhaseTimer timer(PHASE_PLACE);
   Log("Finding files' tiers.",2);
-  long tier_use = 0;
-  std::list<File>::iterator fptr = files.begin();
-  std::vector<Tier>::iterator tptr = tiers.begin();
-  tptr->watermark_bytes = tptr->set_capacity();
-  while(fptr != files.end()){
-    if(tier_use + fptr->size >= tptr->watermark_bytes){
-      tier_use = 0;
-      if(++tptr == tiers.end()) break;
-      tptr->watermark_bytes = tptr->set_capacity();
+  if(measure) measure_capacity();
+  const int64_t *weight = (weights.empty())? files.alloc.data() : weights.data();
+  auto resident = [this](uint32_t i, uint16_t t){
+    uint32_t u = units.unit_of(i);
+    return (u == NO_UNIT)? files.tier[i] == t : units.tier[u] == t;
+  };
+  auto settled = [this](uint32_t i, uint16_t t){
+    uint32_t u = units.unit_of(i);
+    if(u == NO_UNIT) return files.tier[i] == t && (files.flags[i] & FILE_LINKED);
+    return units.tier[u] == t && units.linked[u];
+  };
+  std::vector<int64_t> pinned_bytes(tiers.size(), 0);
+  for(const std::pair<uint32_t, uint16_t> &p : pinned){
+    pinned_bytes[p.second] += weight[p.first];
+    if(!settled(p.first, p.second))
+      tiers[p.second].incoming_files.push_back(p.first);
+  }
+  size_t placed = 0;
+  enum ScoreModel ranked = tiers.front().score_model;
+  for(std::vector<Tier>::iterator tptr = tiers.begin(); tptr != tiers.end() && placed < order.size(); ++tptr){
+    uint16_t t = tptr - tiers.begin();
+    tptr->watermark_bytes = capacity.limit(t, tptr->max_watermark);
+    int64_t budget = capacity.limit(t, tptr->min_watermark);
+    int64_t band = tptr->watermark_bytes - budget;
+    budget -= pinned_bytes[t];
+    if(pinned_bytes[t] > tptr->watermark_bytes)
+      Log("Files pinned to " + tptr->id + " take more than its watermark allows.",1);
+    size_t first = placed;
+    if(tptr != tiers.begin()){
+      // the file that overflowed the previous tier goes here regardless
+      budget -= weight[order[placed].index];
+      first++;
+    }
+    if(tptr->score_model != ranked){
+      rank(first, tptr->score_model);
+      ranked = tptr->score_model;
     }
-    tier_use += fptr->size;
-    /*
-     * TODO: only place file in incoming queue if destination tier != current tier
-     */
-    tptr->incoming_files.emplace_back(&(*fptr));
-    fptr++;
+    size_t cut = first;
+    if(budget > 0){
+      cut = weighted_cut(order.data(), first, order.size(), weight, budget);
+    }else if(first < order.size()){
+      // nothing fits, the hottest remaining file still has to come next
+      std::iter_swap(order.begin() + first, std::min_element(order.begin() + first, order.end()));
+    }
+    if(band > 0 && cut < order.size()){
+      for(size_t i = first; i < cut; i++)
+        budget -= weight[order[i].index];
+      size_t band_end = (budget + band > 0)? weighted_cut(order.data(), cut, order.size(), weight, budget + band) : cut;
+      std::vector<SortKey>::iterator stay = std::partition(order.begin() + cut, order.begin() + band_end,
+        [&resident, t](const SortKey &k){ return resident(k.index, t); }
+      );
+      // the hottest file passed over opens the next tier
+      if(stay != order.begin() + band_end)
+        std::iter_swap(stay, std::min_element(stay, order.begin() + band_end));
+      cut = stay - order.begin();
+    }
+    for(size_t i = placed; i < cut; i++){
+      uint32_t f = order[i].index;
+      if(!settled(f, t))
+        tptr->incoming_files.push_back(f);
+    }
+    placed = cut;
   }
 }
 
+void TierEngine::plan_moves(){
+  PhaseTimer timer(PHASE_PLAN);
+  plan.build(tiers, files, (units.empty())? NULL : &units);
+  if(config.move_budget || config.move_budget_files){
+    // promote the hottest files and demote the coldest first
+    std::vector<uint64_t> benefit;
+    benefit.reserve(plan.moves.size());
+    for(const Move &m : plan.moves){
+      // moves onto a file's pinned tier come before anything the ranking asks for
+      if(!files.pins.empty() && pinned_tier(pin_of(m.file)) == m.to){
+        benefit.push_back(UINT64_MAX);
+        continue;
+      }
+      uint32_t u = units.unit_of(m.file);
+      uint64_t score = (u == NO_UNIT)? file_score(tiers[m.to].score_model, files, m.file, config.half_life, ranked_at)
+        : units.score(tiers[m.to].score_model, files, u, config.half_life, ranked_at);
+      benefit.push_back((m.to < m.from)? score : ~score);
+    }
+    size_t held = plan.limit(files, benefit, config.move_budget, config.move_budget_files);
+    if(held) Log("Move budget holds " + std::to_string(held) + " moves back until the next run.",1);
+  }
+  Log("Planned " + std::to_string(plan.moves.size()) + " moves, " + std::to_string(plan.bytes(files)) + " bytes.",2);
+  if(!plan_path.empty() && plan.save(plan_path, tiers, files, paths))
+    Log("Move plan written to " + plan_path.string(),2);
+}
+
 void TierEngine::move_files(){
-  /*
-   * Currently, this starts at the lowest tier, assuming it has the most free space, and
-   * moves all incoming files from their current tiers before moving on to the next lowest
-   * tier. There should be a better way to shuffle all the files around to avoid over-filling
-   * a tier by doing them one at a time.
-   */
+  PhaseTimer timer(PHASE_MOVE);
   Log("Moving files.",2);
-  for(std::vector<Tier>::reverse_iterator titr = tiers.rbegin(); titr != tiers.rend(); titr++){
-    for(File * fptr : titr->incoming_files){
-      fptr->new_path = titr->dir/relative(fptr->old_path, fptr->old_tier->dir);
-      fptr->symlink_path = tiers.front().dir/relative(fptr->old_path, fptr->old_tier->dir);
-      /*
-       * TODO: handle cases where file already exists at destination (should not happen but could)
-       */
-      if(fptr->new_path != fptr->symlink_path){
-        fptr->move();
-        if(is_symlink(fptr->symlink_path)) remove(fptr->symlink_path);
-        create_symlink(fptr->new_path, fptr->symlink_path);
-      }else{ // moving to top tier
-        if(is_symlink(fptr->new_path)) remove(fptr->new_path);
-        fptr->move();
+  xattr_writer.wait();
+  Mover mover(tiers, config.move_threads, config.expedite_size, &capacity);
+  for(const Move &m : plan.moves){
+    // an interrupted transfer already holds the space it needs
+    struct stat part;
+    if(files.size[m.file] >= TRANSFER_MIN_SZ
+    && lstat(transfer_part_path(tiers[m.to].dir / files.relative_path(m.file, paths)).c_str(), &part) == 0)
+      capacity.credit(m.to, (int64_t)part.st_blocks * 512);
+  }
+  mover.run(plan, files, [this](const Move &m){ return (units.unit_of(m.file) == NO_UNIT)? move_file(m) : move_unit(m); });
+  links.close_dirs();
+  // staying put, only make sure they can be reached
+  std::vector<fs::path> tier_dirs;
+  for(const Tier &t : tiers)
+    tier_dirs.push_back(t.dir);
+  std::vector<uint32_t> file_links;
+  size_t made = 0;
+  for(uint32_t i : plan.links){
+    uint32_t u = units.unit_of(i);
+    if(u == NO_UNIT)
+      file_links.push_back(i);
+    else if(link_unit(u, files.tier[i]))
+      made++;
+  }
+  made += links.link_missing(files, file_links, tier_dirs);
+  if(made) Log("Linked " + std::to_string(made) + " files.",2);
+}
+
+enum CopyMethod TierEngine::copy_method(uint16_t from, uint16_t to){
+  // probed on the first copy between the two tiers, so runs that move nothing write nothing to them
+  std::lock_guard<std::mutex> guard(probe_lock);
+  enum CopyMethod &method = tiers[from].copy_to[to];
+  if(method == COPY_UNPROBED){
+    method = probe_copy_method(tiers[from].dir, tiers[to].dir);
+    Log("Copying from " + tiers[from].id + " to " + tiers[to].id + " with " + copy_method_name(method), 2);
+  }
+  return method;
+}
+
+bool TierEngine::move_file(const Move &m){
+  // called from the mover's threads, each with a different row
+  fs::path rel = files.relative_path(m.file, paths);
+  CopyOptions copy = {copy_method(m.from, m.to), tiers[m.to].verify_mode, (enum HashAlgo)config.hash_algo, config.num_threads,
+    (tiers[m.to].move_threads > 0)? tiers[m.to].move_threads : config.move_threads};
+  File f(tiers[m.from].dir/rel, tiers[m.to].dir/rel, files.atime[m.file], files.mtime[m.file], copy);
+  if(mounted && !mounted->claim(rel.string())){
+    Log("Not moving " + f.old_path.string() + ", it is open through " + mount_path.string(), 2);
+    return false;
+  }
+  try{
+    // a file already at the destination is left alone and the move fails, see rename_copy
+    if(m.to != 0){
+      // a copy out of the first tier stays there until its link is renamed over it
+      f.keep_source = (m.from == 0);
+      if(f.move()){
+        files.tier[m.file] = m.to;
+        files.flags[m.file] |= FILE_META_DIRTY; // a copy does not carry the xattr
+        if(links.link(files.dir[m.file], files.name_of(m.file), f.new_path, m.from == 0 || (files.flags[m.file] & FILE_LINKED)))
+          files.flags[m.file] |= FILE_LINKED;
+        else
+          files.flags[m.file] &= ~FILE_LINKED; // linked at the next run
+        if(f.keep_source && !(files.flags[m.file] & FILE_LINKED))
+          remove(f.old_path);
+      }
+    }else{ // moving to top tier, the file is renamed over its link
+      f.over_link = true;
+      if(f.move()){
+        files.tier[m.file] = m.to;
+        files.flags[m.file] |= FILE_LINKED | FILE_META_DIRTY;
       }
     }
+  }catch(const fs::filesystem_error &e){
+    Log(std::string("Error moving file: ") + e.what(), 0);
+  }
+  bool moved = files.tier[m.file] == m.to;
+  if(mounted){
+    if(moved) mounted->placed(rel.string(), m.to);
+    mounted->release(rel.string());
+  }
+  metrics.moved(m.from, m.to, files.size[m.file], moved);
+  return moved;
+}
+
+void TierEngine::write_xattrs(){
+  /*
+   * Persist priorities where each file ended up, skipping files whose
+   * xattr already holds the same values. The writes are left to the
+   * background writer; move_files waits for it before touching paths.
+   */
+  PhaseTimer timer(PHASE_XATTRS);
+  std::vector<XattrWriter::Record> batch;
+  size_t queued = 0;
+  for(uint32_t i = 0; i < files.count(); i++){
+    if((files.flags[i] & (FILE_REMOVED | FILE_META_DIRTY)) != FILE_META_DIRTY) continue;
+    batch.push_back(XattrWriter::Record{file_path(i).string(), files.packed_meta(i), (files.flags[i] & FILE_LEGACY_META) != 0});
+    files.flags[i] &= ~(FILE_META_DIRTY | FILE_LEGACY_META);
+    if(batch.size() == META_BATCH_SZ){
+      queued += batch.size();
+      xattr_writer.submit(batch);
+    }
   }
+  queued += batch.size();
+  if(!batch.empty()) xattr_writer.submit(batch);
+  Log("Writing xattrs of " + std::to_string(queued) + " of " + std::to_string(files.count()) + " files.",2);
+}
+
+void TierEngine::update_index(){
+  if(config.index_path.empty()) return;
+  PhaseTimer timer(PHASE_INDEX);
+  Log("Updating metadata index.",2);
+  index.unload();
+  // only this node writes its segment, and only while it holds its lease
+  MetaIndex::save(config.index_segment(config.node), scanned, tiers, files, config.node, config.nodes, config.split_depth());
+  scanned.clear();
+}
+
+void TierEngine::save_metrics(){
+  // counts the pass and writes every series, for the textfile collector to pick up
+  metrics.runs++;
+  for(uint64_t &n : metrics.files)
+    n = 0;
+  for(uint32_t i = 0; i < files.count(); i++)
+    if(!(files.flags[i] & FILE_REMOVED)) metrics.files[files.tier[i]]++;
+  if(!config.metrics_path.empty() && metrics.save(config.metrics_path))
+    Log("Metrics written to " + config.metrics_path.string(),2);
 }
 
-void File::move(){
-  if(old_path == new_path) return;
-  if(!is_directory(new_path.parent_path()))
-    create_directories(new_path.parent_path());
-  Log("Copying " + old_path.string() + " to " + new_path.string(),2);
-  copy_file(old_path, new_path); // move item to slow tier
+bool File::move(){
+  if(old_path == new_path) return true;
+  // movers in other threads may be creating the same directories, which only fails the one that loses
+  fs::path dir = new_path.parent_path();
+  boost::system::error_code ec, made;
+  for(int tries = 0; tries < 2 && !is_directory(dir, ec); tries++)
+    create_directories(dir, made);
+  if(!is_directory(dir, ec)){
+    Log("Cannot create " + dir.string() + ": " + made.message(),0);
+    return false;
+  }
+  if(copy.method == COPY_RENAME){
+    if(rename_copy(old_path, old_path, new_path, over_link)){
+      Log("Renamed " + old_path.string() + " to " + new_path.string(),2);
+      return true;
+    }
+    if(errno != EXDEV){
+      Log("Rename failed: " + old_path.string() + ": " + strerror(errno),0);
+      return false;
+    }
+  }
+  Log("Copying " + old_path.string() + " to " + new_path.string() + " (" + copy_method_name(copy.method) + ")",2);
+  struct stat info;
+  if(lstat(old_path.c_str(), &info) == 0 && info.st_size >= TRANSFER_MIN_SZ){
+    if(!copy_resumable(old_path, new_path, copy, over_link)){
+      Log("Copy failed!",0);
+      return false;
+    }
+  }else if(!copy_whole(old_path, new_path)){
+    return false;
+  }
+  Log("Copy succeeded.",2);
   copy_ownership_and_perms(old_path, new_path);
-  if(verify_copy(old_path, new_path)){
-    Log("Copy succeeded.",2);
-    remove(old_path);
-  }else{
+  if(!keep_source) remove(old_path);
+  utime(new_path.c_str(), &times); // overwrite mtime and atime with previous times
+  return true;
+}
+
+bool File::copy_whole(const fs::path &src, const fs::path &dst){
+  // copied under the partial name and renamed into place, replacing only the link a promotion lands on
+  fs::path part = transfer_part_path(dst);
+  if(!copy_target_free(src, dst, over_link)){
+    Log("Cannot copy to " + dst.string() + ": " + strerror(errno),0);
+    return false;
+  }
+  int src_fd = open(src.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if(src_fd == ERR){
+    Log("Cannot open " + src.string() + ": " + strerror(errno),0);
+    return false;
+  }
+  unlink(part.c_str()); // too small to have been resumable, nothing in it is worth keeping
+  int dst_fd = open(part.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if(dst_fd == ERR){
+    Log("Cannot create " + part.string() + ": " + strerror(errno),0);
+    close(src_fd);
+    return false;
+  }
+  bool copied = copy_data(src_fd, dst_fd, copy); // move item to slow tier
+  close(src_fd);
+  if(close(dst_fd) == ERR) copied = false;
+  if(copied && !rename_copy(part, src, dst, over_link)){
+    Log("Cannot rename " + part.string() + ": " + strerror(errno),0);
+    copied = false;
+  }
+  if(!copied){
     Log("Copy failed!",0);
-    /*
-     * TODO: put in place protocol for what to do when this happens
-     */
+    unlink(part.c_str()); // the source is still intact
+    return false;
   }
-  utime(new_path.c_str(), &times); // overwrite mtime and atime with previous times
+  return true;
 }
 
 void copy_ownership_and_perms(const fs::path &src, const fs::path &dst){
@@ -144,46 +521,6 @@ void copy_ownership_and_perms(const fs::path &src, const fs::path &dst){
   chmod(dst.c_str(), info.st_mode);
 }
 
-bool verify_copy(const fs::path &src, const fs::path &dst){
-  /*
-   * TODO: more efficient error checking than this? Also make
-   * optional in global configuration?
-   */
-  int bytes_read;
-  char *src_buffer = new char[4096];
-  char *dst_buffer = new char[4096];
-  
-  int srcf = open(src.c_str(),O_RDONLY);
-  int dstf = open(dst.c_str(),O_RDONLY);
-  
-  XXHash64 src_hash(0);
-  XXHash64 dst_hash(0);
-  
-  while((bytes_read = read(srcf,src_buffer,sizeof(char[4096]))) > 0){
-    src_hash.add(src_buffer,bytes_read);
-  }
-  while((bytes_read = read(dstf,dst_buffer,sizeof(char[4096]))) > 0){
-    dst_hash.add(dst_buffer,bytes_read);
-  }
-  
-  close(srcf);
-  close(dstf);
-  delete [] src_buffer;
-  delete [] dst_buffer;
-  
-  uint64_t src_result = src_hash.hash();
-  uint64_t dst_result = dst_hash.hash();
-  
-  std::stringstream ss;
-  
-  ss << "SRC HASH: 0x" << std::hex << src_result << std::endl;
-  ss << "DST HASH: 0x" << std::hex << dst_result << std::endl;
-  
-  Log(ss.str(),2);
-  
-  return (src_result == dst_result);
-}
-
 struct utimbuf last_times(const fs::path &file){
   struct stat info;
   stat(file.c_str(), &info);
@@ -192,14 +529,3 @@ struct utimbuf last_times(const fs::path &file){
   times.modtime = info.st_mtime;
   return times;
 }
-
-long Tier::set_capacity(){
-  /*
-   * Returns maximum number of bytes to
-   * place in a tier (Total size * watermark%)
-   */
-  struct statvfs fs_stats;
-  if((statvfs(dir.c_str(), &fs_stats) == -1))
-    return -1;
-  return (fs_stats.f_blocks * fs_stats.f_bsize * watermark) / 100;
-}
@@ -21,6 +21,7 @@
 
 #include <boost/filesystem.hpp>
 #include <utime.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -29,122 +30,178 @@ namespace fs = boost::filesystem;
 
 #include "alert.hpp"
 #include "config.hpp"
+#include "exclude.hpp"
+#include "index.hpp"
+#include "filetable.hpp"
+#include "radix.hpp"
+#include "plan.hpp"
+#include "mover.hpp"
+#include "copy.hpp"
+#include "transfer.hpp"
+#include "xattr.hpp"
+#include "score.hpp"
+#include "metrics.hpp"
+#include "links.hpp"
+#include "unionfs.hpp"
+#include "stream.hpp"
+#include "capacity.hpp"
+#include "units.hpp"
+#include "cluster.hpp"
 
 #define BUFF_SZ 4096
 
 class Config; // forward declaration
+class Crawler;
+
+// first tier files demoted during the crawl, by dir id and name, and whether they were linked
+typedef std::unordered_map<std::string, bool> DemotedFiles;
 
 class File{
+  /*
+   * A single file on its way between tiers. The file's metadata lives
+   * in the FileTable; this only carries what the copy needs.
+   */
 public:
-  unsigned long priority;
-  long last_atime;
-  long size;
-  Tier *old_tier;
   struct utimbuf times;
-  fs::path symlink_path;
   fs::path old_path;
   fs::path new_path;
-  fs::path pinned_to;
-  void write_xattrs(){
-    if(setxattr(new_path.c_str(),"user.autotier_last_atime",&last_atime,sizeof(last_atime),0)==ERR)
-      error(SETX);
-    if(setxattr(new_path.c_str(),"user.autotier_priority",&priority,sizeof(priority),0)==ERR)
-      error(SETX);
-    if(setxattr(new_path.c_str(),"user.autotier_pin",pinned_to.c_str(),strlen(pinned_to.c_str()),0)==ERR)
-      error(SETX);
-  }
-  void move(void);
-  File(fs::path path_, Tier *tptr){
-    char strbuff[BUFF_SZ];
-    ssize_t attr_len;
-    old_path = path_;
-    old_tier = tptr;
-    struct stat info;
-    stat(old_path.c_str(), &info);
-    size = (long)info.st_size;
-    times.actime = info.st_atime;
-    times.modtime = info.st_mtime;
-    if((attr_len = getxattr(old_path.c_str(),"user.autotier_pin",strbuff,sizeof(strbuff))) != ERR){
-      strbuff[attr_len] = '\0'; // c-string
-      pinned_to = fs::path(strbuff);
-    }
-    if(getxattr(old_path.c_str(),"user.autotier_last_atime",&last_atime,sizeof(last_atime)) <= 0){
-      last_atime = times.actime;
-    }
-    if(getxattr(old_path.c_str(),"user.autotier_priority",&priority,sizeof(priority)) <= 0){
-      priority = (unsigned long)0x01 << (sizeof(unsigned long)*8 - 1);
-    }else{
-      // age
-      priority = priority >> 1;
-      if(times.actime > last_atime){
-        priority |= ((unsigned long)0x01 << (sizeof(unsigned long)*8 - 1));
-      }
-    }
-    last_atime = times.actime;
-  }
-  File(const File &rhs) {
-    priority = rhs.priority;
-    last_atime = rhs.last_atime;
-    size = rhs.size;
-    times.modtime = rhs.times.modtime;
-    times.actime = rhs.times.actime;
-    symlink_path = rhs.symlink_path;
-    old_path = rhs.old_path;
-    new_path = rhs.new_path;
-    pinned_to = rhs.pinned_to;
-  }
-  ~File(){
-    write_xattrs();
-  }
-  File &operator=(const File &rhs){
-    priority = rhs.priority;
-    last_atime = rhs.last_atime;
-    size = rhs.size;
-    times.modtime = rhs.times.modtime;
-    times.actime = rhs.times.actime;
-    symlink_path = rhs.symlink_path;
-    old_path = rhs.old_path;
-    new_path = rhs.new_path;
-    pinned_to = rhs.pinned_to;
-    return *this;
+  CopyOptions copy;
+  bool keep_source; // after a copy, old_path is left for the caller to replace with a link
+  bool over_link; // a promotion, new_path may be the first tier's link to old_path
+  File(const fs::path &old_path_, const fs::path &new_path_, int64_t atime, int64_t mtime, const CopyOptions &copy_){
+    old_path = old_path_;
+    new_path = new_path_;
+    times.actime = atime;
+    times.modtime = mtime;
+    copy = copy_;
+    keep_source = false;
+    over_link = false;
   }
+  bool move(void);
+  bool copy_whole(const fs::path &src, const fs::path &dst);
 };
 
 class Tier{
 public:
-  long watermark_bytes;
+  int64_t watermark_bytes; // crawled files' bytes the tier holds at MAX_WATERMARK, as of the last placement
   int watermark;
+  int min_watermark; // files are only promoted into the tier below this
+  int max_watermark; // files already in the tier stay until this
   fs::path dir;
   std::string id;
-  std::list<File *> incoming_files;
+  std::vector<uint32_t> incoming_files; // FileTable rows to move here or link
+  ExcludeMatcher exclude;
+  bool io_uring;
+  int shared; // SHARED, 1 if other nodes fill the tier's filesystem too, ERR until detected
+  int move_threads; // concurrent moves on this tier's device, 0 for the global setting
+  int io_priority; // IO_PRIORITY of moves to or from this tier, see IoPriority
+  std::vector<enum CopyMethod> copy_to; // by destination tier, see TierEngine::copy_method
+  enum VerifyMode verify_mode; // for copies into this tier
+  enum ScoreModel score_model; // ranks the files this tier takes
   Tier(std::string id_){
     id = id_;
+    watermark = min_watermark = max_watermark = DISABLED;
+    io_uring = false;
+    shared = ERR;
+    move_threads = 0;
+    io_priority = IO_PRIORITY_UNSET;
+    verify_mode = VERIFY_UNSET;
+    score_model = SCORE_UNSET;
   }
-  long set_capacity();
 };
 
 class TierEngine{
 private:
   std::vector<Tier> tiers;
-  std::list<File> files;
+  PathPool paths;
+  FileTable files;
+  std::vector<SortKey> order; // files rows, hottest first
+  std::vector<std::pair<uint32_t, uint16_t>> pinned; // files rows left out of order, and the tier each is pinned to
+  PlacementUnits units;
+  std::vector<int64_t> weights; // files.alloc, except that a unit's lead row weighs the whole unit; empty without units
+  int64_t ranked_at; // the time scores in order were computed for
+  int64_t demoted_at; // scores used for demotions during the crawl, 0 if there were none
+  int64_t sim_now; // clock of a replayed access trace, 0 for the real one
+  bool dry_run; // --simulate, nothing is moved or written
+  MovePlan plan;
+  fs::path plan_path;
+  std::vector<ScannedDir> scanned;
+  MetaIndex index;
+  XattrWriter xattr_writer;
+  LinkFarm links;
+  Capacity capacity;
+  fs::path mount_path;
+  UnionFS *mounted; // only while the daemon runs with --mount
+  std::mutex probe_lock; // movers probing copy_to
+  NodeLease lease; // with NODE set, held while this node tiers its share
   Config config;
 public:
-  TierEngine(const fs::path &config_path){
+  TierEngine(const fs::path &config_path) : links(&paths){
+    mounted = NULL;
+    capacity.share(&lease);
+    demoted_at = 0;
+    sim_now = 0;
+    dry_run = false;
     config.load(config_path, tiers);
     log_lvl = config.log_lvl;
+    if(!tiers.empty()) links.set_root(tiers.front().dir);
+    std::vector<std::string> ids;
+    for(const Tier &t : tiers)
+      ids.push_back(t.id);
+    metrics.init(ids, !config.metrics_path.empty());
   }
   void begin(void);
   void launch_crawlers(void);
-  void crawl(fs::path dir, Tier *tptr);
+  bool can_demote_early(int64_t &first_budget);
+  void demote_while_crawling(Crawler &crawler, int64_t first_budget, DemotedFiles &demoted);
+  bool move_early(const std::string &rel, int64_t atime, int64_t mtime, bool &linked);
+  void settle_demoted(uint32_t first, const DemotedFiles &demoted);
+  void count_accesses(void);
+  int pinned_tier(const char *pin) const;
+  const char *pin_of(uint32_t i) const;
+  void find_units(void);
   void sort(void);
-  void simulate_tier(void);
+  void rank(size_t first, enum ScoreModel model);
+  void measure_capacity(void);
+  void simulate_tier(bool measure = true);
+  void plan_moves(void);
   void move_files(void);
+  enum CopyMethod copy_method(uint16_t from, uint16_t to);
+  bool move_file(const Move &m);
+  bool move_unit(const Move &m);
+  bool rename_unit(uint32_t u, const Move &m);
+  bool link_unit(uint32_t u, uint16_t t);
+  bool unlink_unit(uint32_t u);
+  void write_xattrs(void);
+  void update_index(void);
+  void save_metrics(void);
+  void stream(void);
+  void stream_cuts(std::vector<std::vector<int64_t>> &bytes, const std::vector<int64_t> &pinned_bytes, std::vector<StreamCut> &cuts);
+  bool link_streamed(const std::string &rel, const fs::path &target, bool replace);
+  bool move_spooled(const MoveSpool::Record &r);
+  void run_spool(MoveSpool &spool, std::atomic<int64_t> &budget_bytes, std::atomic<long> &budget_files, std::atomic<size_t> &held);
+  fs::path file_path(uint32_t i) const{
+    return tiers[files.tier[i]].dir / files.relative_path(i, paths);
+  }
+  void save_plan_to(const fs::path &path){ plan_path = path; }
+  void mount_at(const fs::path &path){ mount_path = path; }
+  const FileTable &file_table(void) const{ return files; }
+  const MovePlan &move_plan(void) const{ return plan; }
+  void wait_for_xattrs(void){ xattr_writer.wait(); }
+  bool pin(const fs::path &target, const char *tier_name);
+  void list_pins(void);
+  bool files_from_index(const fs::path &path);
+  void simulate_pass(bool measure, std::vector<int64_t> &bytes, std::vector<size_t> &moved);
+  void simulate(const fs::path &trace_path, const fs::path &index_path);
+  void retier(void);
+  void forget_missing(void);
+  void run_daemon(void);
   //void dump_tiers(void);
 };
 
 void copy_ownership_and_perms(const fs::path &src, const fs::path &dst);
 
-bool verify_copy(const fs::path &src, const fs::path &dst);
+bool tier_relative(const std::vector<Tier> &tiers, const fs::path &target, fs::path &rel);
 
 void destroy_tiers(void);
 
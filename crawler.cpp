@@ -0,0 +1,388 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "crawler.hpp"
+#include "crawl.hpp"
+#include "alert.hpp"
+#include "cluster.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct linux_dirent64{
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+DirReader::DirReader(const char *path){
+  buff_len = buff_pos = 0;
+  dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+DirReader::~DirReader(){
+  if(dir_fd != ERR) close(dir_fd);
+}
+
+bool DirReader::next(const char *&name, unsigned char &type, uint64_t &ino){
+  if(dir_fd == ERR) return false;
+  for(;;){
+    if(buff_pos >= buff_len){
+      buff_len = syscall(SYS_getdents64, dir_fd, buff, sizeof(buff));
+      buff_pos = 0;
+      if(buff_len <= 0) return false;
+    }
+    struct linux_dirent64 *ent = (struct linux_dirent64 *)(buff + buff_pos);
+    buff_pos += ent->d_reclen;
+    if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    name = ent->d_name;
+    type = ent->d_type;
+    ino = ent->d_ino;
+    if(type == DT_UNKNOWN){
+      struct stat info;
+      if(fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) == ERR) continue;
+      type = IFTODT(info.st_mode);
+    }
+    return true;
+  }
+}
+
+Crawler::Crawler(PathPool *paths_, size_t num_threads, unsigned uring_depth_, const MetaIndex *index_)
+: workers((num_threads)? num_threads : 1){
+  paths = paths_;
+  pending = 0;
+  next_seed = 0;
+  uring_depth = uring_depth_;
+  index = index_;
+  node = 0;
+  nodes = 1;
+  node_depth = DEFAULT_NODE_DEPTH;
+}
+
+bool Crawler::owned(const CrawlJob &job, const char *name, bool is_dir) const{
+  // below the split everything goes with the entry it is under, which was already checked
+  if(nodes < 2 || job.depth >= node_depth) return true;
+  if(is_dir && job.depth + 1u < node_depth) return true;
+  std::string rel = job.dir.string().substr(job.tptr->dir.string().length());
+  return node_owns(fs::path(rel).relative_path() / name, node, nodes, node_depth);
+}
+
+void Crawler::push(const fs::path &dir, Tier *tptr, uint16_t tier, uint32_t dir_id){
+  // spread the tier roots over the workers so tiers are crawled at once
+  uint16_t depth = 0;
+  fs::path rel = fs::path(dir.string().substr(tptr->dir.string().length())).relative_path();
+  for(fs::path::const_iterator c = rel.begin(); c != rel.end(); ++c)
+    depth++;
+  enqueue(next_seed++ % workers.size(), CrawlJob{dir, tptr, tier, dir_id, depth});
+}
+
+void Crawler::enqueue(size_t id, const CrawlJob &job){
+  pending++;
+  {
+    std::lock_guard<std::mutex> guard(workers[id].lock);
+    workers[id].queue.push_back(job);
+  }
+  idle_cv.notify_one();
+}
+
+void Crawler::enqueue_child(size_t id, const CrawlJob &parent, const char *name){
+  enqueue(id, CrawlJob{parent.dir / name, parent.tptr, parent.tier, paths->add(parent.dir_id, name), (uint16_t)(parent.depth + 1)});
+}
+
+void Crawler::launch(){
+  std::vector<std::thread> threads;
+  for(size_t id = 1; id < workers.size(); id++)
+    threads.emplace_back(&Crawler::run, this, id);
+  run(0);
+  for(std::thread &t : threads)
+    t.join();
+}
+
+void Crawler::collect(FileTable &files, std::vector<ScannedDir> &scanned){
+  for(Worker &w : workers){
+    uint32_t base = files.count();
+    for(ScannedDir &d : w.scanned)
+      for(ScannedEntry &e : d.entries)
+        if(e.file != NO_FILE) e.file += base;
+    files.append(w.files);
+    scanned.insert(scanned.end(), w.scanned.begin(), w.scanned.end());
+    w.scanned.clear();
+  }
+}
+
+bool Crawler::next_job(size_t id, CrawlJob &job){
+  {
+    std::lock_guard<std::mutex> guard(workers[id].lock);
+    if(!workers[id].queue.empty()){
+      job = workers[id].queue.back();
+      workers[id].queue.pop_back();
+      return true;
+    }
+  }
+  for(size_t i = 1; i < workers.size(); i++){
+    Worker &victim = workers[(id + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if(!victim.queue.empty()){
+      job = victim.queue.front();
+      victim.queue.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void Crawler::run(size_t id){
+  CrawlJob job;
+  while(pending > 0){
+    if(next_job(id, job)){
+      scan(id, job);
+      if(--pending == 0) idle_cv.notify_all();
+    }else{
+      std::unique_lock<std::mutex> guard(idle_lock);
+      idle_cv.wait_for(guard, std::chrono::milliseconds(1));
+    }
+  }
+}
+
+void Crawler::scan(size_t id, const CrawlJob &job){
+  uint32_t first = workers[id].files.count();
+  scan_dir(id, job);
+  if(sink && workers[id].files.count() > first) sink(workers[id].files, first, job);
+}
+
+void Crawler::scan_dir(size_t id, const CrawlJob &job){
+  /*
+   * Symlinks are never followed, and only regular files are queued:
+   * the symlinks in the first tier point at files this crawl already
+   * finds in their real tier.
+   */
+  DirReader dir(job.dir.c_str());
+  struct stat dir_info;
+  if(dir.fd() == ERR || fstat(dir.fd(), &dir_info) == ERR){
+    Log("Error crawling: cannot open " + job.dir.string() + ": " + strerror(errno), 0);
+    return;
+  }
+  ScannedDir *record = NULL;
+  const IndexDir *idir = NULL;
+  if(index){
+    workers[id].scanned.push_back(ScannedDir{(uint64_t)dir_info.st_dev, (uint64_t)dir_info.st_ino,
+      dir_info.st_mtim.tv_sec, dir_info.st_mtim.tv_nsec, job.dir, job.tptr, std::vector<ScannedEntry>()});
+    record = &workers[id].scanned.back();
+    // an entry made after the listing but within the mtime's granularity would not change it
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if((now.tv_sec - dir_info.st_mtim.tv_sec) * 1000000000LL + (now.tv_nsec - dir_info.st_mtim.tv_nsec) < INDEX_RACY_NS)
+      record->mtime_sec = record->mtime_nsec = INDEX_STALE_MTIME;
+    idir = index->find_dir(dir_info.st_dev, dir_info.st_ino);
+    if(idir && idir->mtime_sec == dir_info.st_mtim.tv_sec && idir->mtime_nsec == dir_info.st_mtim.tv_nsec){
+      scan_indexed(id, job, dir.fd(), idir, record);
+      return;
+    }
+  }
+  const char *name;
+  unsigned char type;
+  uint64_t ino;
+  std::vector<std::string> batch;
+  std::vector<uint64_t> batch_inos;
+  bool batched = job.tptr->io_uring && get_ring(id);
+  while(dir.next(name, type, ino)){
+    if(!owned(job, name, type == DT_DIR)) continue;
+    if(type == DT_DIR){
+      enqueue_child(id, job, name);
+      if(record) record->entries.push_back(ScannedEntry{name, ino, NO_FILE});
+    }else if(type == DT_REG && !job.tptr->exclude.match(name)){
+      const IndexEntry *entry = (idir)? index->find_entry(idir, ino) : NULL;
+      // a known inode in a changed directory still takes its xattrs from the index
+      uint32_t row = (entry && entry->type == INDEX_ENTRY_FILE)? load_indexed(id, job, dir.fd(), name, entry) : NO_FILE;
+      if(row == NO_FILE){
+        if(batched){
+          batch.emplace_back(name);
+          batch_inos.push_back(ino);
+          continue;
+        }
+        row = workers[id].files.load(dir.fd(), name, job.dir_id, job.tier);
+      }
+      if(record) record->entries.push_back(ScannedEntry{name, ino, row});
+    }
+  }
+  if(!batch.empty()) scan_batch(id, job, dir.fd(), batch, batch_inos, record);
+}
+
+void Crawler::scan_indexed(size_t id, const CrawlJob &job, int dirfd, const IndexDir *idir, ScannedDir *record){
+  /*
+   * The directory's entries are unchanged since the last run, so its
+   * listing and the files' xattrs come from the index. Each file costs a
+   * single fstatat, which is still needed to see atime and size changes.
+   */
+  for(const IndexEntry *entry = index->dir_begin(idir); entry != index->dir_end(idir); entry++){
+    const char *name = index->string(entry->name);
+    if(!name || !owned(job, name, entry->type == INDEX_ENTRY_DIR)) continue;
+    if(entry->type == INDEX_ENTRY_DIR){
+      enqueue_child(id, job, name);
+      record->entries.push_back(ScannedEntry{name, entry->ino, NO_FILE});
+    }else if(!job.tptr->exclude.match(name)){
+      uint32_t row = load_indexed(id, job, dirfd, name, entry);
+      if(row == NO_FILE)
+        row = workers[id].files.load(dirfd, name, job.dir_id, job.tier);
+      record->entries.push_back(ScannedEntry{name, entry->ino, row});
+    }
+  }
+}
+
+uint32_t Crawler::load_indexed(size_t id, const CrawlJob &job, int dirfd, const char *name, const IndexEntry *entry){
+  struct stat info;
+  if(fstatat(dirfd, name, &info, AT_SYMLINK_NOFOLLOW) == ERR) return NO_FILE;
+  if((uint64_t)info.st_ino != entry->ino || !S_ISREG(info.st_mode)) return NO_FILE;
+  int64_t last_atime = entry->last_atime;
+  uint64_t priority = entry->priority;
+  double heat = entry->heat;
+  uint32_t row = workers[id].files.add(job.dir_id, name, job.tier, info, index->string(entry->pin), &last_atime, &priority, &heat);
+  // a previous run placed it, but its link may have been deleted since
+  struct stat link;
+  if(job.tier == 0 || (!link_root.empty()
+  && lstat((link_root / job.dir.string().substr(job.tptr->dir.string().length()) / name).c_str(), &link) == 0
+  && S_ISLNK(link.st_mode)))
+    workers[id].files.flags[row] |= FILE_LINKED;
+  return row;
+}
+
+MetaRing *Crawler::get_ring(size_t id){
+  Worker &w = workers[id];
+  if(!w.ring_tried){
+    w.ring_tried = true;
+    w.ring.reset(new MetaRing(uring_depth));
+    if(!w.ring->ok()){
+      Log("io_uring statx unavailable, using synchronous metadata calls.", 2);
+      w.ring.reset();
+    }else{
+      size_t ops = (w.ring->can_getxattr())? 2 : 1;
+      w.slots.resize(std::max<size_t>(1, w.ring->queue_depth() / ops));
+    }
+  }
+  return w.ring.get();
+}
+
+void Crawler::scan_batch(size_t id, const CrawlJob &job, int dirfd, const std::vector<std::string> &names,
+const std::vector<uint64_t> &inos, ScannedDir *record){
+  /*
+   * Keeps up to queue_depth() requests in flight for this directory,
+   * refilling each slot as soon as its file's results are all in.
+   */
+  Worker &w = workers[id];
+  MetaRing &ring = *w.ring;
+  bool async_xattrs = ring.can_getxattr();
+  size_t next = 0, active = 0;
+  
+  auto fill = [&](size_t slot_id){
+    // entries the ring has no room for are read synchronously
+    MetaSlot &slot = w.slots[slot_id];
+    uint64_t tag = (uint64_t)slot_id << 1;
+    for(; next < names.size(); next++){
+      slot.path = job.dir / names[next];
+      slot.ino = inos[next];
+      slot.name = names[next].c_str();
+      slot.stx_res = slot.meta_res = -ENODATA;
+      slot.meta_sync = !async_xattrs;
+      if(!ring.queue_statx(dirfd, slot.name, &slot.stx, tag)){
+        uint32_t row = w.files.load(dirfd, slot.name, job.dir_id, job.tier);
+        if(record) record->entries.push_back(ScannedEntry{names[next], inos[next], row});
+        continue;
+      }
+      slot.outstanding = 1;
+      if(async_xattrs && ring.queue_getxattr(slot.path.c_str(), META_XATTR, slot.meta, sizeof(slot.meta), tag | 1))
+        slot.outstanding++;
+      else
+        slot.meta_sync = true;
+      next++;
+      active++;
+      return;
+    }
+    slot.name = NULL;
+  };
+  
+  for(size_t slot_id = 0; slot_id < w.slots.size() && next < names.size(); slot_id++)
+    fill(slot_id);
+  while(active){
+    if(ring.submit_and_wait(1) < 0){
+      Log(std::string("io_uring failed, using synchronous metadata calls: ") + strerror(errno), 0);
+      // what was submitted must be done with the slots before they are read again
+      ring.drain();
+      w.ring.reset();
+      for(MetaSlot &slot : w.slots){
+        if(slot.outstanding > 0 && slot.name){
+          uint32_t row = w.files.load(dirfd, slot.name, job.dir_id, job.tier);
+          if(record) record->entries.push_back(ScannedEntry{slot.name, slot.ino, row});
+        }
+      }
+      for(; next < names.size(); next++){
+        uint32_t row = w.files.load(dirfd, names[next].c_str(), job.dir_id, job.tier);
+        if(record) record->entries.push_back(ScannedEntry{names[next], inos[next], row});
+      }
+      return;
+    }
+    uint64_t tag;
+    int res;
+    while(active && ring.reap(tag, res)){
+      size_t slot_id = tag >> 1;
+      MetaSlot &slot = w.slots[slot_id];
+      if(tag & 1)
+        slot.meta_res = res;
+      else
+        slot.stx_res = res;
+      if(--slot.outstanding > 0) continue;
+      emit_slot(id, job, slot, record);
+      slot.name = NULL;
+      active--;
+      if(next < names.size()) fill(slot_id);
+    }
+  }
+}
+
+void Crawler::emit_slot(size_t id, const CrawlJob &job, MetaSlot &slot, ScannedDir *record){
+  if(slot.stx_res < 0) return; // vanished since getdents
+  struct stat info;
+  memset(&info, 0, sizeof(info));
+  info.st_mode = slot.stx.stx_mode;
+  info.st_size = slot.stx.stx_size;
+  info.st_blocks = slot.stx.stx_blocks;
+  info.st_atim.tv_sec = slot.stx.stx_atime.tv_sec;
+  info.st_atim.tv_nsec = slot.stx.stx_atime.tv_nsec;
+  info.st_mtim.tv_sec = slot.stx.stx_mtime.tv_sec;
+  info.st_mtim.tv_nsec = slot.stx.stx_mtime.tv_nsec;
+  MetaValues meta;
+  if(slot.meta_sync)
+    read_meta(-1, slot.path.c_str(), meta);
+  else if(slot.meta_res <= 0 || !unpack_meta(slot.meta, slot.meta_res, meta))
+    read_legacy_meta(-1, slot.path.c_str(), meta);
+  uint32_t row = workers[id].files.add(job.dir_id, slot.name, job.tier, info, meta.pin,
+    (meta.have_atime)? &meta.last_atime : NULL,
+    (meta.have_priority)? &meta.priority : NULL,
+    (meta.have_heat)? &meta.heat : NULL);
+  if(meta.legacy) workers[id].files.flags[row] |= FILE_LEGACY_META | FILE_META_DIRTY;
+  if(record) record->entries.push_back(ScannedEntry{slot.name, slot.ino, row});
+}
@@ -0,0 +1,141 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "uring.hpp"
+#include "index.hpp"
+#include "filetable.hpp"
+#include "xattr.hpp"
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+namespace fs = boost::filesystem;
+
+#define DIRENT_BUFF_SZ 65536
+
+class Tier; // forward declaration
+
+class DirReader{
+  /*
+   * Reads directory entries straight from getdents64 so each entry
+   * comes with its d_type, and only entries the file system could not
+   * type (DT_UNKNOWN) cost an extra fstatat. Entries are named relative
+   * to fd(), which the caller uses for openat/fstatat.
+   */
+private:
+  int dir_fd;
+  long buff_len;
+  long buff_pos;
+  char buff[DIRENT_BUFF_SZ];
+public:
+  DirReader(const char *path);
+  ~DirReader();
+  int fd(void) const{ return dir_fd; }
+  bool next(const char *&name, unsigned char &type, uint64_t &ino);
+};
+
+struct MetaSlot{
+  /*
+   * One file's worth of in-flight io_uring requests. Results land here
+   * as they complete, so a slot is only reused once all have been reaped.
+   */
+  fs::path path;
+  const char *name;
+  struct statx stx;
+  int stx_res;
+  uint64_t ino;
+  char meta[META_BUFF_SZ];
+  int meta_res;
+  bool meta_sync; // no getxattr was queued, read_meta instead
+  int outstanding;
+};
+
+struct CrawlJob{
+  fs::path dir;
+  Tier *tptr;
+  uint16_t tier;
+  uint32_t dir_id; // in the PathPool
+  uint16_t depth; // of dir below the tier directory
+};
+
+// sees the rows one directory job added to a worker's table, from that worker's thread
+typedef std::function<void(FileTable &files, uint32_t first, const CrawlJob &job)> RowSink;
+
+class Crawler{
+  /*
+   * Work-stealing directory crawler. Each worker owns a queue of
+   * directories, popping from the back so it stays depth-first in
+   * its own subtree. Idle workers steal from the front of the other
+   * queues, which holds the oldest (and usually largest) subtrees.
+   * Files are gathered per worker and only merged once at the end.
+   */
+private:
+  struct Worker{
+    std::mutex lock;
+    std::deque<CrawlJob> queue;
+    FileTable files;
+    std::unique_ptr<MetaRing> ring;
+    bool ring_tried;
+    std::vector<MetaSlot> slots;
+    std::vector<ScannedDir> scanned;
+    Worker() : ring_tried(false){}
+  };
+  std::vector<Worker> workers;
+  std::atomic<long> pending; // jobs queued or being scanned
+  std::mutex idle_lock;
+  std::condition_variable idle_cv;
+  size_t next_seed;
+  unsigned uring_depth;
+  const MetaIndex *index;
+  PathPool *paths;
+  RowSink sink;
+  uint32_t node; // with nodes > 1, only the entries this node owns are crawled, see node_owns()
+  uint32_t nodes;
+  unsigned node_depth;
+  fs::path link_root; // the first tier, where indexed files in the others are checked for their links
+  bool owned(const CrawlJob &job, const char *name, bool is_dir) const;
+  void run(size_t id);
+  bool next_job(size_t id, CrawlJob &job);
+  void enqueue(size_t id, const CrawlJob &job);
+  void enqueue_child(size_t id, const CrawlJob &parent, const char *name);
+  void scan(size_t id, const CrawlJob &job);
+  void scan_dir(size_t id, const CrawlJob &job);
+  void scan_indexed(size_t id, const CrawlJob &job, int dirfd, const IndexDir *idir, ScannedDir *record);
+  uint32_t load_indexed(size_t id, const CrawlJob &job, int dirfd, const char *name, const IndexEntry *entry);
+  MetaRing *get_ring(size_t id);
+  void scan_batch(size_t id, const CrawlJob &job, int dirfd, const std::vector<std::string> &names,
+    const std::vector<uint64_t> &inos, ScannedDir *record);
+  void emit_slot(size_t id, const CrawlJob &job, MetaSlot &slot, ScannedDir *record);
+public:
+  Crawler(PathPool *paths_, size_t num_threads, unsigned uring_depth_ = DEFAULT_URING_DEPTH,
+    const MetaIndex *index_ = NULL);
+  void push(const fs::path &dir, Tier *tptr, uint16_t tier, uint32_t dir_id = ROOT_DIR);
+  void set_sink(const RowSink &sink_){ sink = sink_; }
+  void set_partition(uint32_t node_, uint32_t nodes_, unsigned depth_){ node = node_; nodes = nodes_; node_depth = depth_; }
+  void set_link_root(const fs::path &root){ link_root = root; }
+  void launch(void);
+  void collect(FileTable &files, std::vector<ScannedDir> &scanned);
+};
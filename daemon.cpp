@@ -0,0 +1,253 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "crawl.hpp"
+#include "watch.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+static volatile sig_atomic_t stop_daemon = 0;
+
+static void handle_stop(int){
+  stop_daemon = 1;
+}
+
+typedef std::unordered_map<std::string, uint32_t> FileMap;
+
+void TierEngine::retier(){
+  /*
+   * Placement pass over the in-memory file table. move_files leaves files
+   * that stay in their tier alone, so only changed placements cost I/O.
+   */
+  for(Tier &t : tiers)
+    t.incoming_files.clear();
+  sort();
+  simulate_tier();
+  forget_missing();
+  plan_moves();
+  move_files();
+}
+
+void TierEngine::forget_missing(){
+  /*
+   * fanotify does not report deletions or renames, so a file that is
+   * gone still has its row. Only the rows about to be moved or linked
+   * are checked, and the ones not found are dropped for good.
+   */
+  size_t gone = 0;
+  for(Tier &t : tiers){
+    std::vector<uint32_t>::iterator kept = std::remove_if(t.incoming_files.begin(), t.incoming_files.end(), [&](uint32_t i){
+      struct stat info;
+      if(lstat(file_path(i).c_str(), &info) == 0 || (errno != ENOENT && errno != ENOTDIR)) return false;
+      files.flags[i] |= FILE_REMOVED;
+      gone++;
+      return true;
+    });
+    t.incoming_files.erase(kept, t.incoming_files.end());
+  }
+  if(gone) Log("Forgetting " + std::to_string(gone) + " files that are gone.",2);
+}
+
+static int tier_of(std::vector<Tier> &tiers, const fs::path &path){
+  const std::string &str = path.string();
+  for(size_t t = 0; t < tiers.size(); t++){
+    const std::string &dir = tiers[t].dir.string();
+    if(str.compare(0, dir.length(), dir) == 0 && str.length() > dir.length() && str[dir.length()] == '/')
+      return t;
+  }
+  return -1;
+}
+
+void TierEngine::run_daemon(){
+  Log("autotier daemon started.\n",1);
+  if(config.nodes > 1 && !lease.acquire(config.lease_dir, config.node, config.nodes)) return;
+  if(config.streaming) Log("STREAMING does not apply to the daemon, which keeps every file in memory.",1);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  AccessWatcher watcher;
+  // watch before the first pass so nothing is missed while it runs
+  if(!watcher.start(tiers)) return;
+  std::vector<fs::path> dirs;
+  for(const Tier &t : tiers)
+    dirs.push_back(t.dir);
+  UnionFS union_fs(dirs);
+  if(!mount_path.empty()){
+    if(!union_fs.mount(mount_path)) return;
+    mounted = &union_fs;
+    watcher.wake_on(union_fs.wake_fd());
+    // fanotify leaves out our own I/O, inotify already sees what goes through the mount
+    union_fs.set_recording(watcher.using_fanotify());
+  }
+  metrics.begin_run();
+  launch_crawlers();
+  if(mounted){
+    for(uint32_t i = 0; i < files.count(); i++)
+      mounted->placed(files.relative_path(i, paths).string(), files.tier[i]);
+  }
+  auto own_paths = [this](const std::vector<uint16_t> &placed){
+    // what a pass's own copies and links touched: each moved file's old and new place, and its link
+    std::unordered_set<std::string> touched;
+    for(uint32_t i = 0; i < files.count(); i++){
+      if(files.tier[i] == placed[i] || (files.flags[i] & FILE_REMOVED)) continue;
+      fs::path rel = files.relative_path(i, paths);
+      touched.insert((tiers[placed[i]].dir / rel).string());
+      touched.insert((tiers[files.tier[i]].dir / rel).string());
+      touched.insert((tiers.front().dir / rel).string());
+    }
+    return touched;
+  };
+  std::vector<WatchEvent> carried; // clients' events that came in during a pass
+  std::vector<uint16_t> placed = files.tier;
+  retier();
+  write_xattrs();
+  update_index();
+  save_metrics();
+  watcher.discard_own(own_paths(placed), carried);
+
+  FileMap by_path;
+  for(uint32_t i = 0; i < files.count(); i++)
+    by_path[file_path(i).string()] = i;
+
+  typedef std::chrono::steady_clock clock;
+  clock::time_point next_pass = clock::now() + std::chrono::seconds(config.daemon_interval);
+  clock::time_point next_age = clock::now() + std::chrono::seconds(config.age_interval);
+  bool dirty = false;
+  std::vector<WatchEvent> events;
+
+  while(!stop_daemon){
+    clock::time_point now = clock::now();
+    clock::time_point wake = (next_pass < next_age)? next_pass : next_age;
+    long timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+    events.swap(carried);
+    carried.clear();
+    watcher.poll(events, (timeout > 0 && events.empty())? timeout : 0);
+    if(mounted) mounted->drain(events);
+    for(const WatchEvent &e : events){
+      if(e.type == CREATED_DIR){
+        watcher.add_watches(e.path);
+        continue;
+      }
+      FileMap::iterator entry = by_path.find(e.path.string());
+      if(entry != by_path.end() && (files.flags[entry->second] & FILE_REMOVED)){
+        // found gone by a pass, a file here now is a new one
+        by_path.erase(entry);
+        entry = by_path.end();
+      }
+      if(e.type == REMOVED){
+        if(entry != by_path.end()){
+          files.flags[entry->second] |= FILE_REMOVED; // nothing left to write xattrs to
+          by_path.erase(entry);
+          dirty = true;
+        }
+        continue;
+      }
+      if(entry == by_path.end()){
+        int t = tier_of(tiers, e.path);
+        if(t == -1 || !is_regular_file(symlink_status(e.path)) || tiers[t].exclude.match(e.path.filename().string()))
+          continue;
+        // another node's share, that node picks it up
+        if(!node_owns(relative(e.path, tiers[t].dir), config.node, config.nodes, config.node_depth))
+          continue;
+        int dirfd = open(e.path.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dirfd == -1) continue;
+        uint32_t dir = paths.add_path(relative(e.path.parent_path(), tiers[t].dir));
+        uint32_t i = files.load(dirfd, e.path.filename().c_str(), dir, t);
+        close(dirfd);
+        if(files.priority[i] & TOP_PRIORITY_BIT) // same as counting it at the next crawl
+          files.heat[i] = heat_after_access(files.heat[i], files.atime[i], config.half_life);
+        entry = by_path.insert(std::make_pair(e.path.string(), i)).first;
+        Log("New file " + e.path.string(), 2);
+      }
+      uint32_t i = entry->second;
+      if(e.type == OPENED || e.type == ACCESSED){
+        // same as a new atime at the next crawl, without waiting for it
+        if(!(files.priority[i] & TOP_PRIORITY_BIT)){
+          dirty = true;
+          // a small file read from a lower tier is promoted soon rather than at the next pass
+          clock::time_point soon = clock::now() + std::chrono::seconds(EXPEDITE_DELAY);
+          if(files.tier[i] != 0 && config.expedite_size && files.alloc[i] <= config.expedite_size && soon < next_pass)
+            next_pass = soon;
+        }
+        files.priority[i] |= TOP_PRIORITY_BIT;
+        files.atime[i] = time(NULL);
+        // one read of a large file is many access events, it is counted once by its open
+        if(e.type == OPENED)
+          files.heat[i] = heat_after_access(files.heat[i], files.atime[i], config.half_life);
+        files.flags[i] |= FILE_META_DIRTY;
+      }else{
+        struct stat info;
+        if(lstat(e.path.c_str(), &info) == 0){
+          files.size[i] = info.st_size;
+          files.alloc[i] = allocated_size(info);
+          files.mtime[i] = info.st_mtime;
+        }
+        dirty = true;
+      }
+    }
+
+    now = clock::now();
+    if(now >= next_age){
+      for(uint32_t i = 0; i < files.count(); i++){
+        if(files.priority[i] == 0) continue;
+        files.priority[i] >>= 1;
+        files.flags[i] |= FILE_META_DIRTY;
+      }
+      next_age = now + std::chrono::seconds(config.age_interval);
+      dirty = true;
+    }
+    if(now >= next_pass){
+      if(dirty){
+        Log("Re-tiering.",2);
+        placed = files.tier;
+        metrics.begin_run();
+        retier();
+        watcher.discard_own(own_paths(placed), carried);
+        // files that moved are tracked at their new location from now on
+        for(uint32_t i = 0; i < files.count(); i++){
+          if(files.tier[i] == placed[i] || (files.flags[i] & FILE_REMOVED)) continue;
+          fs::path rel = files.relative_path(i, paths);
+          by_path.erase((tiers[placed[i]].dir / rel).string());
+          by_path[(tiers[files.tier[i]].dir / rel).string()] = i;
+        }
+        write_xattrs();
+        save_metrics();
+        dirty = false;
+      }
+      next_pass = clock::now() + std::chrono::seconds(config.daemon_interval);
+    }
+  }
+  write_xattrs();
+  xattr_writer.wait();
+  union_fs.unmount();
+  mounted = NULL;
+  Log("autotier daemon stopping.",1);
+}
@@ -0,0 +1,156 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "exclude.hpp"
+#include "transfer.hpp"
+#include "cluster.hpp"
+
+// vim swap files, LibreOffice lock files, MS Office owner files, our own partial transfers and node leases
+static const char *default_globs[] = {".*.swp", ".~lock.*#", "~$*", ".*" TRANSFER_SUFFIX, LEASE_NAME, INDEX_SEGMENT_NAME ".*"};
+
+size_t AffixTrie::child(size_t node, char c) const{
+  for(const std::pair<char, size_t> &n : nodes[node].next)
+    if(n.first == c) return n.second;
+  return 0;
+}
+
+void AffixTrie::insert(const std::string &prefix, const std::string &suffix){
+  size_t node = 0;
+  for(char c : prefix){
+    size_t next = child(node, c);
+    if(next == 0){
+      next = nodes.size();
+      nodes[node].next.emplace_back(c, next);
+      nodes.emplace_back();
+    }
+    node = next;
+  }
+  nodes[node].suffixes.push_back(suffix);
+}
+
+bool AffixTrie::match(const std::string &str, bool reversed) const{
+  size_t node = 0;
+  size_t len = str.length();
+  for(size_t depth = 0; ; depth++){
+    for(const std::string &suffix : nodes[node].suffixes){
+      if(suffix.empty()) return true;
+      if(len - depth >= suffix.length() &&
+      str.compare(len - suffix.length(), suffix.length(), suffix) == 0) return true;
+    }
+    if(depth == len) return false;
+    char c = (reversed)? str[len - depth - 1] : str[depth];
+    if((node = child(node, c)) == 0) return false;
+  }
+}
+
+void ExcludeMatcher::inherit(const ExcludeMatcher &parent){
+  globs.insert(globs.begin(), parent.globs.begin(), parent.globs.end());
+  regexes.insert(regexes.begin(), parent.regexes.begin(), parent.regexes.end());
+}
+
+void ExcludeMatcher::add_compiled_glob(const std::string &glob, std::string &regex_str){
+  size_t first_star = glob.find('*');
+  if(glob.find_first_of("?[\\") == std::string::npos &&
+  (first_star == std::string::npos || first_star == glob.find_last_of('*'))){
+    if(first_star == std::string::npos){
+      literals.insert(glob);
+    }else if(first_star == 0){
+      std::string suffix(glob.rbegin(), glob.rend() - 1);
+      suffixes.insert(suffix, "");
+    }else{
+      prefixes.insert(glob.substr(0, first_star), glob.substr(first_star + 1));
+    }
+    return;
+  }
+  if(!regex_str.empty()) regex_str += "|";
+  regex_str += "(?:" + glob_to_regex(glob) + ")";
+}
+
+bool ExcludeMatcher::compile(){
+  std::string regex_str;
+  literals.clear();
+  prefixes = AffixTrie();
+  suffixes = AffixTrie();
+  for(const char *glob : default_globs)
+    add_compiled_glob(glob, regex_str);
+  for(const std::string &glob : globs)
+    add_compiled_glob(glob, regex_str);
+  for(const std::string &regex : regexes){
+    if(!regex_str.empty()) regex_str += "|";
+    regex_str += "(?:" + regex + ")";
+  }
+  use_regex = !regex_str.empty();
+  if(!use_regex) return true;
+  try{
+    pattern.assign(regex_str, std::regex::ECMAScript | std::regex::optimize);
+  }catch(std::regex_error &){
+    use_regex = false;
+    return false;
+  }
+  return true;
+}
+
+bool ExcludeMatcher::match(const std::string &name) const{
+  if(literals.count(name) || prefixes.match(name, false) || suffixes.match(name, true))
+    return true;
+  return use_regex && regex_match(name, pattern);
+}
+
+void ExcludeMatcher::dump(std::ostream &os) const{
+  for(const std::string &glob : globs)
+    os << "EXCLUDE=" << glob << std::endl;
+  for(const std::string &regex : regexes)
+    os << "EXCLUDE_REGEX=" << regex << std::endl;
+}
+
+std::string glob_to_regex(const std::string &glob){
+  std::string regex;
+  for(size_t i = 0; i < glob.length(); i++){
+    char c = glob[i];
+    switch(c){
+      case '*':
+        regex += ".*";
+        break;
+      case '?':
+        regex += ".";
+        break;
+      case '[':
+        {
+          size_t close = glob.find(']', i + 2);
+          if(close == std::string::npos){
+            regex += "\\[";
+            break;
+          }
+          std::string set = glob.substr(i + 1, close - i - 1);
+          if(set[0] == '!') set[0] = '^';
+          regex += "[" + set + "]";
+          i = close;
+        }
+        break;
+      case '\\':
+        if(i + 1 < glob.length()) c = glob[++i];
+        // fall through
+      default:
+        if(std::string("^$.|+(){}[]*?\\").find(c) != std::string::npos)
+          regex += "\\";
+        regex += c;
+    }
+  }
+  return regex;
+}
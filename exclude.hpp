@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <regex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class AffixTrie{
+  /*
+   * Byte trie of literal prefixes. Each node that ends a prefix holds
+   * the suffixes that must also match for the pattern to hit, an
+   * empty suffix meaning the prefix alone is enough. Suffix-only
+   * patterns are stored reversed in a second trie.
+   */
+private:
+  struct Node{
+    std::vector<std::pair<char, size_t>> next;
+    std::vector<std::string> suffixes;
+  };
+  std::vector<Node> nodes;
+  size_t child(size_t node, char c) const;
+public:
+  AffixTrie() : nodes(1){}
+  void insert(const std::string &prefix, const std::string &suffix);
+  bool match(const std::string &str, bool reversed) const;
+};
+
+class ExcludeMatcher{
+  /*
+   * Matches file names against the EXCLUDE (glob) and EXCLUDE_REGEX
+   * patterns. Globs that are plain literals, prefixes, suffixes or
+   * prefix*suffix pairs go into hash sets and tries; anything else is
+   * folded into a single regex with the user regexes, which is only
+   * built once by compile().
+   */
+private:
+  std::vector<std::string> globs;
+  std::vector<std::string> regexes;
+  std::unordered_set<std::string> literals;
+  AffixTrie prefixes;
+  AffixTrie suffixes;
+  std::regex pattern;
+  bool use_regex;
+  void add_compiled_glob(const std::string &glob, std::string &regex_str);
+public:
+  ExcludeMatcher() : use_regex(false){}
+  void add_glob(const std::string &glob){ globs.push_back(glob); }
+  void add_regex(const std::string &regex){ regexes.push_back(regex); }
+  void inherit(const ExcludeMatcher &parent);
+  bool compile(void);
+  bool match(const std::string &name) const;
+  void dump(std::ostream &os) const;
+};
+
+std::string glob_to_regex(const std::string &glob);
@@ -0,0 +1,211 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "filetable.hpp"
+#include "alert.hpp"
+#include "xattr.hpp"
+#include "score.hpp"
+#include "metrics.hpp"
+#include "capacity.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+PathPool::PathPool(){
+  dirs.push_back(Dir{NO_PARENT, 0, 0}); // ROOT_DIR, the tier directory itself
+  arena.push_back('\0');
+}
+
+uint64_t PathPool::hash(uint32_t parent, const char *name, size_t len){
+  // FNV-1a over the parent id and the name
+  uint64_t h = 14695981039346656037ULL;
+  for(int i = 0; i < 4; i++){
+    h ^= (parent >> (i * 8)) & 0xff;
+    h *= 1099511628211ULL;
+  }
+  for(size_t i = 0; i < len; i++){
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint32_t PathPool::add(uint32_t parent, const char *name){
+  size_t len = strlen(name);
+  uint64_t h = hash(parent, name, len);
+  std::lock_guard<std::mutex> guard(lock);
+  auto range = lookup.equal_range(h);
+  for(auto itr = range.first; itr != range.second; ++itr){
+    const Dir &d = dirs[itr->second];
+    if(d.parent == parent && d.name_len == len && arena.compare(d.name, len, name) == 0)
+      return itr->second;
+  }
+  uint32_t id = dirs.size();
+  dirs.push_back(Dir{parent, (uint32_t)len, arena.size()});
+  arena.append(name, len + 1);
+  lookup.insert(std::make_pair(h, id));
+  return id;
+}
+
+uint32_t PathPool::add_path(const fs::path &relative){
+  uint32_t id = ROOT_DIR;
+  for(const fs::path &component : relative)
+    if(component != ".") id = add(id, component.c_str());
+  return id;
+}
+
+void PathPool::append(uint32_t dir, std::string &out) const{
+  if(dir == ROOT_DIR) return;
+  append(dirs[dir].parent, out);
+  if(!out.empty()) out.push_back('/');
+  out.append(arena, dirs[dir].name, dirs[dir].name_len);
+}
+
+fs::path PathPool::path(uint32_t dir) const{
+  std::string out;
+  append(dir, out);
+  return fs::path(out);
+}
+
+uint32_t FileTable::add(uint32_t dir_, const char *name_, uint16_t tier_, const struct stat &info,
+const char *pin, const int64_t *xattr_atime, const uint64_t *xattr_priority, const double *xattr_heat){
+  /*
+   * Shared by every metadata backend. Missing xattrs are passed as NULL.
+   * A row starts out dirty unless the values it ends up with are the
+   * ones that were read.
+   */
+  uint32_t i = count();
+  int64_t last_atime = (xattr_atime)? *xattr_atime : info.st_atime;
+  uint64_t prio;
+  if(!xattr_priority){
+    prio = TOP_PRIORITY_BIT;
+  }else{
+    // age
+    prio = *xattr_priority >> 1;
+    if(info.st_atime > last_atime){
+      prio |= TOP_PRIORITY_BIT;
+    }
+  }
+  priority.push_back(prio);
+  atime.push_back(info.st_atime);
+  mtime.push_back(info.st_mtime);
+  size.push_back(info.st_size);
+  alloc.push_back(allocated_size(info));
+  heat.push_back((xattr_heat)? *xattr_heat : NO_HEAT); // accesses are counted once the crawl is done
+  dir.push_back(dir_);
+  name.push_back(names.size());
+  names.append(name_);
+  names.push_back('\0');
+  tier.push_back(tier_);
+  bool same = xattr_atime && xattr_priority && xattr_heat && last_atime == info.st_atime && prio == *xattr_priority;
+  flags.push_back((same)? 0 : FILE_META_DIRTY);
+  if(pin && *pin) pins[i] = pin;
+  return i;
+}
+
+uint32_t FileTable::load(int dirfd, const char *name_, uint32_t dir_, uint16_t tier_){
+  /*
+   * Opens the file once, relative to its directory, and reads the stat
+   * and xattrs through that fd instead of resolving the path each time.
+   */
+  MetaValues meta;
+  meta.have_atime = meta.have_priority = meta.have_heat = meta.legacy = false;
+  meta.pin[0] = '\0';
+  struct stat info;
+  int open_flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+  int fd = openat(dirfd, name_, open_flags | O_NOATIME);
+  if(fd == ERR && errno == EPERM) // O_NOATIME is only allowed for the owner
+    fd = openat(dirfd, name_, open_flags);
+  uint64_t start = (metrics.enabled)? metrics_now() : 0;
+  if(fd == ERR || fstat(fd, &info) == ERR){
+    if(fstatat(dirfd, name_, &info, AT_SYMLINK_NOFOLLOW) == ERR)
+      memset(&info, 0, sizeof(info));
+  }
+  if(metrics.enabled){
+    uint64_t now = metrics_now();
+    metrics.stat_latency.observe(now - start);
+    start = now;
+  }
+  if(fd != ERR){
+    read_meta(fd, NULL, meta);
+    close(fd);
+    if(metrics.enabled) metrics.xattr_read_latency.observe(metrics_now() - start);
+  }
+  uint32_t i = add(dir_, name_, tier_, info, meta.pin,
+    (meta.have_atime)? &meta.last_atime : NULL, (meta.have_priority)? &meta.priority : NULL,
+    (meta.have_heat)? &meta.heat : NULL);
+  if(meta.legacy) flags[i] |= FILE_LEGACY_META | FILE_META_DIRTY;
+  return i;
+}
+
+void FileTable::append(FileTable &other){
+  uint32_t base = count();
+  uint64_t name_base = names.size();
+  priority.insert(priority.end(), other.priority.begin(), other.priority.end());
+  atime.insert(atime.end(), other.atime.begin(), other.atime.end());
+  mtime.insert(mtime.end(), other.mtime.begin(), other.mtime.end());
+  size.insert(size.end(), other.size.begin(), other.size.end());
+  alloc.insert(alloc.end(), other.alloc.begin(), other.alloc.end());
+  heat.insert(heat.end(), other.heat.begin(), other.heat.end());
+  dir.insert(dir.end(), other.dir.begin(), other.dir.end());
+  for(uint64_t n : other.name)
+    name.push_back(n + name_base);
+  tier.insert(tier.end(), other.tier.begin(), other.tier.end());
+  flags.insert(flags.end(), other.flags.begin(), other.flags.end());
+  for(const std::pair<const uint32_t, std::string> &p : other.pins)
+    pins[p.first + base] = p.second;
+  names.append(other.names);
+  other = FileTable();
+}
+
+void FileTable::truncate(uint32_t n){
+  // drops the rows from n on, for passes that are done with them once seen
+  if(n >= count()) return;
+  names.resize(name[n]);
+  priority.resize(n);
+  atime.resize(n);
+  mtime.resize(n);
+  size.resize(n);
+  alloc.resize(n);
+  heat.resize(n);
+  dir.resize(n);
+  name.resize(n);
+  tier.resize(n);
+  flags.resize(n);
+  for(std::unordered_map<uint32_t, std::string>::iterator itr = pins.begin(); itr != pins.end(); )
+    itr = (itr->first >= n)? pins.erase(itr) : std::next(itr);
+}
+
+const char *FileTable::pin_of(uint32_t i) const{
+  std::unordered_map<uint32_t, std::string>::const_iterator itr = pins.find(i);
+  return (itr == pins.end())? NULL : itr->second.c_str();
+}
+
+fs::path FileTable::relative_path(uint32_t i, const PathPool &paths) const{
+  std::string out;
+  paths.append(dir[i], out);
+  if(!out.empty()) out.push_back('/');
+  out.append(name_of(i));
+  return fs::path(out);
+}
+
+std::string FileTable::packed_meta(uint32_t i) const{
+  return pack_meta(atime[i], priority[i], heat[i], pin_of(i));
+}
@@ -0,0 +1,99 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+namespace fs = boost::filesystem;
+
+#define ROOT_DIR 0
+#define NO_PARENT ((uint32_t)-1)
+#define NO_FILE ((uint32_t)-1)
+
+#define TOP_PRIORITY_BIT ((uint64_t)0x01 << 63)
+
+#define FILE_REMOVED 0x01
+#define FILE_LINKED 0x02 // reachable from the first tier, by a symlink or by being there
+#define FILE_META_DIRTY 0x04 // priority, atime or pin differ from what the file's xattr holds
+#define FILE_LEGACY_META 0x08 // xattrs are still in the old layout
+
+class PathPool{
+  /*
+   * Directories interned as (parent id, name) pairs, relative to the
+   * tier roots, so the same directory in every tier shares one id and a
+   * file changes tier without its path being touched. add() may be
+   * called from several crawler threads; lookups must not race with it.
+   */
+private:
+  struct Dir{
+    uint32_t parent;
+    uint32_t name_len;
+    uint64_t name;
+  };
+  std::vector<Dir> dirs;
+  std::string arena;
+  std::unordered_multimap<uint64_t, uint32_t> lookup;
+  std::mutex lock;
+  static uint64_t hash(uint32_t parent, const char *name, size_t len);
+public:
+  PathPool();
+  uint32_t add(uint32_t parent, const char *name);
+  uint32_t add_path(const fs::path &relative);
+  uint32_t parent(uint32_t dir) const{ return dirs[dir].parent; }
+  size_t size(void) const{ return dirs.size(); }
+  void append(uint32_t dir, std::string &out) const;
+  fs::path path(uint32_t dir) const;
+};
+
+class FileTable{
+  /*
+   * Every crawled file as one row spread over packed arrays, instead of
+   * a heap node per file. Rows are addressed by index; names live in one
+   * arena and paths are rebuilt from the PathPool when a file is moved.
+   */
+public:
+  std::vector<uint64_t> priority;
+  std::vector<int64_t> atime;
+  std::vector<int64_t> mtime;
+  std::vector<int64_t> size;
+  std::vector<int64_t> alloc; // space taken on a tier, see allocated_size()
+  std::vector<double> heat; // decayed access count, see score.hpp
+  std::vector<uint32_t> dir;
+  std::vector<uint64_t> name;
+  std::vector<uint16_t> tier;
+  std::vector<uint8_t> flags;
+  std::unordered_map<uint32_t, std::string> pins; // sparse, few files are pinned
+  std::string names;
+  size_t count(void) const{ return priority.size(); }
+  uint32_t add(uint32_t dir_, const char *name_, uint16_t tier_, const struct stat &info,
+    const char *pin, const int64_t *xattr_atime, const uint64_t *xattr_priority, const double *xattr_heat);
+  uint32_t load(int dirfd, const char *name_, uint32_t dir_, uint16_t tier_);
+  void append(FileTable &other);
+  void truncate(uint32_t n);
+  const char *name_of(uint32_t i) const{ return names.c_str() + name[i]; }
+  const char *pin_of(uint32_t i) const;
+  fs::path relative_path(uint32_t i, const PathPool &paths) const;
+  std::string packed_meta(uint32_t i) const;
+};
@@ -0,0 +1,141 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "hash.hpp"
+#include "config.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void TreeHash::add(const void *data, size_t length){
+  const char *input = (const char *)data;
+  while(length > 0){
+    if(leaf_len == TREE_CHUNK_SZ){
+      leaves.push_back(leaf.hash());
+      leaf.reset();
+      leaf_len = 0;
+    }
+    size_t n = (length < TREE_CHUNK_SZ - leaf_len)? length : TREE_CHUNK_SZ - leaf_len;
+    leaf.add(input, n);
+    leaf_len += n;
+    input += n;
+    length -= n;
+  }
+}
+
+uint64_t TreeHash::hash() const{
+  if(leaves.empty()) return leaf.hash();
+  std::vector<uint64_t> all(leaves);
+  all.push_back(leaf.hash());
+  return combine(algo, all);
+}
+
+uint64_t TreeHash::combine(enum HashAlgo algo, const std::vector<uint64_t> &leaves){
+  if(leaves.size() == 1) return leaves[0];
+  Hasher root(algo);
+  root.add(leaves.data(), leaves.size() * sizeof(uint64_t));
+  return root.hash();
+}
+
+int hash_range(int fd, enum HashAlgo algo, off_t begin, off_t end, uint64_t *result){
+  void *buff;
+  if(posix_memalign(&buff, HASH_ALIGN, HASH_BUFF_SZ) != 0) return ENOMEM;
+  Hasher hash(algo);
+  int err = 0;
+  for(off_t offset = begin; offset < end; ){
+    size_t want = (end - offset < HASH_BUFF_SZ)? end - offset : HASH_BUFF_SZ;
+    // O_DIRECT wants whole blocks, the file end cuts the last read short anyway
+    size_t len = (want + HASH_ALIGN - 1) & ~(size_t)(HASH_ALIGN - 1);
+    ssize_t n = pread(fd, buff, len, offset);
+    if(n == ERR){
+      if(errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+    if(n == 0) break;
+    if((size_t)n > want) n = want;
+    hash.add(buff, n);
+    offset += n;
+  }
+  free(buff);
+  *result = hash.hash();
+  return err;
+}
+
+int hash_fd(int fd, enum HashAlgo algo, int num_threads, uint64_t *result){
+  /*
+   * Hashes the whole of fd as a TreeHash, one chunk per thread at a
+   * time. Reads use O_DIRECT where possible so what gets hashed is what
+   * reached the disk rather than cached writes.
+   */
+  struct stat info;
+  if(fstat(fd, &info) == ERR) return errno;
+  int flags = fcntl(fd, F_GETFL);
+  bool direct = (fcntl(fd, F_SETFL, flags | O_DIRECT) != ERR);
+  size_t chunks = (info.st_size + TREE_CHUNK_SZ - 1) / TREE_CHUNK_SZ;
+  if(chunks == 0) chunks = 1;
+  std::vector<uint64_t> leaves(chunks);
+  std::vector<int> errs(chunks, 0);
+  for(int attempt = 0; attempt < 2; attempt++){
+    size_t threads = (num_threads > 1)? num_threads : 1;
+    if(threads > chunks) threads = chunks;
+    std::vector<std::thread> pool;
+    for(size_t t = 0; t < threads; t++){
+      pool.emplace_back([&, t](){
+        for(size_t c = t; c < chunks; c += threads)
+          errs[c] = hash_range(fd, algo, c * TREE_CHUNK_SZ, (c + 1) * TREE_CHUNK_SZ, &leaves[c]);
+      });
+    }
+    for(std::thread &th : pool) th.join();
+    bool einval = false;
+    for(int e : errs) einval |= (e == EINVAL);
+    if(!(einval && direct)) break;
+    // the filesystem took the flag but not the reads
+    fcntl(fd, F_SETFL, flags);
+    direct = false;
+    std::fill(errs.begin(), errs.end(), 0);
+  }
+  if(direct) fcntl(fd, F_SETFL, flags);
+  for(int e : errs)
+    if(e) return e;
+  *result = TreeHash::combine(algo, leaves);
+  return 0;
+}
+
+enum HashAlgo parse_hash_algo(const std::string &value){
+  if(value == "xxh3") return HASH_XXH3;
+  if(value == "xxh64") return HASH_XXH64;
+  return HASH_INVALID;
+}
+
+const char *hash_algo_name(enum HashAlgo algo){
+  switch(algo){
+  case HASH_XXH64:
+    return "xxh64";
+  case HASH_XXH3:
+    return "xxh3";
+  default:
+    return "invalid";
+  }
+}
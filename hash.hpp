@@ -0,0 +1,86 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "xxhash64.h"
+#include "xxh3.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#define TREE_CHUNK_SZ ((uint64_t)256 << 20) // files larger than this are hashed chunk by chunk
+#define HASH_BUFF_SZ (1 << 20)
+#define HASH_ALIGN 4096
+
+enum HashAlgo{HASH_XXH64, HASH_XXH3, HASH_INVALID};
+
+class Hasher{
+  /*
+   * The checksums verification can use behind one interface. XXH3 runs
+   * on SIMD where the CPU has it and is then about twice as fast as
+   * XXHash64, which is kept for compatibility.
+   */
+private:
+  enum HashAlgo algo;
+  XXHash64 xxh64;
+  XXH3 xxh3;
+public:
+  Hasher(enum HashAlgo algo_) : algo(algo_), xxh64(0){}
+  void reset(void){
+    xxh64 = XXHash64(0);
+    xxh3.reset();
+  }
+  void add(const void *data, size_t length){
+    if(algo == HASH_XXH64) xxh64.add(data, length); else xxh3.add(data, length);
+  }
+  uint64_t hash(void) const{
+    return (algo == HASH_XXH64)? xxh64.hash() : xxh3.hash();
+  }
+};
+
+class TreeHash{
+  /*
+   * A file of at most TREE_CHUNK_SZ bytes hashes as itself. Larger files
+   * hash as the list of their chunks' hashes, so the chunks can be
+   * hashed on separate threads and still agree with a hash taken while
+   * the file streams past.
+   */
+private:
+  enum HashAlgo algo;
+  Hasher leaf;
+  uint64_t leaf_len;
+  std::vector<uint64_t> leaves;
+public:
+  TreeHash(enum HashAlgo algo_) : algo(algo_), leaf(algo_), leaf_len(0){}
+  void add(const void *data, size_t length);
+  uint64_t hash(void) const;
+  static uint64_t combine(enum HashAlgo algo, const std::vector<uint64_t> &leaves);
+};
+
+enum HashAlgo parse_hash_algo(const std::string &value);
+
+const char *hash_algo_name(enum HashAlgo algo);
+
+int hash_range(int fd, enum HashAlgo algo, off_t begin, off_t end, uint64_t *result);
+
+int hash_fd(int fd, enum HashAlgo algo, int num_threads, uint64_t *result);
@@ -0,0 +1,279 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "index.hpp"
+#include "crawl.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MetaIndex::MetaIndex(){
+  map = MAP_FAILED;
+  map_size = 0;
+  header = NULL;
+  dirs = NULL;
+  entries = NULL;
+  pin_table = NULL;
+  strtab = NULL;
+}
+
+MetaIndex::~MetaIndex(){
+  unload();
+}
+
+void MetaIndex::unload(){
+  if(map != MAP_FAILED) munmap(map, map_size);
+  map = MAP_FAILED;
+  map_size = 0;
+  header = NULL;
+  dirs = NULL;
+  entries = NULL;
+  pin_table = NULL;
+  strtab = NULL;
+}
+
+bool MetaIndex::load(const fs::path &path){
+  struct stat info;
+  unload();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd == ERR) return false;
+  if(fstat(fd, &info) == ERR || (size_t)info.st_size < sizeof(IndexHeader)){
+    close(fd);
+    return false;
+  }
+  map_size = info.st_size;
+  map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return false;
+
+  const IndexHeader *h = (const IndexHeader *)map;
+  uint64_t expected = sizeof(IndexHeader) + h->num_dirs * sizeof(IndexDir)
+    + h->num_entries * sizeof(IndexEntry) + h->num_pins * sizeof(IndexPin) + h->strtab_size;
+  if(memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h->version != INDEX_VERSION ||
+  expected != map_size){
+    Log("Ignoring invalid metadata index " + path.string(), 1);
+    unload();
+    return false;
+  }
+  dirs = (const IndexDir *)(h + 1);
+  entries = (const IndexEntry *)(dirs + h->num_dirs);
+  pin_table = (const IndexPin *)(entries + h->num_entries);
+  strtab = (const char *)(pin_table + h->num_pins);
+  for(uint64_t i = 0; i < h->num_dirs; i++){
+    if(dirs[i].first_entry + dirs[i].num_entries > h->num_entries){
+      Log("Ignoring corrupt metadata index " + path.string(), 1);
+      unload();
+      return false;
+    }
+  }
+  for(uint64_t i = 0; i < h->num_pins; i++){
+    if(pin_table[i].dir >= h->num_dirs || pin_table[i].entry >= h->num_entries){
+      Log("Ignoring corrupt metadata index " + path.string(), 1);
+      unload();
+      return false;
+    }
+  }
+  if(h->strtab_size == 0 || strtab[h->strtab_size - 1] != '\0'){
+    Log("Ignoring corrupt metadata index " + path.string(), 1);
+    unload();
+    return false;
+  }
+  header = h;
+  madvise(map, map_size, MADV_WILLNEED);
+  return true;
+}
+
+const IndexDir *MetaIndex::find_dir(uint64_t dev, uint64_t ino) const{
+  if(!header) return NULL;
+  const IndexDir *end = dirs + header->num_dirs;
+  const IndexDir *itr = std::lower_bound(dirs, end, std::make_pair(dev, ino),
+    [](const IndexDir &d, const std::pair<uint64_t, uint64_t> &key){
+      return (d.dev == key.first)? d.ino < key.second : d.dev < key.first;
+    }
+  );
+  if(itr == end || itr->dev != dev || itr->ino != ino) return NULL;
+  return itr;
+}
+
+const IndexEntry *MetaIndex::find_entry(const IndexDir *dir, uint64_t ino) const{
+  const IndexEntry *end = dir_end(dir);
+  const IndexEntry *itr = std::lower_bound(dir_begin(dir), end, ino,
+    [](const IndexEntry &e, uint64_t key){ return e.ino < key; }
+  );
+  if(itr == end || itr->ino != ino) return NULL;
+  return itr;
+}
+
+const char *MetaIndex::string(uint64_t offset) const{
+  if(offset == INDEX_NO_STRING || offset >= header->strtab_size) return NULL;
+  return strtab + offset;
+}
+
+static uint64_t add_string(std::string &strtab, const std::string &str){
+  uint64_t offset = strtab.size();
+  strtab.append(str);
+  strtab.push_back('\0');
+  return offset;
+}
+
+bool MetaIndex::save(const fs::path &path, std::vector<ScannedDir> &scanned, const std::vector<Tier> &tiers,
+const FileTable &files, uint32_t node, uint32_t nodes, uint32_t node_depth){
+  /*
+   * Files that were moved this run are left out: both their old and new
+   * directories changed mtime, so the next crawl lists them again. A
+   * directory renamed to another tier as a whole keeps its mtime, so
+   * any directory that lost entries is saved as changed.
+   */
+  std::vector<IndexDir> out_dirs;
+  std::vector<IndexEntry> out_entries;
+  std::string strtab;
+
+  std::sort(scanned.begin(), scanned.end(),
+    [](const ScannedDir &a, const ScannedDir &b){
+      return (a.dev == b.dev)? a.ino < b.ino : a.dev < b.dev;
+    }
+  );
+  out_dirs.reserve(scanned.size());
+  for(ScannedDir &d : scanned){
+    IndexDir dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.dev = d.dev;
+    dir.ino = d.ino;
+    dir.mtime_sec = d.mtime_sec;
+    dir.mtime_nsec = d.mtime_nsec;
+    dir.path = add_string(strtab, d.path.string());
+    dir.first_entry = out_entries.size();
+    dir.tier = d.tptr - &tiers.front();
+    std::sort(d.entries.begin(), d.entries.end(),
+      [](const ScannedEntry &a, const ScannedEntry &b){ return a.ino < b.ino; }
+    );
+    bool dropped = false;
+    for(const ScannedEntry &e : d.entries){
+      IndexEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.ino = e.ino;
+      entry.name = add_string(strtab, e.name);
+      entry.tier = dir.tier;
+      entry.pin = INDEX_NO_STRING;
+      if(e.file != NO_FILE){
+        // moved or gone, its new directory is listed at the next crawl
+        if(files.tier[e.file] != dir.tier || (files.flags[e.file] & FILE_REMOVED)){
+          dropped = true;
+          continue;
+        }
+        const char *pin = files.pin_of(e.file);
+        entry.type = INDEX_ENTRY_FILE;
+        entry.priority = files.priority[e.file];
+        entry.last_atime = files.atime[e.file];
+        entry.size = files.size[e.file];
+        entry.heat = files.heat[e.file];
+        if(pin) entry.pin = add_string(strtab, pin);
+      }else{
+        entry.type = INDEX_ENTRY_DIR;
+      }
+      out_entries.push_back(entry);
+    }
+    dir.num_entries = out_entries.size() - dir.first_entry;
+    if(dropped) dir.mtime_sec = dir.mtime_nsec = INDEX_STALE_MTIME;
+    out_dirs.push_back(dir);
+  }
+  if(strtab.empty()) strtab.push_back('\0');
+  IndexHeader shape;
+  memset(&shape, 0, sizeof(shape));
+  shape.num_tiers = tiers.size();
+  shape.node = node;
+  shape.nodes = nodes;
+  shape.node_depth = (nodes > 1)? node_depth : 0;
+  return write(path, shape, out_dirs, out_entries, strtab);
+}
+
+bool MetaIndex::write(const fs::path &path, const IndexHeader &shape, const std::vector<IndexDir> &out_dirs,
+const std::vector<IndexEntry> &out_entries, const std::string &strtab){
+  std::vector<IndexPin> out_pins;
+  for(uint64_t d = 0; d < out_dirs.size(); d++)
+    for(uint64_t e = out_dirs[d].first_entry; e < out_dirs[d].first_entry + out_dirs[d].num_entries; e++)
+      if(out_entries[e].pin != INDEX_NO_STRING) out_pins.push_back(IndexPin{d, e});
+
+  IndexHeader h = shape;
+  memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  h.version = INDEX_VERSION;
+  h.num_dirs = out_dirs.size();
+  h.num_entries = out_entries.size();
+  h.num_pins = out_pins.size();
+  h.strtab_size = strtab.size();
+
+  // another node's segment can be rewritten by a pin command at the same time
+  fs::path tmp_path = path.string() + ".tmp." + std::to_string(getpid());
+  boost::system::error_code ec;
+  if(!is_directory(path.parent_path(), ec)) create_directories(path.parent_path(), ec);
+  std::ofstream out(tmp_path.string(), std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write((const char *)&h, sizeof(h));
+  out.write((const char *)out_dirs.data(), out_dirs.size() * sizeof(IndexDir));
+  out.write((const char *)out_entries.data(), out_entries.size() * sizeof(IndexEntry));
+  out.write((const char *)out_pins.data(), out_pins.size() * sizeof(IndexPin));
+  out.write(strtab.data(), strtab.size());
+  out.close();
+  if(!out || rename(tmp_path.c_str(), path.c_str()) == ERR){
+    Log("Error writing metadata index " + path.string(), 0);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool under(const std::string &path, const fs::path &root){
+  const std::string &r = root.string();
+  return path.compare(0, r.length(), r) == 0 && (path.length() == r.length() || path[r.length()] == '/');
+}
+
+bool MetaIndex::pin_subtree(const fs::path &path, const std::vector<fs::path> &roots, const char *pin, size_t &pinned){
+  /*
+   * Rewrites the index with every file in the directories under roots
+   * pinned (or unpinned, with pin NULL), to match xattrs that were just
+   * written to them. Pinning does not touch directory mtimes, so without
+   * this the next crawl would take the old pins from the index.
+   */
+  MetaIndex index;
+  pinned = 0;
+  if(!index.load(path)) return false;
+  std::vector<IndexDir> out_dirs(index.dirs, index.dirs + index.header->num_dirs);
+  std::vector<IndexEntry> out_entries(index.entries, index.entries + index.header->num_entries);
+  std::string strtab(index.strtab, index.header->strtab_size);
+  uint64_t offset = (pin)? add_string(strtab, pin) : INDEX_NO_STRING;
+  for(const IndexDir &d : out_dirs){
+    const char *dir_path = index.string(d.path);
+    bool match = false;
+    for(const fs::path &root : roots)
+      match = match || (dir_path && under(dir_path, root));
+    if(!match) continue;
+    for(uint64_t e = d.first_entry; e < d.first_entry + d.num_entries; e++){
+      if(out_entries[e].type != INDEX_ENTRY_FILE) continue;
+      out_entries[e].pin = offset;
+      pinned++;
+    }
+  }
+  IndexHeader shape = *index.header;
+  index.unload();
+  return write(path, shape, out_dirs, out_entries, strtab);
+}
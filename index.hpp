@@ -0,0 +1,144 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+namespace fs = boost::filesystem;
+
+#define DEFAULT_INDEX_PATH "/var/lib/autotier/index"
+#define INDEX_MAGIC "ATINDEX"
+#define INDEX_VERSION 4 // version 3 had no node split, version 2 no pin table
+#define INDEX_NO_STRING ((uint64_t)-1)
+#define INDEX_STALE_MTIME -1 // matches no directory, so it is listed again
+#define INDEX_RACY_NS 1000000000LL // a directory changed this close to its listing may change again within the same mtime
+
+class FileTable; // forward declaration
+class Tier; // forward declaration
+
+/*
+ * On-disk layout: header, directory table sorted by (dev, ino), entry
+ * table, pin table, string table. Each directory owns a contiguous run
+ * of entries sorted by inode, so both lookups are binary searches
+ * straight into the mapped file. The pin table lists every pinned file,
+ * so they can be found without going through all entries.
+ */
+struct IndexHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_tiers;
+  uint64_t num_dirs;
+  uint64_t num_entries;
+  uint64_t num_pins;
+  uint64_t strtab_size;
+  uint32_t node; // the share of shared tiers this segment covers, see node_owns()
+  uint32_t nodes;
+  uint32_t node_depth;
+  uint32_t reserved;
+};
+
+struct IndexDir{
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t path;
+  uint64_t first_entry;
+  uint64_t num_entries;
+  uint32_t tier;
+  uint32_t reserved;
+};
+
+#define INDEX_ENTRY_FILE 0
+#define INDEX_ENTRY_DIR 1
+
+struct IndexEntry{
+  uint64_t ino;
+  uint64_t priority;
+  int64_t last_atime;
+  int64_t size;
+  double heat;
+  uint64_t name;
+  uint64_t pin;
+  uint32_t tier;
+  uint32_t type;
+};
+
+struct IndexPin{
+  uint64_t dir; // directory table index
+  uint64_t entry; // entry table index
+};
+
+struct ScannedEntry{
+  std::string name;
+  uint64_t ino;
+  uint32_t file; // FileTable row, NO_FILE for subdirectories
+};
+
+struct ScannedDir{
+  /*
+   * What the crawler saw in one directory, turned into an IndexDir once
+   * the run is over and the files' final values are known.
+   */
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  fs::path path;
+  Tier *tptr;
+  std::vector<ScannedEntry> entries;
+};
+
+class MetaIndex{
+private:
+  void *map;
+  size_t map_size;
+  const IndexHeader *header;
+  const IndexDir *dirs;
+  const IndexEntry *entries;
+  const IndexPin *pin_table;
+  const char *strtab;
+  static bool write(const fs::path &path, const IndexHeader &shape, const std::vector<IndexDir> &out_dirs,
+    const std::vector<IndexEntry> &out_entries, const std::string &strtab);
+public:
+  MetaIndex();
+  ~MetaIndex();
+  bool load(const fs::path &path);
+  void unload(void);
+  bool loaded(void) const{ return header != NULL; }
+  bool split_as(uint32_t node, uint32_t nodes, uint32_t node_depth) const{
+    return header && header->node == node && header->nodes == nodes && header->node_depth == node_depth;
+  }
+  const IndexDir *find_dir(uint64_t dev, uint64_t ino) const;
+  const IndexEntry *find_entry(const IndexDir *dir, uint64_t ino) const;
+  const IndexEntry *dir_begin(const IndexDir *dir) const{ return entries + dir->first_entry; }
+  const IndexEntry *dir_end(const IndexDir *dir) const{ return entries + dir->first_entry + dir->num_entries; }
+  const char *string(uint64_t offset) const;
+  const IndexPin *pins_begin(void) const{ return pin_table; }
+  const IndexPin *pins_end(void) const{ return pin_table + ((header)? header->num_pins : 0); }
+  uint64_t num_dirs(void) const{ return (header)? header->num_dirs : 0; }
+  const IndexDir &dir_at(uint64_t i) const{ return dirs[i]; }
+  const IndexEntry &entry_at(uint64_t i) const{ return entries[i]; }
+  static bool save(const fs::path &path, std::vector<ScannedDir> &scanned, const std::vector<Tier> &tiers,
+    const FileTable &files, uint32_t node = 0, uint32_t nodes = 1, uint32_t node_depth = 0);
+  static bool pin_subtree(const fs::path &path, const std::vector<fs::path> &roots, const char *pin, size_t &pinned);
+};
@@ -0,0 +1,148 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "links.hpp"
+#include "alert.hpp"
+#include "crawler.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unordered_set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int LinkFarm::dir_fd(uint32_t dir){
+  // called with the lock held
+  std::unordered_map<uint32_t, int>::iterator itr = dir_fds.find(dir);
+  if(itr != dir_fds.end()) return itr->second;
+  if(dir_fds.size() >= LINK_DIR_CACHE) close_dirs();
+  fs::path path = root / paths->path(dir);
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd == ERR && errno == ENOENT){
+    boost::system::error_code ec;
+    create_directories(path, ec);
+    fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  if(fd == ERR){
+    Log("Cannot open " + path.string() + ": " + strerror(errno), 0);
+    return ERR;
+  }
+  dir_fds[dir] = fd;
+  return fd;
+}
+
+void LinkFarm::close_dirs(){
+  for(std::pair<const uint32_t, int> &d : dir_fds)
+    close(d.second);
+  dir_fds.clear();
+}
+
+bool LinkFarm::link(uint32_t dir, const char *name, const fs::path &target, bool replace){
+  /*
+   * With replace, whatever is at name is swapped for the link in one
+   * rename: the old link, or the file itself when it was copied out of
+   * the first tier. Otherwise name is expected to be free. One that is
+   * taken by an old link still gets replaced, but a file is left alone.
+   */
+  std::lock_guard<std::mutex> guard(lock);
+  int fd = dir_fd(dir);
+  if(fd == ERR) return false;
+  if(!replace){
+    if(symlinkat(target.c_str(), fd, name) == 0) return true;
+    struct stat info;
+    if(errno != EEXIST || fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == ERR || !S_ISLNK(info.st_mode)){
+      Log("Cannot link " + (root / paths->path(dir) / name).string() + ": " + strerror(errno), 0);
+      return false;
+    }
+  }
+  return replace_at(fd, name, target, root / paths->path(dir) / name);
+}
+
+bool LinkFarm::replace_at(int fd, const char *name, const fs::path &target, const fs::path &path){
+  std::string tmp = std::string(".") + name + LINK_SUFFIX;
+  if(symlinkat(target.c_str(), fd, tmp.c_str()) == ERR){
+    // left behind by an earlier run that did not get to rename it
+    if(errno != EEXIST || unlinkat(fd, tmp.c_str(), 0) == ERR || symlinkat(target.c_str(), fd, tmp.c_str()) == ERR){
+      Log("Cannot link " + path.string() + ": " + strerror(errno), 0);
+      return false;
+    }
+  }
+  if(renameat(fd, tmp.c_str(), fd, name) == ERR){
+    Log("Cannot link " + path.string() + ": " + strerror(errno), 0);
+    unlinkat(fd, tmp.c_str(), 0);
+    return false;
+  }
+  return true;
+}
+
+bool LinkFarm::link_at(const fs::path &path, const fs::path &target){
+  // by full path, for when the PathPool may still be growing
+  int fd = open(path.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd == ERR){
+    Log("Cannot link " + path.string() + ": " + strerror(errno), 0);
+    return false;
+  }
+  bool linked = replace_at(fd, path.filename().c_str(), target, path);
+  close(fd);
+  return linked;
+}
+
+size_t LinkFarm::link_missing(FileTable &files, std::vector<uint32_t> rows, const std::vector<fs::path> &tier_dirs){
+  /*
+   * Files staying in a lower tier only need a link if there is none.
+   * Each directory is listed once instead of checking every name, and
+   * only the missing links are created. Existing links are trusted, as
+   * autotier is the only one making them.
+   */
+  std::sort(rows.begin(), rows.end(), [&files](uint32_t a, uint32_t b){ return files.dir[a] < files.dir[b]; });
+  size_t made = 0;
+  std::unordered_set<std::string> present;
+  for(size_t first = 0, last; first < rows.size(); first = last){
+    uint32_t dir = files.dir[rows[first]];
+    for(last = first + 1; last < rows.size() && files.dir[rows[last]] == dir; last++);
+    present.clear();
+    bool listed = false;
+    for(size_t r = first; r < last; r++){
+      uint32_t i = rows[r];
+      if(files.tier[i] == 0){ // the file itself is there
+        files.flags[i] |= FILE_LINKED;
+        continue;
+      }
+      if(!listed){
+        DirReader reader((root / paths->path(dir)).c_str());
+        const char *name;
+        unsigned char type;
+        uint64_t ino;
+        while(reader.next(name, type, ino))
+          if(type == DT_LNK) present.insert(name);
+        listed = true;
+      }
+      if(present.count(files.name_of(i))){
+        files.flags[i] |= FILE_LINKED;
+      }else if(link(dir, files.name_of(i), tier_dirs[files.tier[i]] / files.relative_path(i, *paths), false)){
+        files.flags[i] |= FILE_LINKED;
+        made++;
+      }
+    }
+  }
+  close_dirs();
+  return made;
+}
@@ -0,0 +1,57 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "filetable.hpp"
+#include <boost/filesystem.hpp>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+namespace fs = boost::filesystem;
+
+#define LINK_SUFFIX ".autotier-link"
+#define LINK_DIR_CACHE 64 // directory fds kept open between links
+
+class LinkFarm{
+  /*
+   * The symlinks in the first tier that point at the files in the
+   * others. A link is replaced by making the new one under a temporary
+   * name and renaming it over the old, so the path never goes missing,
+   * and every call is relative to an fd of the link's directory, kept
+   * open for the links that follow in the same directory.
+   */
+private:
+  fs::path root;
+  const PathPool *paths;
+  std::mutex lock;
+  std::unordered_map<uint32_t, int> dir_fds;
+  int dir_fd(uint32_t dir);
+  bool replace_at(int fd, const char *name, const fs::path &target, const fs::path &path);
+public:
+  LinkFarm(const PathPool *paths_){ paths = paths_; }
+  ~LinkFarm(){ close_dirs(); }
+  void set_root(const fs::path &root_){ root = root_; }
+  bool link(uint32_t dir, const char *name, const fs::path &target, bool replace);
+  bool link_at(const fs::path &path, const fs::path &target);
+  size_t link_missing(FileTable &files, std::vector<uint32_t> rows, const std::vector<fs::path> &tier_dirs);
+  void close_dirs(void);
+};
@@ -19,15 +19,84 @@
 
 #include "config.hpp"
 #include "crawl.hpp"
+#include <cstring>
 #include <iostream>
 
-inline bool config_passed(int argc, char *argv[]){
-  return (argc >= 3 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "--config") == 0));
+void usage(const char *prog){
+  std::cerr << "Usage: " << prog << " [-c|--config <path>] [-d|--daemon] [-m|--mount <dir>] [-p|--plan <path>]" << std::endl;
+  std::cerr << "       " << prog << " [-c|--config <path>] --pin <tier> <dir> | --unpin <dir> | --list-pins" << std::endl;
+  std::cerr << "       " << prog << " [-c|--config <path>] [-p|--plan <path>] -s|--simulate [--trace <path>] [--from-index <path>]" << std::endl;
+  std::cerr << "  -c, --config  configuration file, defaults to " DEFAULT_CONFIG_PATH << std::endl;
+  std::cerr << "  -d, --daemon  keep running and tier files as they are accessed" << std::endl;
+  std::cerr << "  -m, --mount   with --daemon, also show all tiers merged on this directory (needs make FUSE=1)" << std::endl;
+  std::cerr << "  -p, --plan    write each pass's planned moves to this file" << std::endl;
+  std::cerr << "  --pin         keep every file under dir (in any tier) in the tier with this id" << std::endl;
+  std::cerr << "  --unpin       let the files under dir be ranked again" << std::endl;
+  std::cerr << "  --list-pins   print each pinned file's tier and path" << std::endl;
+  std::cerr << "  -s, --simulate  report what the next run would move, and how long it would take, without moving anything" << std::endl;
+  std::cerr << "  --trace       with --simulate, replay the accesses in this file, one \"<unix time> <path>\" per line" << std::endl;
+  std::cerr << "  --from-index  with --simulate, read the files from this metadata index instead of crawling" << std::endl;
 }
 
 int main(int argc, char *argv[]){
-  fs::path config_path = (config_passed(argc, argv))? argv[2] : DEFAULT_CONFIG_PATH;
+  fs::path config_path = DEFAULT_CONFIG_PATH;
+  fs::path plan_path;
+  fs::path mount_path;
+  bool daemon_mode = false;
+  bool list_pins = false;
+  bool simulate = false;
+  fs::path trace_path;
+  fs::path from_index;
+  const char *pin_tier = NULL;
+  const char *pin_dir = NULL;
+  const char *unpin_dir = NULL;
+  for(int i = 1; i < argc; i++){
+    if((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) && i + 1 < argc){
+      config_path = argv[++i];
+    }else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0){
+      daemon_mode = true;
+    }else if((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mount") == 0) && i + 1 < argc){
+      mount_path = argv[++i];
+    }else if((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--plan") == 0) && i + 1 < argc){
+      plan_path = argv[++i];
+    }else if(strcmp(argv[i], "--pin") == 0 && i + 2 < argc){
+      pin_tier = argv[++i];
+      pin_dir = argv[++i];
+    }else if(strcmp(argv[i], "--unpin") == 0 && i + 1 < argc){
+      unpin_dir = argv[++i];
+    }else if(strcmp(argv[i], "--list-pins") == 0){
+      list_pins = true;
+    }else if(strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--simulate") == 0){
+      simulate = true;
+    }else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+      trace_path = argv[++i];
+    }else if(strcmp(argv[i], "--from-index") == 0 && i + 1 < argc){
+      from_index = argv[++i];
+    }else{
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  int commands = (pin_dir != NULL) + (unpin_dir != NULL) + list_pins;
+  if((!mount_path.empty() && !daemon_mode) || commands > 1 || (commands && (daemon_mode || !plan_path.empty()))
+  || (simulate && (commands || daemon_mode)) || (!simulate && (!trace_path.empty() || !from_index.empty()))){
+    usage(argv[0]);
+    return 1;
+  }
   TierEngine autotier(config_path);
-  autotier.begin();
+  if(pin_dir) return (autotier.pin(pin_dir, pin_tier))? 0 : 1;
+  if(unpin_dir) return (autotier.pin(unpin_dir, NULL))? 0 : 1;
+  if(list_pins){
+    autotier.list_pins();
+    return 0;
+  }
+  autotier.save_plan_to(plan_path);
+  autotier.mount_at(mount_path);
+  if(simulate)
+    autotier.simulate(trace_path, from_index);
+  else if(daemon_mode)
+    autotier.run_daemon();
+  else
+    autotier.begin();
   return 0;
 }
@@ -0,0 +1,182 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "metrics.hpp"
+#include "alert.hpp"
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+
+Metrics metrics;
+
+static const char *phase_names[NUM_PHASES] = {
+  "crawl", "sort", "place", "plan", "move", "xattrs", "index"
+};
+
+Histogram::Histogram(){
+  for(std::atomic<uint64_t> &b : buckets)
+    b = 0;
+  count = sum_ns = 0;
+}
+
+void Histogram::observe(uint64_t ns){
+  size_t b = 0;
+  for(uint64_t bound = 1000; b < METRICS_BUCKETS && ns > bound; bound *= 4)
+    b++;
+  buckets[b].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void Histogram::write(std::ostream &os, const char *name, const char *help) const{
+  os << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+  uint64_t cumulative = 0;
+  double bound = 1e-6;
+  for(size_t b = 0; b < METRICS_BUCKETS; b++, bound *= 4){
+    cumulative += buckets[b];
+    os << name << "_bucket{le=\"" << bound << "\"} " << cumulative << "\n";
+  }
+  cumulative += buckets[METRICS_BUCKETS];
+  os << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+  os << name << "_sum " << sum_ns / 1e9 << "\n";
+  os << name << "_count " << count << "\n";
+}
+
+Metrics::Metrics(){
+  enabled = false;
+  runs = 0;
+  for(size_t p = 0; p < NUM_PHASES; p++)
+    phase_ns[p] = phase_total_ns[p] = 0;
+  bytes_copied = copy_failures = verify_failures = 0;
+  xattr_writes = xattr_write_failures = 0;
+}
+
+void Metrics::init(const std::vector<std::string> &ids, bool enabled_){
+  tier_ids = ids;
+  enabled = enabled_;
+  files.assign(ids.size(), 0);
+  files_crawled.assign(ids.size(), 0);
+  size_t n = 3 * ids.size() * ids.size();
+  pair_counters.reset(new std::atomic<uint64_t>[n]);
+  for(size_t i = 0; i < n; i++)
+    pair_counters[i] = 0;
+}
+
+void Metrics::begin_run(){
+  for(size_t p = 0; p < NUM_PHASES; p++)
+    phase_ns[p] = 0;
+}
+
+std::atomic<uint64_t> &Metrics::pair(size_t which, size_t from, size_t to) const{
+  return pair_counters[(which * tier_ids.size() + from) * tier_ids.size() + to];
+}
+
+void Metrics::moved(size_t from, size_t to, int64_t bytes, bool ok){
+  if(!pair_counters) return;
+  if(ok){
+    pair(0, from, to).fetch_add(bytes, std::memory_order_relaxed);
+    pair(1, from, to).fetch_add(1, std::memory_order_relaxed);
+  }else{
+    pair(2, from, to).fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+static std::string label(const std::string &value){
+  // tier names are free text, escape them for the exposition format
+  std::string out;
+  for(char c : value){
+    if(c == '\\' || c == '"') out.push_back('\\');
+    if(c == '\n'){
+      out += "\\n";
+      continue;
+    }
+    out.push_back(c);
+  }
+  return out;
+}
+
+void Metrics::write(std::ostream &os) const{
+  os << "# HELP autotier_runs_total Tiering passes, including daemon passes.\n"
+    "# TYPE autotier_runs_total counter\nautotier_runs_total " << runs << "\n";
+  os << "# HELP autotier_last_run_timestamp_seconds When the last pass finished.\n"
+    "# TYPE autotier_last_run_timestamp_seconds gauge\nautotier_last_run_timestamp_seconds " << time(NULL) << "\n";
+  os << "# HELP autotier_phase_seconds Wall time of each phase in the last pass.\n"
+    "# TYPE autotier_phase_seconds gauge\n";
+  for(size_t p = 0; p < NUM_PHASES; p++)
+    os << "autotier_phase_seconds{phase=\"" << phase_names[p] << "\"} " << phase_ns[p] / 1e9 << "\n";
+  os << "# HELP autotier_phase_seconds_total Wall time of each phase over all passes.\n"
+    "# TYPE autotier_phase_seconds_total counter\n";
+  for(size_t p = 0; p < NUM_PHASES; p++)
+    os << "autotier_phase_seconds_total{phase=\"" << phase_names[p] << "\"} " << phase_total_ns[p] / 1e9 << "\n";
+  os << "# HELP autotier_files Files in each tier after the last pass.\n# TYPE autotier_files gauge\n";
+  for(size_t t = 0; t < tier_ids.size(); t++)
+    os << "autotier_files{tier=\"" << label(tier_ids[t]) << "\"} " << files[t] << "\n";
+  os << "# HELP autotier_files_crawled_total Files found by full crawls.\n# TYPE autotier_files_crawled_total counter\n";
+  for(size_t t = 0; t < tier_ids.size(); t++)
+    os << "autotier_files_crawled_total{tier=\"" << label(tier_ids[t]) << "\"} " << files_crawled[t] << "\n";
+  const char *pair_names[3][2] = {
+    {"autotier_moved_bytes_total", "Bytes moved between tiers."},
+    {"autotier_moves_total", "Files moved between tiers."},
+    {"autotier_move_failures_total", "Moves that failed and left the file in place."}
+  };
+  for(size_t which = 0; which < 3; which++){
+    os << "# HELP " << pair_names[which][0] << " " << pair_names[which][1] << "\n# TYPE " << pair_names[which][0] << " counter\n";
+    for(size_t from = 0; from < tier_ids.size(); from++){
+      for(size_t to = 0; to < tier_ids.size(); to++){
+        if(from == to) continue;
+        os << pair_names[which][0] << "{from=\"" << label(tier_ids[from]) << "\",to=\"" << label(tier_ids[to]) << "\"} "
+          << pair(which, from, to) << "\n";
+      }
+    }
+  }
+  stat_latency.write(os, "autotier_stat_seconds", "Latency of stat calls while crawling without io_uring.");
+  xattr_read_latency.write(os, "autotier_xattr_read_seconds", "Latency of xattr reads while crawling without io_uring.");
+  copy_latency.write(os, "autotier_copy_seconds", "Time to copy one file between tiers, without verification.");
+  verify_latency.write(os, "autotier_verify_seconds", "Time to verify one copied file.");
+  os << "# HELP autotier_copied_bytes_total Bytes copied, renames excluded.\n"
+    "# TYPE autotier_copied_bytes_total counter\nautotier_copied_bytes_total " << bytes_copied << "\n";
+  os << "# HELP autotier_copy_failures_total Copies that failed with an I/O error.\n"
+    "# TYPE autotier_copy_failures_total counter\nautotier_copy_failures_total " << copy_failures << "\n";
+  os << "# HELP autotier_verify_failures_total Copies that did not match their source.\n"
+    "# TYPE autotier_verify_failures_total counter\nautotier_verify_failures_total " << verify_failures << "\n";
+  os << "# HELP autotier_xattr_writes_total Packed metadata xattrs written.\n"
+    "# TYPE autotier_xattr_writes_total counter\nautotier_xattr_writes_total " << xattr_writes << "\n";
+  os << "# HELP autotier_xattr_write_failures_total Packed metadata xattrs that could not be written.\n"
+    "# TYPE autotier_xattr_write_failures_total counter\nautotier_xattr_write_failures_total " << xattr_write_failures << "\n";
+}
+
+bool Metrics::save(const fs::path &path) const{
+  // the textfile collector may read at any time, so replace the file in one step
+  fs::path tmp = path.string() + ".tmp";
+  {
+    std::ofstream f(tmp.string());
+    if(!f){
+      Log("Cannot write metrics to " + tmp.string(), 0);
+      return false;
+    }
+    write(f);
+    if(!f) return false;
+  }
+  if(rename(tmp.c_str(), path.c_str()) != 0){
+    Log("Cannot write metrics to " + path.string(), 0);
+    return false;
+  }
+  return true;
+}
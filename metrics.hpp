@@ -0,0 +1,110 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <time.h>
+namespace fs = boost::filesystem;
+
+#define METRICS_BUCKETS 15 // upper bounds of 1us * 4^k, up to about 4.5 minutes
+
+inline uint64_t metrics_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+class Histogram{
+  /*
+   * Latencies in nanoseconds, observed from any thread. Written out
+   * with cumulative buckets in seconds, as Prometheus expects.
+   */
+private:
+  std::atomic<uint64_t> buckets[METRICS_BUCKETS + 1]; // the last one is +Inf
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum_ns;
+public:
+  Histogram();
+  void observe(uint64_t ns);
+  void write(std::ostream &os, const char *name, const char *help) const;
+};
+
+enum Phase{PHASE_CRAWL, PHASE_SORT, PHASE_PLACE, PHASE_PLAN, PHASE_MOVE, PHASE_XATTRS, PHASE_INDEX, NUM_PHASES};
+
+class Metrics{
+  /*
+   * Counters and histograms for one process, shared by every thread
+   * through the global below. Per tier and per tier pair counters are
+   * sized by init(). Latencies are only timed once enabled, so an
+   * unconfigured run does not pay for the clock reads.
+   */
+private:
+  std::vector<std::string> tier_ids;
+  std::unique_ptr<std::atomic<uint64_t>[]> pair_counters; // moved bytes, moves, failures per (from, to)
+  std::atomic<uint64_t> &pair(size_t which, size_t from, size_t to) const;
+public:
+  bool enabled;
+  uint64_t phase_ns[NUM_PHASES]; // since begin_run()
+  uint64_t phase_total_ns[NUM_PHASES];
+  uint64_t runs;
+  std::vector<uint64_t> files; // per tier, after the last run
+  std::vector<uint64_t> files_crawled;
+  Histogram stat_latency;
+  Histogram xattr_read_latency;
+  Histogram copy_latency;
+  Histogram verify_latency;
+  std::atomic<uint64_t> bytes_copied;
+  std::atomic<uint64_t> copy_failures;
+  std::atomic<uint64_t> verify_failures;
+  std::atomic<uint64_t> xattr_writes;
+  std::atomic<uint64_t> xattr_write_failures;
+  Metrics();
+  void init(const std::vector<std::string> &ids, bool enabled_);
+  void begin_run(void);
+  void moved(size_t from, size_t to, int64_t bytes, bool ok);
+  void write(std::ostream &os) const;
+  bool save(const fs::path &path) const;
+};
+
+extern Metrics metrics;
+
+class PhaseTimer{
+  // adds the time until it goes out of scope to a phase
+private:
+  enum Phase phase;
+  uint64_t start;
+public:
+  PhaseTimer(enum Phase phase_){
+    phase = phase_;
+    start = metrics_now();
+  }
+  ~PhaseTimer(){
+    uint64_t ns = metrics_now() - start;
+    metrics.phase_ns[phase] += ns;
+    metrics.phase_total_ns[phase] += ns;
+  }
+};
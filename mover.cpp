@@ -0,0 +1,210 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "mover.hpp"
+#include "crawl.hpp"
+#include "alert.hpp"
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// from linux/ioprio.h, which older kernel headers do not have
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+static int ioprio_value(int prio){
+  if(prio == IO_PRIORITY_IDLE) return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+  return (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | prio;
+}
+
+int parse_io_priority(const std::string &value){
+  if(value == "idle") return IO_PRIORITY_IDLE;
+  if(value.length() == 1 && value[0] >= '0' && value[0] <= '7') return value[0] - '0';
+  return ERR;
+}
+
+std::string io_priority_name(int prio){
+  if(prio == IO_PRIORITY_IDLE) return "idle";
+  return std::to_string(prio);
+}
+
+int lower_io_priority(int a, int b){
+  if(a == IO_PRIORITY_UNSET) return b;
+  if(b == IO_PRIORITY_UNSET) return a;
+  return (a > b)? a : b;
+}
+
+IoPriority::IoPriority(){
+  base = current = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+}
+
+void IoPriority::set(int prio){
+  int want = (prio == IO_PRIORITY_UNSET)? base : ioprio_value(prio);
+  if(want != current && want != ERR && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, want) == 0)
+    current = want;
+}
+
+Mover::Mover(const std::vector<Tier> &tiers, int default_threads, int64_t expedite_size_, Capacity *capacity_){
+  in_flight = 0;
+  num_expedited = 0;
+  expedite_size = expedite_size_;
+  capacity = capacity_;
+  plan = NULL;
+  for(const Tier &t : tiers){
+    tier_prio.push_back(t.io_priority);
+    struct stat info;
+    dev_t dev = (stat(t.dir.c_str(), &info) == 0)? info.st_dev : 0;
+    int limit = (t.move_threads > 0)? t.move_threads : default_threads;
+    size_t d;
+    for(d = 0; d < devices.size() && devices[d].dev != dev; d++);
+    if(d == devices.size()){
+      devices.push_back(Device{dev, limit, 0});
+    }else if(limit < devices[d].limit){
+      devices[d].limit = limit; // tiers sharing a device get the lowest limit
+    }
+    tier_dev.push_back(d);
+  }
+}
+
+bool Mover::fits(const Move &m, int64_t size){
+  // reserves the space when it does
+  const Device &src = devices[tier_dev[m.from]];
+  const Device &dst = devices[tier_dev[m.to]];
+  if(&src == &dst) return src.active < src.limit; // rename or copy within one device
+  return src.active < src.limit && dst.active < dst.limit && capacity->reserve(m.from, m.to, size);
+}
+
+bool Mover::next(Move &m, bool &expedited, const FileTable &files){
+  /*
+   * Called with the lock held. Takes the first queue head that can start
+   * now, waiting for running moves if none can. Heads that still do not
+   * fit once nothing is running never will, so they are dropped.
+   */
+  std::unique_lock<std::mutex> guard(lock, std::adopt_lock);
+  for(;;){
+    bool pending = false;
+    for(size_t i = 0; i < queues.size(); i++){
+      std::deque<Move> &q = queues[i];
+      if(q.empty()) continue;
+      pending = true;
+      if(fits(q.front(), plan->alloc_of(q.front(), files))){
+        m = q.front();
+        q.pop_front();
+        expedited = (i < num_expedited);
+        guard.release();
+        return true;
+      }
+    }
+    if(!pending){
+      guard.release();
+      return false;
+    }
+    if(in_flight == 0){
+      // every head was just tried with nothing running
+      for(std::deque<Move> &q : queues){
+        if(q.empty()) continue;
+        Log("Not enough free space to move " + std::to_string(plan->alloc_of(q.front(), files)) + " bytes, skipping.", 1);
+        q.pop_front();
+      }
+      continue;
+    }
+    done_cv.wait(guard);
+  }
+}
+
+void Mover::worker(const FileTable &files, const std::function<bool(const Move &)> &move){
+  IoPriority io_priority;
+  Move m;
+  bool expedited;
+  lock.lock();
+  while(next(m, expedited, files)){
+    Device &src = devices[tier_dev[m.from]];
+    Device &dst = devices[tier_dev[m.to]];
+    bool same = (&src == &dst);
+    src.active++;
+    if(!same) dst.active++;
+    in_flight++;
+    lock.unlock();
+    io_priority.set((expedited)? IO_PRIORITY_UNSET : lower_io_priority(tier_prio[m.from], tier_prio[m.to]));
+    bool moved = move(m);
+    lock.lock();
+    src.active--;
+    if(!same){
+      dst.active--;
+      capacity->release(m.from, m.to, plan->alloc_of(m, files), moved);
+    }
+    in_flight--;
+    done_cv.notify_all();
+  }
+  lock.unlock();
+}
+
+void Mover::run(const MovePlan &plan_, const FileTable &files, const std::function<bool(const Move &)> &move){
+  plan = &plan_;
+  size_t num_tiers = tier_dev.size();
+  /*
+   * Expedited promotions get queues of their own, one per pair like the
+   * rest. A head that has no room yet does not hold back the demotions
+   * that would make room for it.
+   */
+  std::vector<std::deque<Move>> expedited(num_tiers * num_tiers);
+  // demotion pairs first, slowest destinations first; the plan's order is kept within a pair
+  std::vector<size_t> rank;
+  for(size_t to = num_tiers; to-- > 0; )
+    for(size_t from = 0; from < to; from++)
+      rank.push_back(from * num_tiers + to);
+  for(size_t to = 0; to < num_tiers; to++)
+    for(size_t from = num_tiers; from-- > to + 1; )
+      rank.push_back(from * num_tiers + to);
+  std::vector<std::deque<Move>> by_pair(num_tiers * num_tiers);
+  size_t num_fast = 0;
+  for(const Move &m : plan->moves){
+    if(m.to < m.from && expedite_size > 0 && (files.priority[m.file] & TOP_PRIORITY_BIT)
+    && plan->files_of(m) == 1 && plan->alloc_of(m, files) <= expedite_size){
+      expedited[m.from * num_tiers + m.to].push_back(m);
+      num_fast++;
+    }else{
+      by_pair[m.from * num_tiers + m.to].push_back(m);
+    }
+  }
+  if(num_fast) Log("Expediting " + std::to_string(num_fast) + " promotions of recently read files.",2);
+  queues.clear();
+  for(size_t to = 0; to < num_tiers; to++){
+    for(size_t from = num_tiers; from-- > to + 1; ){
+      std::deque<Move> &q = expedited[from * num_tiers + to];
+      if(!q.empty()) queues.push_back(std::move(q));
+    }
+  }
+  num_expedited = queues.size();
+  for(size_t r : rank)
+    queues.push_back(std::move(by_pair[r]));
+  size_t num_workers = 0;
+  for(const Device &d : devices)
+    num_workers += d.limit;
+  if(num_workers > plan->moves.size()) num_workers = plan->moves.size();
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < num_workers; i++)
+    threads.emplace_back(&Mover::worker, this, std::cref(files), std::cref(move));
+  for(std::thread &t : threads)
+    t.join();
+}
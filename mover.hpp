@@ -0,0 +1,102 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "plan.hpp"
+#include "capacity.hpp"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#define DEFAULT_MOVE_THREADS 2
+#define DEFAULT_EXPEDITE_SIZE (1 << 20)
+#define EXPEDITE_DELAY 5 // seconds a daemon pass brought forward by a read waits for more of them
+
+// IO_PRIORITY: best-effort levels 0 (highest) to 7, then the idle class
+#define IO_PRIORITY_IDLE 8
+#define IO_PRIORITY_UNSET 9 // moves keep the priority autotier was started with
+
+class Tier; // forward declaration
+class FileTable; // forward declaration
+
+class IoPriority{
+  /*
+   * The calling thread's I/O priority, as an IO_PRIORITY value. Linux
+   * keeps it per thread, and threads started later inherit it, such as
+   * the chunk threads of a large transfer. It only has an effect on
+   * schedulers that honour it, like BFQ.
+   */
+private:
+  int base; // what the thread started with, back for IO_PRIORITY_UNSET
+  int current;
+public:
+  IoPriority();
+  void set(int prio);
+};
+
+class Mover{
+  /*
+   * Runs a MovePlan on several threads. Tiers on the same device share
+   * one concurrency limit, and a move needs a free slot on both its
+   * source and destination devices plus room on the destination, which
+   * is reserved in the Capacity the plan was made from as copies start
+   * and settled as sources are removed. Demotions are always tried first so they free space before
+   * promotions need it, but a long demotion no longer holds up
+   * promotions between other devices. Ahead of them all go promotions
+   * of small files read since the last pass, which are what clients are
+   * waiting on; these run at the starting I/O priority, every other
+   * move at the lower IO_PRIORITY of its two tiers.
+   */
+private:
+  struct Device{
+    dev_t dev;
+    int limit;
+    int active;
+  };
+  std::vector<Device> devices;
+  std::vector<size_t> tier_dev; // tier index -> devices index
+  std::vector<int> tier_prio; // tier index -> IO_PRIORITY
+  std::vector<std::deque<Move>> queues; // one per (from, to) pair, demotions first
+  size_t num_expedited; // queues at the front that hold expedited promotions
+  int64_t expedite_size;
+  size_t in_flight;
+  Capacity *capacity;
+  const MovePlan *plan; // while it runs
+  std::mutex lock;
+  std::condition_variable done_cv;
+  bool fits(const Move &m, int64_t size);
+  bool next(Move &m, bool &expedited, const FileTable &files);
+  void worker(const FileTable &files, const std::function<bool(const Move &)> &move);
+public:
+  Mover(const std::vector<Tier> &tiers, int default_threads, int64_t expedite_size_, Capacity *capacity_);
+  void run(const MovePlan &plan, const FileTable &files, const std::function<bool(const Move &)> &move);
+};
+
+int parse_io_priority(const std::string &value);
+
+int lower_io_priority(int a, int b);
+
+std::string io_priority_name(int prio);
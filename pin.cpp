@@ -0,0 +1,155 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "crawl.hpp"
+#include "crawler.hpp"
+#include "alert.hpp"
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+bool tier_relative(const std::vector<Tier> &tiers, const fs::path &target, fs::path &rel){
+  // a path in any tier, or one relative to all of them
+  if(!target.is_absolute()){
+    rel = target;
+    return true;
+  }
+  const std::string &str = target.string();
+  for(const Tier &t : tiers){
+    const std::string &dir = t.dir.string();
+    if(str.compare(0, dir.length(), dir) != 0) continue;
+    if(str.length() == dir.length()){
+      rel = fs::path();
+      return true;
+    }
+    if(str[dir.length()] == '/'){
+      rel = str.substr(dir.length() + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TierEngine::pin(const fs::path &target, const char *tier_name){
+  /*
+   * Pins every file under a directory to one tier, or unpins them with
+   * tier_name NULL, in each tier the directory is in. Only the pin in
+   * each file's xattr changes; the other values are written back as
+   * they were read, so the next run ages and counts them as usual. The
+   * crawler's threads write the xattrs as they list the directories,
+   * and the index is patched to match since directories' mtimes do not
+   * change. Files get to their tier at the next run.
+   */
+  std::string pin;
+  if(tier_name){
+    int t = pinned_tier(tier_name);
+    if(t == ERR){
+      Log(std::string("No tier named ") + tier_name, 0);
+      return false;
+    }
+    pin = tiers[t].dir.string();
+  }
+  fs::path rel;
+  if(!tier_relative(tiers, target, rel)){
+    Log(target.string() + " is not in a tier", 0);
+    return false;
+  }
+  std::vector<fs::path> roots;
+  Crawler crawler(&paths, config.num_threads, config.uring_depth);
+  uint32_t dir_id = paths.add_path(rel);
+  for(uint16_t t = 0; t < tiers.size(); t++){
+    fs::path root = tiers[t].dir / rel;
+    if(!is_directory(symlink_status(root))) continue;
+    roots.push_back(root);
+    crawler.push(root, &tiers[t], t, dir_id);
+  }
+  if(roots.empty()){
+    Log("No directory " + rel.string() + " in any tier", 0);
+    return false;
+  }
+  std::atomic<size_t> written(0);
+  crawler.set_sink([&](FileTable &rows, uint32_t first, const CrawlJob &job){
+    MetaValues meta;
+    for(uint32_t i = first; i < rows.count(); i++){
+      // the row's values are already aged, so they are read again
+      fs::path path = job.dir / rows.name_of(i);
+      meta.have_atime = meta.have_priority = meta.have_heat = meta.legacy = false;
+      read_meta(ERR, path.c_str(), meta);
+      std::string value = pack_meta((meta.have_atime)? meta.last_atime : rows.atime[i],
+        (meta.have_priority)? meta.priority : rows.priority[i], (meta.have_heat)? meta.heat : rows.heat[i],
+        (tier_name)? pin.c_str() : NULL);
+      if(write_meta(path.c_str(), value, meta.legacy)) written++;
+    }
+    rows.truncate(first);
+  });
+  crawler.launch();
+  // every node's segment, since the files under dir may be in any node's share
+  for(int n = 0; n < config.nodes && !config.index_path.empty(); n++){
+    size_t indexed = 0;
+    fs::path index_path = config.index_segment(n);
+    if(MetaIndex::pin_subtree(index_path, roots, (tier_name)? pin.c_str() : NULL, indexed))
+      Log("Updated " + std::to_string(indexed) + " files in metadata index " + index_path.string(), 2);
+  }
+  if(tier_name)
+    Log("Pinned " + std::to_string(written) + " files to " + tier_name + ".", 1);
+  else
+    Log("Unpinned " + std::to_string(written) + " files.", 1);
+  return true;
+}
+
+void TierEngine::list_pins(){
+  /*
+   * Prints the pinned files as tier and path. With a metadata index
+   * they come from its pin table, as of the last run or pin command;
+   * without one every tier is crawled.
+   */
+  std::mutex out_lock;
+  auto print = [&](const char *pin, const std::string &path){
+    int t = pinned_tier(pin);
+    std::lock_guard<std::mutex> guard(out_lock);
+    std::cout << ((t == ERR)? std::string(pin) : tiers[t].id) << '\t' << path << std::endl;
+  };
+  // a shared index is only used whole, with a segment from every node
+  bool indexed = !config.index_path.empty();
+  for(int n = 0; n < config.nodes && indexed; n++)
+    indexed = index.load(config.index_segment(n));
+  for(int n = 0; n < config.nodes && indexed; n++){
+    index.load(config.index_segment(n));
+    for(const IndexPin *p = index.pins_begin(); p != index.pins_end(); ++p){
+      const IndexEntry &e = index.entry_at(p->entry);
+      const char *dir = index.string(index.dir_at(p->dir).path);
+      const char *name = index.string(e.name);
+      const char *pin = index.string(e.pin);
+      if(dir && name && pin) print(pin, std::string(dir) + '/' + name);
+    }
+    index.unload();
+  }
+  if(indexed) return;
+  Crawler crawler(&paths, config.num_threads, config.uring_depth);
+  for(uint16_t t = 0; t < tiers.size(); t++)
+    crawler.push(tiers[t].dir, &tiers[t], t);
+  crawler.set_sink([&](FileTable &rows, uint32_t first, const CrawlJob &job){
+    for(uint32_t i = first; i < rows.count(); i++){
+      const char *pin = rows.pin_of(i);
+      if(pin) print(pin, (job.dir / rows.name_of(i)).string());
+    }
+    rows.truncate(first);
+  });
+  crawler.launch();
+}
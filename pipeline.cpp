@@ -0,0 +1,205 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "crawl.hpp"
+#include "crawler.hpp"
+#include "pipeline.hpp"
+#include "alert.hpp"
+#include <iterator>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <unordered_map>
+
+struct Ranked{
+  // a crawled file as the ranking stage sees it, named only if it is in the first tier
+  uint64_t hi;
+  uint64_t lo;
+  int64_t size;
+  int64_t alloc;
+  int64_t atime;
+  int64_t mtime;
+  std::string key; // PathPool dir id and name, to find the row again after the crawl
+  std::string rel;
+};
+
+static std::string row_key(uint32_t dir, const char *name){
+  return std::to_string(dir) + '/' + name;
+}
+
+bool TierEngine::can_demote_early(int64_t &first_budget){
+  /*
+   * A file in the first tier can only be demoted before the crawl ends
+   * if where it goes is already certain. Whether it leaves the first
+   * tier is (see demote_while_crawling); that it lands in the second is
+   * only certain if the second can take every file there is, which is
+   * checked against the space used on all tiers. Move budgets pick
+   * moves from the whole plan, files open through the union mount
+   * must be claimed first, and a unit is only known once all of its
+   * files are, so none of them is done early. Neither is anything in a
+   * dry run.
+   */
+  if(dry_run || tiers.size() < 2 || config.move_budget || config.move_budget_files || mounted || config.placing_units()) return false;
+  // nothing is counted yet, so the first tier's share is at its largest; a file that misses it misses the real one
+  capacity.probe(tiers);
+  first_budget = capacity.limit(0, tiers.front().max_watermark);
+  int64_t second_budget = capacity.limit(1, tiers[1].min_watermark);
+  if(first_budget < 0 || second_budget <= 0) return false;
+  return capacity.total_used() < second_budget;
+}
+
+void TierEngine::demote_while_crawling(Crawler &crawler, int64_t first_budget, DemotedFiles &demoted){
+  /*
+   * Runs the crawl with two more stages behind it. Crawler threads
+   * score each file as its directory is done and queue it for a single
+   * ranking thread, which keeps the hottest files seen so far until
+   * they add up to the first tier's MAX_WATERMARK. Files that fall out
+   * of that set can never make it back in, since files found later only
+   * push them further down, so the ones still in the first tier are
+   * handed to mover threads and demoted while the crawl goes on. The
+   * movers take what the ranking thread gives them only while they keep
+   * up; whatever they do not get to is left to the plan.
+   */
+  const std::string root = tiers.front().dir.string();
+  enum ScoreModel model = tiers.front().score_model;
+  demoted_at = time(NULL);
+  BoundedQueue<Ranked> crawled(PIPELINE_QUEUE_SZ);
+  BoundedQueue<Ranked> cold(PIPELINE_MOVE_QUEUE_SZ);
+  std::mutex done_lock;
+  std::atomic<size_t> started(0);
+  crawler.set_sink([&](FileTable &rows, uint32_t first, const CrawlJob &job){
+    // heats are counted here instead of after the crawl, scores need them
+    const std::string &dir = job.dir.string();
+    std::string rel_dir = (dir.length() > root.length())? dir.substr(root.length() + 1) + '/' : std::string();
+    for(uint32_t i = first; i < rows.count(); i++){
+      if(rows.priority[i] & TOP_PRIORITY_BIT)
+        rows.heat[i] = heat_after_access(rows.heat[i], rows.atime[i], config.half_life);
+      // pinned files only shrink the first tier's real share, leaving them out keeps every demotion safe
+      if(!rows.pins.empty() && pinned_tier(rows.pin_of(i)) != ERR) continue;
+      if(job.tier == 1 && started){
+        // a copy demoted before its directory here was listed, already ranked from the first tier
+        std::lock_guard<std::mutex> guard(done_lock);
+        if(demoted.count(row_key(job.dir_id, rows.name_of(i)))) continue;
+      }
+      SortKey k(file_score(model, rows, i, config.half_life, demoted_at), rows.atime[i], i);
+      Ranked r{k.hi, k.lo, rows.size[i], rows.alloc[i], rows.atime[i], rows.mtime[i], std::string(), std::string()};
+      if(job.tier == 0){
+        r.key = row_key(job.dir_id, rows.name_of(i));
+        r.rel = rel_dir + rows.name_of(i);
+      }
+      crawled.push(std::move(r));
+    }
+  });
+  std::thread ranker([&](){
+    std::map<std::pair<uint64_t, uint64_t>, std::vector<Ranked>> hottest; // coldest last
+    int64_t held = 0;
+    Ranked r;
+    while(crawled.pop(r)){
+      held += r.alloc;
+      hottest[std::make_pair(r.hi, r.lo)].push_back(std::move(r));
+      while(!hottest.empty()){
+        // files tied with each other leave together, or not at all
+        std::map<std::pair<uint64_t, uint64_t>, std::vector<Ranked>>::iterator coldest = std::prev(hottest.end());
+        int64_t tied = 0;
+        for(const Ranked &c : coldest->second)
+          tied += c.alloc;
+        if(held - tied < first_budget) break;
+        held -= tied;
+        for(Ranked &c : coldest->second)
+          if(!c.rel.empty()) cold.try_push(std::move(c));
+        hottest.erase(coldest);
+      }
+    }
+    cold.close();
+  });
+  std::vector<std::thread> movers;
+  for(int m = 0; m < config.move_threads; m++){
+    movers.emplace_back([&](){
+      IoPriority io_priority;
+      io_priority.set(lower_io_priority(tiers[0].io_priority, tiers[1].io_priority));
+      Ranked r;
+      while(cold.pop(r)){
+        if(!capacity.reserve(0, 1, r.alloc)) continue; // the plan makes room for it later
+        {
+          // entered before the copy appears, so the crawl of the second tier skips it
+          std::lock_guard<std::mutex> guard(done_lock);
+          demoted[r.key] = false;
+          started++;
+        }
+        bool linked = false;
+        bool moved = move_early(r.rel, r.atime, r.mtime, linked);
+        capacity.release(0, 1, r.alloc, moved);
+        metrics.moved(0, 1, r.size, moved);
+        std::lock_guard<std::mutex> guard(done_lock);
+        if(moved)
+          demoted[r.key] = linked;
+        else
+          demoted.erase(r.key);
+      }
+    });
+  }
+  crawler.launch();
+  crawled.close();
+  ranker.join();
+  for(std::thread &t : movers)
+    t.join();
+  crawler.set_sink(RowSink());
+}
+
+bool TierEngine::move_early(const std::string &rel, int64_t atime, int64_t mtime, bool &linked){
+  // same as move_file from the first tier to the second, by path since there are no rows yet
+  CopyOptions copy = {copy_method(0, 1), tiers[1].verify_mode, (enum HashAlgo)config.hash_algo, config.num_threads,
+    (tiers[1].move_threads > 0)? tiers[1].move_threads : config.move_threads};
+  File f(tiers[0].dir/rel, tiers[1].dir/rel, atime, mtime, copy);
+  f.keep_source = true;
+  try{
+    if(!f.move()) return false;
+  }catch(const fs::filesystem_error &e){
+    Log(std::string("Error moving file: ") + e.what(), 0);
+    return false;
+  }
+  linked = links.link_at(f.old_path, f.new_path);
+  if(!linked) remove(f.old_path);
+  return true;
+}
+
+void TierEngine::settle_demoted(uint32_t first, const DemotedFiles &demoted){
+  /*
+   * The rows of demoted files still say they are in the first tier. A
+   * crawler that listed the second tier's directory after the file got
+   * there found it twice; the copy has no xattrs yet, so the row from
+   * the first tier is the one kept.
+   */
+  size_t settled = 0;
+  for(uint32_t i = first; i < files.count(); i++){
+    if(files.tier[i] > 1) continue;
+    DemotedFiles::const_iterator itr = demoted.find(row_key(files.dir[i], files.name_of(i)));
+    if(itr == demoted.end()) continue;
+    if(files.tier[i] == 1){
+      files.flags[i] |= FILE_REMOVED;
+      continue;
+    }
+    files.tier[i] = 1;
+    files.flags[i] |= FILE_META_DIRTY; // a copy does not carry the xattr
+    if(itr->second) files.flags[i] |= FILE_LINKED;
+    settled++;
+  }
+  Log("Demoted " + std::to_string(settled) + " files while crawling.", 2);
+}
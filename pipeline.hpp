@@ -0,0 +1,78 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#define PIPELINE_QUEUE_SZ 4096 // crawled files waiting to be ranked
+#define PIPELINE_MOVE_QUEUE_SZ 256 // early demotions waiting for a mover
+
+template<typename T>
+class BoundedQueue{
+  /*
+   * Hands items from one pipeline stage to the next. push() blocks
+   * while the queue is full, so a stage cannot run further ahead of the
+   * next than the capacity; try_push() gives up instead, for stages
+   * whose work can just as well be left for later. pop() returns false
+   * once the queue is closed and empty.
+   */
+private:
+  std::deque<T> items;
+  size_t capacity;
+  bool closed;
+  std::mutex lock;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+public:
+  BoundedQueue(size_t capacity_){
+    capacity = capacity_;
+    closed = false;
+  }
+  void push(T &&item){
+    std::unique_lock<std::mutex> guard(lock);
+    not_full.wait(guard, [this]{ return items.size() < capacity; });
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+  }
+  bool try_push(T &&item){
+    std::lock_guard<std::mutex> guard(lock);
+    if(items.size() >= capacity) return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+  bool pop(T &item){
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [this]{ return !items.empty() || closed; });
+    if(items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  void close(void){
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    not_empty.notify_all();
+  }
+};
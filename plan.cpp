@@ -0,0 +1,120 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "plan.hpp"
+#include "crawl.hpp"
+#include "alert.hpp"
+#include "units.hpp"
+#include <algorithm>
+#include <fstream>
+
+void MovePlan::clear(){
+  moves.clear();
+  links.clear();
+}
+
+void MovePlan::build(const std::vector<Tier> &tiers, const FileTable &files, const PlacementUnits *units_){
+  clear();
+  units = units_;
+  for(size_t t = tiers.size(); t-- > 0; ){
+    for(uint32_t i : tiers[t].incoming_files){
+      uint32_t u = (units)? units->unit_of(i) : NO_UNIT;
+      uint16_t from = (u == NO_UNIT)? files.tier[i] : units->from_tier(u, files, t);
+      if(from != t)
+        moves.push_back(Move{i, from, (uint16_t)t});
+      else
+        links.push_back(i);
+    }
+  }
+}
+
+int64_t MovePlan::size_of(const Move &m, const FileTable &files) const{
+  uint32_t u = (units)? units->unit_of(m.file) : NO_UNIT;
+  return (u == NO_UNIT)? files.size[m.file] : units->size[u];
+}
+
+int64_t MovePlan::alloc_of(const Move &m, const FileTable &files) const{
+  uint32_t u = (units)? units->unit_of(m.file) : NO_UNIT;
+  return (u == NO_UNIT)? files.alloc[m.file] : units->alloc[u];
+}
+
+size_t MovePlan::files_of(const Move &m) const{
+  uint32_t u = (units)? units->unit_of(m.file) : NO_UNIT;
+  return (u == NO_UNIT)? 1 : units->first[u + 1] - units->first[u];
+}
+
+size_t MovePlan::limit(const FileTable &files, const std::vector<uint64_t> &benefit, int64_t max_bytes, size_t max_files){
+  /*
+   * Keeps the moves that fit in a per-run budget, 0 meaning no limit.
+   * Demotions are kept first since promotions need the room they free,
+   * and within each the moves with the highest benefit (one per move)
+   * go first. Returns how many moves were held back for a later run.
+   */
+  std::vector<size_t> picks(moves.size());
+  for(size_t k = 0; k < picks.size(); k++)
+    picks[k] = k;
+  std::stable_sort(picks.begin(), picks.end(), [this, &benefit](size_t a, size_t b){
+    bool demote_a = moves[a].to > moves[a].from, demote_b = moves[b].to > moves[b].from;
+    if(demote_a != demote_b) return demote_a;
+    return benefit[a] > benefit[b];
+  });
+  std::vector<Move> kept;
+  int64_t total = 0;
+  size_t total_files = 0;
+  for(size_t k : picks){
+    const Move &m = moves[k];
+    if(max_files && total_files + files_of(m) > max_files) continue;
+    if(max_bytes && total + size_of(m, files) > max_bytes) continue; // a smaller one may still fit
+    total += size_of(m, files);
+    total_files += files_of(m);
+    kept.push_back(m);
+  }
+  size_t held = moves.size() - kept.size();
+  moves.swap(kept);
+  return held;
+}
+
+int64_t MovePlan::bytes(const FileTable &files) const{
+  int64_t total = 0;
+  for(const Move &m : moves)
+    total += size_of(m, files);
+  return total;
+}
+
+void MovePlan::write(std::ostream &os, const std::vector<Tier> &tiers, const FileTable &files, const PathPool &paths) const{
+  // one tab separated line per move: source tier, destination tier, size, path in the tier
+  os << "# autotier move plan: " << moves.size() << " files, " << bytes(files) << " bytes" << std::endl;
+  for(const Move &m : moves){
+    // a unit is listed once, as its directory with a trailing slash
+    uint32_t u = (units)? units->unit_of(m.file) : NO_UNIT;
+    os << tiers[m.from].id << '\t' << tiers[m.to].id << '\t' << size_of(m, files) << '\t'
+      << ((u == NO_UNIT)? files.relative_path(m.file, paths).string() : paths.path(units->dir[u]).string() + '/') << std::endl;
+  }
+}
+
+bool MovePlan::save(const fs::path &path, const std::vector<Tier> &tiers, const FileTable &files, const PathPool &paths) const{
+  std::ofstream f(path.string());
+  if(!f){
+    Log("Cannot write move plan to " + path.string(), 0);
+    return false;
+  }
+  write(f, tiers, files, paths);
+  return (bool)f;
+}
@@ -0,0 +1,62 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+namespace fs = boost::filesystem;
+
+class Tier; // forward declaration
+class FileTable; // forward declaration
+class PathPool; // forward declaration
+class PlacementUnits; // forward declaration
+
+struct Move{
+  uint32_t file; // FileTable row
+  uint16_t from;
+  uint16_t to;
+};
+
+class MovePlan{
+  /*
+   * The files that change tier in one pass, each going straight from its
+   * current tier to its destination. Slowest destinations come first so
+   * demotions free space before promotions need it. Files that stay put
+   * are only listed when their symlink in the first tier was never
+   * confirmed. A move of a unit's lead row moves the whole unit.
+   */
+public:
+  std::vector<Move> moves;
+  std::vector<uint32_t> links;
+  const PlacementUnits *units; // NULL when every file is placed alone
+  MovePlan() : units(NULL){}
+  void clear(void);
+  void build(const std::vector<Tier> &tiers, const FileTable &files, const PlacementUnits *units_ = NULL);
+  int64_t size_of(const Move &m, const FileTable &files) const;
+  int64_t alloc_of(const Move &m, const FileTable &files) const;
+  size_t files_of(const Move &m) const;
+  size_t limit(const FileTable &files, const std::vector<uint64_t> &benefit, int64_t max_bytes, size_t max_files);
+  int64_t bytes(const FileTable &files) const;
+  void write(std::ostream &os, const std::vector<Tier> &tiers, const FileTable &files, const PathPool &paths) const;
+  bool save(const fs::path &path, const std::vector<Tier> &tiers, const FileTable &files, const PathPool &paths) const;
+};
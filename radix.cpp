@@ -0,0 +1,144 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "radix.hpp"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#define INDEX_PASSES ((32 + RADIX_BITS - 1) / RADIX_BITS)
+#define WORD_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+
+static inline unsigned digit(const SortKey &k, unsigned pass){
+  // passes run from the least significant digit of index to the most significant of hi
+  if(pass < INDEX_PASSES) return (k.index >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+  pass -= INDEX_PASSES;
+  uint64_t word = (pass < WORD_PASSES)? k.lo : k.hi;
+  return (word >> ((pass % WORD_PASSES) * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+}
+
+static void histogram(const SortKey *items, size_t begin, size_t end, unsigned pass, size_t *counts){
+  std::fill(counts, counts + RADIX_BUCKETS, 0);
+  for(size_t i = begin; i < end; i++)
+    counts[digit(items[i], pass)]++;
+}
+
+static void scatter(const SortKey *src, SortKey *dst, size_t begin, size_t end, unsigned pass, size_t *offsets){
+  for(size_t i = begin; i < end; i++)
+    dst[offsets[digit(src[i], pass)]++] = src[i];
+}
+
+void radix_sort(SortKey *items, size_t n, size_t num_threads){
+  /*
+   * Parallel LSD radix sort. Each thread counts and later scatters its
+   * own contiguous chunk; chunk offsets are laid out in thread order per
+   * bucket, which keeps every pass stable. Passes where all keys share
+   * the digit (most high atime bits, unused priority bits) are skipped,
+   * and so are the index passes when the input is already in row order.
+   */
+  if(n < RADIX_MIN_ITEMS){
+    std::sort(items, items + n);
+    return;
+  }
+  if(num_threads < 1) num_threads = 1;
+  if(num_threads > n / RADIX_MIN_PER_THREAD) num_threads = std::max<size_t>(n / RADIX_MIN_PER_THREAD, 1);
+  const unsigned passes = INDEX_PASSES + 2 * WORD_PASSES;
+  unsigned pass = INDEX_PASSES;
+  for(size_t i = 1; i < n && pass; i++)
+    if(items[i].index <= items[i - 1].index) pass = 0;
+  std::vector<SortKey> buffer(n);
+  std::vector<size_t> counts(num_threads * RADIX_BUCKETS);
+  std::vector<size_t> bounds(num_threads + 1);
+  for(size_t t = 0; t <= num_threads; t++)
+    bounds[t] = n * t / num_threads;
+  SortKey *src = items, *dst = &buffer[0];
+  std::vector<std::thread> threads;
+  for(; pass < passes; pass++){
+    for(size_t t = 1; t < num_threads; t++)
+      threads.emplace_back(histogram, src, bounds[t], bounds[t + 1], pass, &counts[t * RADIX_BUCKETS]);
+    histogram(src, bounds[0], bounds[1], pass, &counts[0]);
+    for(std::thread &th : threads) th.join();
+    threads.clear();
+    size_t offset = 0;
+    bool skip = false;
+    for(size_t b = 0; b < RADIX_BUCKETS && !skip; b++){
+      size_t total = 0;
+      for(size_t t = 0; t < num_threads; t++){
+        size_t c = counts[t * RADIX_BUCKETS + b];
+        counts[t * RADIX_BUCKETS + b] = offset;
+        offset += c;
+        total += c;
+      }
+      skip = (total == n);
+    }
+    if(skip) continue;
+    for(size_t t = 1; t < num_threads; t++)
+      threads.emplace_back(scatter, src, dst, bounds[t], bounds[t + 1], pass, &counts[t * RADIX_BUCKETS]);
+    scatter(src, dst, bounds[0], bounds[1], pass, &counts[0]);
+    for(std::thread &th : threads) th.join();
+    threads.clear();
+    std::swap(src, dst);
+  }
+  if(src != items) std::copy(src, src + n, items);
+}
+
+static inline int64_t weight(const int64_t *weights, const SortKey &k){
+  return weights[k.index];
+}
+
+size_t weighted_cut(SortKey *items, size_t lo, size_t hi, const int64_t *weights, int64_t budget){
+  /*
+   * Moves the hottest items of [lo, hi) to the front and returns the
+   * first position whose weight would make the running total reach
+   * budget, with the next hottest item placed there. Only ranges that
+   * contain the cut get partitioned further; the items on either side
+   * are left unordered. Returns hi if everything fits.
+   */
+  while(hi - lo > SELECT_WINDOW){
+    // median of three as pivot, swapped to the end of the range
+    size_t mid = lo + (hi - lo) / 2;
+    if(items[mid] < items[lo]) std::swap(items[mid], items[lo]);
+    if(items[hi - 1] < items[lo]) std::swap(items[hi - 1], items[lo]);
+    if(items[mid] < items[hi - 1]) std::swap(items[mid], items[hi - 1]);
+    const SortKey pivot = items[hi - 1];
+    SortKey *split = std::partition(items + lo, items + hi - 1,
+      [&pivot](const SortKey &k){ return k < pivot; }
+    );
+    size_t m = split - items;
+    std::swap(items[m], items[hi - 1]);
+    int64_t hotter = 0;
+    for(size_t i = lo; i < m; i++)
+      hotter += weight(weights, items[i]);
+    if(hotter >= budget){
+      hi = m;
+    }else if(hotter + weight(weights, items[m]) >= budget){
+      return m;
+    }else{
+      budget -= hotter + weight(weights, items[m]);
+      lo = m + 1;
+    }
+  }
+  radix_sort(items + lo, hi - lo, 1);
+  for(size_t i = lo; i < hi; i++){
+    budget -= weight(weights, items[i]);
+    if(budget <= 0) return i;
+  }
+  return hi;
+}
@@ -0,0 +1,56 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_MIN_ITEMS 4096 // below this std::sort is faster
+#define RADIX_MIN_PER_THREAD 65536
+#define SELECT_WINDOW 16384 // ranges this small are sorted instead of partitioned
+
+struct SortKey{
+  /*
+   * Sort key for one FileTable row, hottest first. Both words are
+   * inverted so that ascending order of (hi, lo) is descending order of
+   * (priority, atime); ties keep row order.
+   */
+  uint64_t hi;
+  uint64_t lo;
+  uint32_t index;
+  SortKey(){}
+  SortKey(uint64_t priority, int64_t atime, uint32_t index_){
+    hi = ~priority;
+    lo = ~((uint64_t)atime ^ ((uint64_t)0x01 << 63)); // bias so negative times order correctly
+    index = index_;
+  }
+  bool operator<(const SortKey &other) const{
+    if(hi != other.hi) return hi < other.hi;
+    if(lo != other.lo) return lo < other.lo;
+    return index < other.index;
+  }
+};
+
+void radix_sort(SortKey *items, size_t n, size_t num_threads);
+
+size_t weighted_cut(SortKey *items, size_t lo, size_t hi, const int64_t *weights, int64_t budget);
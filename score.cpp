@@ -0,0 +1,69 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "score.hpp"
+#include "filetable.hpp"
+#include <cstring>
+
+enum ScoreModel parse_score_model(const std::string &str){
+  if(str == "shift") return SCORE_SHIFT;
+  if(str == "decay") return SCORE_DECAY;
+  if(str == "hybrid") return SCORE_HYBRID;
+  if(str == "density") return SCORE_DENSITY;
+  return SCORE_INVALID;
+}
+
+const char *score_model_name(enum ScoreModel model){
+  switch(model){
+    case SCORE_SHIFT: return "shift";
+    case SCORE_DECAY: return "decay";
+    case SCORE_HYBRID: return "hybrid";
+    case SCORE_DENSITY: return "density";
+    default: return "invalid";
+  }
+}
+
+double heat_after_access(double heat, int64_t when, double half_life){
+  double count = (heat == NO_HEAT)? 0.0 : exp2((heat - when) / half_life);
+  return when + half_life * log2(count + 1.0);
+}
+
+static uint64_t ordered(double d){
+  // maps doubles onto unsigned integers with the same order
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return (bits >> 63)? ~bits : bits | ((uint64_t)0x01 << 63);
+}
+
+uint64_t file_score(enum ScoreModel model, const FileTable &files, uint32_t i, double half_life, int64_t now){
+  double heat = files.heat[i];
+  switch(model){
+    case SCORE_DECAY:
+      return ordered(heat);
+    case SCORE_HYBRID:
+      if(heat - now >= half_life) // count of 2 or more
+        return ordered(heat) >> 1 | ((uint64_t)0x01 << 63);
+      return ((uint64_t)files.atime[i] ^ ((uint64_t)0x01 << 63)) >> 1;
+    case SCORE_DENSITY:
+      return ordered(heat - half_life * log2((files.size[i] > SCORE_MIN_SIZE)? (double)files.size[i] : SCORE_MIN_SIZE));
+    default:
+      return files.priority[i];
+  }
+}
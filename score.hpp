@@ -0,0 +1,54 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cmath>
+#include <stdint.h>
+#include <string>
+
+#define DEFAULT_HALF_LIFE 86400 // seconds for a decayed access count to halve
+#define NO_HEAT (-HUGE_VAL) // never accessed
+#define SCORE_MIN_SIZE 4096 // smaller files score per byte as if they were this big
+
+class FileTable; // forward declaration
+
+/*
+ * How a tier ranks the files it could hold. Every model but SCORE_SHIFT
+ * reads the decayed access count kept in FileTable::heat, stored as the
+ * time at which the count was (or will have decayed to) exactly 1:
+ *   count(now) = 2^((heat - now) / half_life)
+ * which orders files by their current count without being rewritten as
+ * time passes.
+ */
+enum ScoreModel{
+  SCORE_SHIFT, // the priority shift register, one bit per run or age interval
+  SCORE_DECAY, // exponentially decayed access count
+  SCORE_HYBRID, // files seen twice within a half life first by count, then the rest by recency
+  SCORE_DENSITY, // decayed access count per byte
+  SCORE_UNSET,
+  SCORE_INVALID
+};
+
+enum ScoreModel parse_score_model(const std::string &str);
+const char *score_model_name(enum ScoreModel model);
+
+double heat_after_access(double heat, int64_t when, double half_life);
+uint64_t file_score(enum ScoreModel model, const FileTable &files, uint32_t i, double half_life, int64_t now);
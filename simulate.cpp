@@ -0,0 +1,401 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "crawl.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SIM_PROBE_SZ (32 << 20) // read from and written to each tier to measure it
+
+struct TraceEvent{
+  int64_t when;
+  uint32_t file;
+};
+
+static std::string human(double bytes){
+  const char *units = "KMGT";
+  if(bytes < 1024) return std::to_string((int64_t)bytes) + " B";
+  int u = -1;
+  while(bytes >= 1024 && u < 3){
+    bytes /= 1024;
+    u++;
+  }
+  char buff[32];
+  snprintf(buff, sizeof(buff), "%.1f %ciB", bytes, units[u]);
+  return buff;
+}
+
+static double elapsed(const struct timespec &start){
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static double read_rate(const fs::path &path){
+  /*
+   * Bytes per second read from one file, bypassing the page cache where
+   * the filesystem allows it. Only files we may open without touching
+   * their atime are read, so measuring does not change their rank.
+   */
+  int fd = open(path.c_str(), O_RDONLY | O_NOATIME | O_DIRECT | O_CLOEXEC);
+  if(fd == ERR && errno == EINVAL){
+    fd = open(path.c_str(), O_RDONLY | O_NOATIME | O_CLOEXEC);
+    if(fd != ERR) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  if(fd == ERR) return 0;
+  void *buff;
+  if(posix_memalign(&buff, COPY_ALIGN, COPY_BUFF_SZ) != 0){
+    close(fd);
+    return 0;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int64_t done = 0;
+  while(done < SIM_PROBE_SZ){
+    ssize_t n = read(fd, buff, COPY_BUFF_SZ);
+    if(n == ERR && errno == EINTR) continue;
+    if(n == ERR && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)){
+      // the filesystem took the flag but not the read
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      continue;
+    }
+    if(n <= 0) break;
+    done += n;
+  }
+  double secs = elapsed(start);
+  free(buff);
+  close(fd);
+  return (done > 0 && secs > 0)? done / secs : 0;
+}
+
+static double write_rate(const fs::path &dir){
+  // bytes per second written to and synced on a scratch file, which is removed again
+  fs::path path = dir / (".autotier-probe." + std::to_string(getpid()));
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_DIRECT | O_CLOEXEC, 0600);
+  if(fd == ERR && errno == EINVAL) fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if(fd == ERR) return 0;
+  void *buff;
+  double rate = 0;
+  if(posix_memalign(&buff, COPY_ALIGN, COPY_BUFF_SZ) == 0){
+    memset(buff, 0, COPY_BUFF_SZ);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t done = 0;
+    while(done < SIM_PROBE_SZ){
+      ssize_t n = write(fd, buff, COPY_BUFF_SZ);
+      if(n == ERR && errno == EINTR) continue;
+      if(n == ERR && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)){
+        // the filesystem took the flag but not the write
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        continue;
+      }
+      if(n <= 0) break;
+      done += n;
+    }
+    if(done == SIM_PROBE_SZ && fdatasync(fd) == 0){
+      double secs = elapsed(start);
+      if(secs > 0) rate = done / secs;
+    }
+    free(buff);
+  }
+  close(fd);
+  unlink(path.c_str());
+  return rate;
+}
+
+static double first_tier_share(const FileTable &files, double half_life, int64_t now){
+  // of the decayed access counts, how much is on files in the first tier, -1 if nothing was read
+  double first = 0, total = 0;
+  for(uint32_t i = 0; i < files.count(); i++){
+    if((files.flags[i] & FILE_REMOVED) || files.heat[i] == NO_HEAT) continue;
+    double count = exp2((files.heat[i] - now) / half_life);
+    total += count;
+    if(files.tier[i] == 0) first += count;
+  }
+  return (total > 0)? first / total : -1;
+}
+
+bool TierEngine::files_from_index(const fs::path &path){
+  /*
+   * Fills the file table from a metadata index instead of crawling, so a
+   * copy of a production index can be replayed elsewhere. Each tier's
+   * root is its shortest directory in the index, and its paths are taken
+   * relative to that. The index does not keep allocated sizes, so files
+   * are weighed by their size rounded up to a 4 KiB block.
+   */
+  if(!index.load(path)){
+    Log("Cannot read metadata index " + path.string(), 0);
+    return false;
+  }
+  std::vector<std::string> roots(tiers.size());
+  std::vector<bool> rooted(tiers.size(), false);
+  for(uint64_t k = 0; k < index.num_dirs(); k++){
+    const IndexDir *d = &index.dir_at(k);
+    const char *p = index.string(d->path);
+    if(!p || d->tier >= tiers.size()) continue;
+    if(!rooted[d->tier] || strlen(p) < roots[d->tier].length()){
+      roots[d->tier] = p;
+      rooted[d->tier] = true;
+    }
+  }
+  size_t skipped = 0;
+  for(uint64_t k = 0; k < index.num_dirs(); k++){
+    const IndexDir *d = &index.dir_at(k);
+    const char *p = index.string(d->path);
+    if(!p || d->tier >= tiers.size()){
+      skipped++;
+      continue;
+    }
+    std::string rel = std::string(p).substr(roots[d->tier].length());
+    uint32_t dir_id = paths.add_path(fs::path(rel).relative_path());
+    for(const IndexEntry *e = index.dir_begin(d); e != index.dir_end(d); ++e){
+      const char *name = index.string(e->name);
+      if(e->type != INDEX_ENTRY_FILE || !name) continue;
+      struct stat info;
+      memset(&info, 0, sizeof(info));
+      info.st_size = e->size;
+      info.st_blocks = (e->size + 4095) / 4096 * 8;
+      info.st_atime = info.st_mtime = e->last_atime;
+      uint32_t i = files.add(dir_id, name, d->tier, info, index.string(e->pin), &e->last_atime, &e->priority, &e->heat);
+      files.flags[i] |= FILE_LINKED;
+    }
+  }
+  index.unload();
+  if(skipped) Log("Skipped " + std::to_string(skipped) + " directories of other tiers in " + path.string(), 1);
+  return true;
+}
+
+void TierEngine::simulate_pass(bool measure, std::vector<int64_t> &bytes, std::vector<size_t> &moved){
+  /*
+   * One placement pass whose moves only happen in the file table. Space
+   * is handed over as the movers would, and moves the destination has
+   * no room for are left out like theirs.
+   */
+  for(Tier &t : tiers)
+    t.incoming_files.clear();
+  sort();
+  simulate_tier(measure);
+  plan_moves();
+  size_t n = tiers.size();
+  for(const Move &m : plan.moves){
+    int64_t alloc = plan.alloc_of(m, files);
+    if(!capacity.reserve(m.from, m.to, alloc)) continue;
+    capacity.release(m.from, m.to, alloc, true);
+    bytes[m.from * n + m.to] += plan.size_of(m, files);
+    moved[m.from * n + m.to] += plan.files_of(m);
+    uint32_t u = units.unit_of(m.file);
+    if(u == NO_UNIT){
+      files.tier[m.file] = m.to;
+      files.flags[m.file] |= FILE_LINKED;
+      continue;
+    }
+    for(uint32_t k = units.first[u]; k < units.first[u + 1]; k++){
+      files.tier[units.members[k]] = m.to;
+      files.flags[units.members[k]] |= FILE_LINKED;
+    }
+  }
+}
+
+void TierEngine::simulate(const fs::path &trace_path, const fs::path &index_path){
+  /*
+   * A dry run: the files are crawled, or read from an index, and placed
+   * as a run would, but nothing is moved and no xattr, index or metrics
+   * file is written. Without a trace this is the next run's plan. With
+   * one, the trace's accesses are replayed from now on as the daemon
+   * would see them, with a pass every DAEMON_INTERVAL and aging every
+   * AGE_INTERVAL of trace time, and the first tier's hit rate is what
+   * share of them found their file there.
+   */
+  dry_run = true;
+  if(config.streaming) Log("STREAMING does not apply to --simulate, which keeps every file in memory.",1);
+  if(index_path.empty()){
+    launch_crawlers();
+  }else{
+    if(!files_from_index(index_path)) return;
+    count_accesses();
+  }
+  std::vector<TraceEvent> events;
+  size_t unknown = 0;
+  if(!trace_path.empty()){
+    std::ifstream trace(trace_path.string());
+    if(!trace){
+      Log("Cannot read access trace " + trace_path.string(), 0);
+      return;
+    }
+    std::unordered_map<std::string, uint32_t> by_path;
+    for(uint32_t i = 0; i < files.count(); i++)
+      by_path[files.relative_path(i, paths).string()] = i;
+    std::string line;
+    while(getline(trace, line)){
+      // <unix time> <path in any tier, or relative to them>
+      std::istringstream fields(line);
+      int64_t when;
+      std::string target;
+      if(!(fields >> when) || !getline(fields >> std::ws, target) || target.empty()) continue;
+      fs::path rel;
+      std::unordered_map<std::string, uint32_t>::const_iterator itr;
+      if(!tier_relative(tiers, target, rel) || (itr = by_path.find(rel.string())) == by_path.end()){
+        unknown++;
+        continue;
+      }
+      events.push_back(TraceEvent{when, itr->second});
+    }
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b){ return a.when < b.when; });
+  }
+
+  size_t n = tiers.size();
+  std::vector<int64_t> bytes(n * n, 0);
+  std::vector<size_t> moved(n * n, 0);
+  int64_t now = time(NULL);
+  double share_before = first_tier_share(files, config.half_life, now);
+  std::vector<int64_t> tier_bytes(n, 0);
+  std::vector<uint32_t> largest(n, NO_FILE);
+  for(uint32_t i = 0; i < files.count(); i++){
+    uint16_t t = files.tier[i];
+    tier_bytes[t] += files.size[i];
+    if(largest[t] == NO_FILE || files.size[i] > files.size[largest[t]]) largest[t] = i;
+  }
+  std::vector<fs::path> probe_files(n); // before the simulated moves change where they are
+  for(size_t t = 0; t < n; t++)
+    if(largest[t] != NO_FILE) probe_files[t] = file_path(largest[t]);
+  simulate_pass(true, bytes, moved);
+  double share_after = first_tier_share(files, config.half_life, now);
+  size_t passes = 1, hits = 0;
+  if(!events.empty()){
+    int64_t offset = now - events.front().when; // the trace starts where the pool is now
+    int64_t next_pass = now + config.daemon_interval;
+    int64_t next_age = now + config.age_interval;
+    bool dirty = false;
+    for(const TraceEvent &e : events){
+      int64_t when = e.when + offset;
+      while(next_pass <= when || next_age <= when){
+        if(next_age <= next_pass){
+          sim_now = next_age;
+          for(uint32_t i = 0; i < files.count(); i++)
+            files.priority[i] >>= 1;
+          next_age += config.age_interval;
+          dirty = true;
+          continue;
+        }
+        sim_now = next_pass;
+        if(dirty){
+          simulate_pass(false, bytes, moved);
+          passes++;
+          dirty = false;
+        }
+        next_pass += config.daemon_interval;
+      }
+      uint32_t i = e.file;
+      if(files.tier[i] == 0) hits++;
+      if(!(files.priority[i] & TOP_PRIORITY_BIT)){
+        dirty = true;
+        int64_t soon = when + EXPEDITE_DELAY;
+        if(files.tier[i] != 0 && config.expedite_size && files.alloc[i] <= config.expedite_size && soon < next_pass)
+          next_pass = soon;
+      }
+      files.priority[i] |= TOP_PRIORITY_BIT;
+      files.atime[i] = when;
+      files.heat[i] = heat_after_access(files.heat[i], when, config.half_life);
+    }
+    sim_now = 0;
+  }
+
+  // bandwidth of each tier, measured on its largest file and a scratch file
+  std::vector<double> read_bw(n, 0), write_bw(n, 0);
+  bool copying = false;
+  for(size_t from = 0; from < n; from++)
+    for(size_t to = 0; to < n; to++)
+      copying = copying || (moved[from * n + to] && tiers[from].copy_to[to] != COPY_RENAME && tiers[from].copy_to[to] != COPY_REFLINK);
+  if(copying){
+    for(size_t t = 0; t < n; t++){
+      if(!probe_files[t].empty()) read_bw[t] = read_rate(probe_files[t]);
+      write_bw[t] = write_rate(tiers[t].dir);
+    }
+  }
+
+  std::ostringstream out;
+  out << "Simulated " << ((events.empty())? "the next run" : std::to_string(passes) + " passes") << " over "
+    << files.count() << " files";
+  if(!index_path.empty()) out << " from " << index_path.string();
+  out << "." << std::endl;
+  for(size_t t = 0; t < n; t++)
+    out << "  " << tiers[t].id << ": " << human(tier_bytes[t]) << " now" << std::endl;
+  if(!events.empty()){
+    out << "Replayed " << events.size() << " accesses over " << (events.back().when - events.front().when) << " seconds";
+    if(unknown) out << ", " << unknown << " more were to files that were not found";
+    out << "." << std::endl;
+  }
+  double total_secs = 0;
+  int64_t total_bytes = 0;
+  size_t total_files = 0;
+  bool timed = true;
+  for(size_t from = 0; from < n; from++){
+    for(size_t to = 0; to < n; to++){
+      size_t p = from * n + to;
+      if(!moved[p]) continue;
+      total_bytes += bytes[p];
+      total_files += moved[p];
+      enum CopyMethod method = tiers[from].copy_to[to];
+      out << "  " << tiers[from].id << " -> " << tiers[to].id << ": " << moved[p] << " files, " << human(bytes[p]) << ", ";
+      double rate = std::min(read_bw[from], write_bw[to]);
+      if(method == COPY_RENAME || method == COPY_REFLINK){
+        out << copy_method_name(method);
+      }else if(rate > 0){
+        double secs = bytes[p] / rate;
+        total_secs += secs;
+        char buff[64];
+        snprintf(buff, sizeof(buff), "%.1f s at %s/s", secs, human(rate).c_str());
+        out << buff;
+      }else{
+        out << "transfer rate unknown";
+        timed = false;
+      }
+      out << std::endl;
+    }
+  }
+  out << "Would move " << total_files << " files, " << human(total_bytes);
+  if(total_secs > 0){
+    char buff[64];
+    snprintf(buff, sizeof(buff), "%.1f s", total_secs);
+    out << ", taking " << ((timed)? "" : "at least ") << buff << " one tier pair after another";
+  }
+  out << "." << std::endl;
+  char buff[128];
+  if(!events.empty()){
+    snprintf(buff, sizeof(buff), "%.1f%%", 100.0 * hits / events.size());
+    out << tiers.front().id << " hit rate: " << buff << " of replayed accesses." << std::endl;
+  }else if(share_before >= 0){
+    snprintf(buff, sizeof(buff), "%.1f%% now, %.1f%% after the moves", 100 * share_before, 100 * share_after);
+    out << tiers.front().id << " hit rate: " << buff << ", projected from decayed access counts." << std::endl;
+  }
+  std::cout << out.str();
+}
@@ -0,0 +1,468 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "stream.hpp"
+#include "crawl.hpp"
+#include "crawler.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void ByteHistogram::add(const std::vector<Entry> &entries){
+  std::lock_guard<std::mutex> guard(lock);
+  for(const Entry &e : entries){
+    std::map<StreamKey, std::vector<int64_t>>::iterator itr = buckets.lower_bound(e.key);
+    if(itr == buckets.end() || itr->first != e.key)
+      itr = buckets.insert(itr, std::make_pair(e.key, std::vector<int64_t>(num_tiers, 0)));
+    itr->second[e.tier] += e.size;
+    total += e.size;
+  }
+  if(buckets.size() > 2 * STREAM_BUCKETS) compact();
+}
+
+void ByteHistogram::compact(){
+  // neighbours are merged until each holds its share, a bucket keeps the key of its coldest part
+  int64_t share = total / STREAM_BUCKETS + 1;
+  std::map<StreamKey, std::vector<int64_t>> merged;
+  std::vector<int64_t> group(num_tiers, 0);
+  int64_t held = 0;
+  for(std::map<StreamKey, std::vector<int64_t>>::iterator itr = buckets.begin(); itr != buckets.end(); ++itr){
+    for(size_t t = 0; t < num_tiers; t++){
+      group[t] += itr->second[t];
+      held += itr->second[t];
+    }
+    if(held >= share || std::next(itr) == buckets.end()){
+      merged.insert(merged.end(), std::make_pair(itr->first, group));
+      group.assign(num_tiers, 0);
+      held = 0;
+    }
+  }
+  buckets.swap(merged);
+}
+
+void ByteHistogram::freeze(std::vector<std::vector<int64_t>> &bytes){
+  // no more adds, the keys are kept to look files up by
+  bounds.clear();
+  bytes.clear();
+  for(std::pair<const StreamKey, std::vector<int64_t>> &b : buckets){
+    bounds.push_back(b.first);
+    bytes.push_back(b.second);
+  }
+  buckets.clear();
+}
+
+size_t ByteHistogram::bucket_of(const StreamKey &key) const{
+  // files colder than anything seen while counting land one past the end
+  return std::lower_bound(bounds.begin(), bounds.end(), key) - bounds.begin();
+}
+
+static bool take(std::atomic<int64_t> &left, int64_t size){
+  int64_t now = left.load();
+  while(now >= size)
+    if(left.compare_exchange_weak(now, now - size)) return true;
+  return false;
+}
+
+bool StreamCut::takes(size_t bucket, bool resident, int64_t size){
+  if(min_bucket == NO_BUCKET || bucket < min_bucket) return true;
+  if(bucket == min_bucket && take(min_left, size)) return true;
+  if(!resident) return false;
+  if(max_bucket == NO_BUCKET || bucket < max_bucket) return true;
+  return bucket == max_bucket && take(max_left, size);
+}
+
+struct SpoolHeader{
+  uint16_t from;
+  uint16_t to;
+  uint32_t meta_len;
+  uint32_t rel_len;
+  int64_t size;
+  int64_t alloc;
+  int64_t atime;
+  int64_t mtime;
+};
+
+bool MoveSpool::open(const fs::path &dir){
+  // O_TMPFILE keeps it out of sight of the crawl and gone if we are killed
+  int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  file = (fd == ERR)? tmpfile() : fdopen(fd, "w+");
+  if(!file){
+    if(fd != ERR) close(fd);
+    Log(std::string("Cannot create a move spool: ") + strerror(errno), 0);
+    return false;
+  }
+  return true;
+}
+
+void MoveSpool::add(const Record &r){
+  SpoolHeader h = {r.from, r.to, (uint32_t)r.meta.size(), (uint32_t)r.rel.size(), r.size, r.alloc, r.atime, r.mtime};
+  std::lock_guard<std::mutex> guard(lock);
+  if(err) return;
+  if(fwrite(&h, sizeof(h), 1, file) != 1
+  || fwrite(r.meta.data(), 1, r.meta.size(), file) != r.meta.size()
+  || fwrite(r.rel.data(), 1, r.rel.size(), file) != r.rel.size()){
+    err = (errno)? errno : EIO;
+    return;
+  }
+  records++;
+  bytes += r.size;
+}
+
+bool MoveSpool::rewind(){
+  std::lock_guard<std::mutex> guard(lock);
+  if(!err && (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0)) err = (errno)? errno : EIO;
+  return !err;
+}
+
+bool MoveSpool::next(Record &r){
+  // from any number of threads once rewound
+  SpoolHeader h;
+  std::lock_guard<std::mutex> guard(lock);
+  if(fread(&h, sizeof(h), 1, file) != 1) return false;
+  r.meta.resize(h.meta_len);
+  r.rel.resize(h.rel_len);
+  if((h.meta_len && fread(&r.meta[0], 1, h.meta_len, file) != h.meta_len)
+  || (h.rel_len && fread(&r.rel[0], 1, h.rel_len, file) != h.rel_len))
+    return false;
+  r.from = h.from;
+  r.to = h.to;
+  r.size = h.size;
+  r.alloc = h.alloc;
+  r.atime = h.atime;
+  r.mtime = h.mtime;
+  return true;
+}
+
+static std::string relative_dir(const CrawlJob &job, const fs::path &root){
+  // the job's directory within its tier, with a trailing slash unless it is the tier itself
+  const std::string &dir = job.dir.string();
+  size_t len = root.string().length();
+  return (dir.length() > len)? dir.substr(len + 1) + '/' : std::string();
+}
+
+void TierEngine::stream(){
+  /*
+   * begin() without the file table, for pools with too many files to
+   * hold. The first crawl only adds each file's bytes to a histogram of
+   * rank, the tiers' cuts are found in that, and a second crawl ranks
+   * each file again and sends it to the tier whose share its bucket is
+   * in. Moves are spooled to disk and made once the second crawl is
+   * done, slowest destination first like a plan. Memory is the
+   * histogram, the directory names and one directory of rows per
+   * crawler thread.
+   *
+   * The placement is the one simulate_tier finds, to within the bytes
+   * of the bucket each cut falls in: in that bucket, files are taken in
+   * the order they are crawled. A MOVE_BUDGET keeps moves in that order
+   * too, not by benefit. The metadata index is not used; one left from
+   * an earlier run would go stale, so it is removed.
+   */
+  boost::system::error_code ec;
+  if(!config.index_path.empty() && remove(config.index_segment(config.node), ec))
+    Log("STREAMING does not keep the metadata index, removed " + config.index_segment(config.node).string(), 1);
+  enum ScoreModel model = tiers.front().score_model;
+  ranked_at = time(NULL);
+  ByteHistogram histogram(tiers.size());
+  std::mutex count_lock;
+  std::vector<int64_t> pinned_used(tiers.size(), 0); // by the tier pinned files are in
+  std::vector<int64_t> pinned_bytes(tiers.size(), 0); // by the tier they are pinned to
+  {
+    PhaseTimer timer(PHASE_CRAWL);
+    Log("Counting bytes by rank.",2);
+    Crawler crawler(&paths, config.num_threads, config.uring_depth);
+    crawler.set_partition(config.node, config.nodes, config.node_depth);
+    for(uint16_t t = 0; t < tiers.size(); t++)
+      crawler.push(tiers[t].dir, &tiers[t], t);
+    crawler.set_sink([&](FileTable &rows, uint32_t first, const CrawlJob &job){
+      std::vector<ByteHistogram::Entry> entries;
+      size_t crawled = rows.count() - first;
+      for(uint32_t i = first; i < rows.count(); i++){
+        if(rows.priority[i] & TOP_PRIORITY_BIT)
+          rows.heat[i] = heat_after_access(rows.heat[i], rows.atime[i], config.half_life);
+        int pin = (rows.pins.empty())? ERR : pinned_tier(rows.pin_of(i));
+        if(pin != ERR){
+          // not ranked, as in sort()
+          std::lock_guard<std::mutex> guard(count_lock);
+          pinned_used[job.tier] += rows.alloc[i];
+          pinned_bytes[pin] += rows.alloc[i];
+          continue;
+        }
+        SortKey k(file_score(model, rows, i, config.half_life, ranked_at), rows.atime[i], i);
+        entries.push_back(ByteHistogram::Entry{StreamKey(k.hi, k.lo), job.tier, rows.alloc[i]});
+      }
+      histogram.add(entries);
+      {
+        std::lock_guard<std::mutex> guard(count_lock);
+        metrics.files_crawled[job.tier] += crawled;
+      }
+      rows.truncate(first);
+    });
+    crawler.launch();
+  }
+
+  std::vector<StreamCut> cuts(tiers.size());
+  {
+    PhaseTimer timer(PHASE_PLACE);
+    Log("Finding tiers' cuts.",2);
+    std::vector<std::vector<int64_t>> bytes;
+    histogram.freeze(bytes);
+    capacity.probe(tiers);
+    for(const std::vector<int64_t> &b : bytes)
+      for(uint16_t t = 0; t < tiers.size(); t++)
+        capacity.count(t, b[t]);
+    for(uint16_t t = 0; t < tiers.size(); t++)
+      capacity.count(t, pinned_used[t]);
+    capacity.counted_all();
+    stream_cuts(bytes, pinned_bytes, cuts);
+  }
+
+  std::vector<std::unique_ptr<MoveSpool>> spools; // by destination
+  MoveSpool link_spool;
+  bool opened = link_spool.open(tiers.back().dir);
+  for(size_t t = 0; t < tiers.size(); t++){
+    spools.emplace_back(new MoveSpool());
+    opened = opened && spools.back()->open(tiers.back().dir);
+  }
+  if(!opened) return;
+  {
+    PhaseTimer timer(PHASE_PLAN);
+    Log("Placing files.",2);
+    Crawler crawler(&paths, config.num_threads, config.uring_depth);
+    crawler.set_partition(config.node, config.nodes, config.node_depth);
+    for(uint16_t t = 0; t < tiers.size(); t++)
+      crawler.push(tiers[t].dir, &tiers[t], t);
+    std::vector<std::atomic<uint64_t>> placed(tiers.size());
+    crawler.set_sink([&](FileTable &rows, uint32_t first, const CrawlJob &job){
+      // the xattrs are the ones the count read, so each file ranks the same as then
+      std::string rel_dir = relative_dir(job, tiers[job.tier].dir);
+      std::unordered_set<std::string> linked; // as in LinkFarm::link_missing, the links in the first tier's directory
+      if(job.tier != 0){
+        DirReader dir((tiers.front().dir / rel_dir).c_str());
+        const char *name;
+        unsigned char type;
+        uint64_t ino;
+        while(dir.next(name, type, ino))
+          if(type == DT_LNK) linked.insert(name);
+      }
+      for(uint32_t i = first; i < rows.count(); i++){
+        if(rows.priority[i] & TOP_PRIORITY_BIT)
+          rows.heat[i] = heat_after_access(rows.heat[i], rows.atime[i], config.half_life);
+        int pin = (rows.pins.empty())? ERR : pinned_tier(rows.pin_of(i));
+        SortKey k(file_score(model, rows, i, config.half_life, ranked_at), rows.atime[i], i);
+        size_t bucket = histogram.bucket_of(StreamKey(k.hi, k.lo));
+        uint16_t to = (pin == ERR)? job.tier : pin; // past the last tier's watermark, left where it is
+        for(uint16_t t = 0; t < tiers.size() && pin == ERR; t++){
+          if(cuts[t].takes(bucket, t == job.tier, rows.alloc[i])){
+            to = t;
+            break;
+          }
+        }
+        placed[to]++;
+        MoveSpool::Record r{job.tier, to, rows.size[i], rows.alloc[i], rows.atime[i], rows.mtime[i], rows.packed_meta(i), rel_dir + rows.name_of(i)};
+        if(to != job.tier){
+          spools[to]->add(r);
+          continue;
+        }
+        if(rows.flags[i] & FILE_META_DIRTY)
+          write_meta((job.dir / rows.name_of(i)).c_str(), r.meta, (rows.flags[i] & FILE_LEGACY_META) != 0);
+        if(to != 0 && !linked.count(rows.name_of(i)))
+          link_spool.add(r);
+      }
+      rows.truncate(first);
+    });
+    crawler.launch();
+    for(size_t t = 0; t < tiers.size(); t++)
+      metrics.files[t] = placed[t];
+  }
+  // moving only the part of the plan that was written would skew every tier
+  std::vector<MoveSpool *> written(1, &link_spool);
+  for(const std::unique_ptr<MoveSpool> &s : spools)
+    written.push_back(s.get());
+  for(MoveSpool *s : written){
+    if(s->rewind()) continue;
+    Log(std::string("Cannot write a move spool, moving nothing this run: ") + strerror(s->error()), 0);
+    return;
+  }
+
+  size_t moves = 0;
+  int64_t move_bytes = 0;
+  for(const std::unique_ptr<MoveSpool> &s : spools){
+    moves += s->count();
+    move_bytes += s->total_bytes();
+  }
+  Log("Planned " + std::to_string(moves) + " moves, " + std::to_string(move_bytes) + " bytes.",2);
+  if(!plan_path.empty()){
+    std::ofstream f(plan_path.string());
+    f << "# autotier move plan: " << moves << " files, " << move_bytes << " bytes" << std::endl;
+    MoveSpool::Record r;
+    for(size_t t = tiers.size(); t-- > 0; ){
+      spools[t]->rewind();
+      while(spools[t]->next(r))
+        f << tiers[r.from].id << '\t' << tiers[r.to].id << '\t' << r.size << '\t' << r.rel << std::endl;
+    }
+    if(f)
+      Log("Move plan written to " + plan_path.string(),2);
+    else
+      Log("Cannot write move plan to " + plan_path.string(), 0);
+  }
+
+  {
+    PhaseTimer timer(PHASE_MOVE);
+    Log("Moving files.",2);
+    std::atomic<int64_t> budget_bytes(0);
+    std::atomic<long> budget_files(0);
+    std::atomic<size_t> held(0);
+    for(size_t t = tiers.size(); t-- > 0; )
+      run_spool(*spools[t], budget_bytes, budget_files, held);
+    if(held) Log("Holding " + std::to_string(held) + " moves back until the next run.",1);
+    link_spool.rewind();
+    MoveSpool::Record r;
+    size_t made = 0;
+    while(link_spool.next(r))
+      if(link_streamed(r.rel, tiers[r.to].dir / r.rel, false)) made++;
+    if(made) Log("Linked " + std::to_string(made) + " files.",2);
+  }
+  metrics.runs++;
+  if(!config.metrics_path.empty() && metrics.save(config.metrics_path))
+    Log("Metrics written to " + config.metrics_path.string(),2);
+}
+
+void TierEngine::stream_cuts(std::vector<std::vector<int64_t>> &bytes, const std::vector<int64_t> &pinned_bytes,
+std::vector<StreamCut> &cuts){
+  /*
+   * simulate_tier over buckets instead of files. A bucket a cut falls
+   * in is split proportionally between its files' tiers, and the tier
+   * gets that many bytes of them in the second crawl. The bytes pinned
+   * to a tier come off both of its budgets first.
+   */
+  for(size_t t = 0; t < tiers.size(); t++){
+    Tier &tier = tiers[t];
+    tier.watermark_bytes = capacity.limit(t, tier.max_watermark);
+    int64_t min_budget = capacity.limit(t, tier.min_watermark) - pinned_bytes[t];
+    int64_t max_budget = std::max<int64_t>(min_budget, tier.watermark_bytes - pinned_bytes[t]);
+    StreamCut &cut = cuts[t];
+    int64_t used = 0;
+    for(size_t b = 0; b < bytes.size(); b++){
+      std::vector<int64_t> &left = bytes[b];
+      int64_t all = 0;
+      for(int64_t n : left)
+        all += n;
+      if(all == 0) continue;
+      if(cut.min_bucket == NO_BUCKET){
+        if(used + all < min_budget){
+          used += all;
+          left.assign(left.size(), 0);
+          continue;
+        }
+        int64_t part = std::max<int64_t>(min_budget - used, 0);
+        cut.min_bucket = b;
+        cut.min_left = part;
+        used += part;
+        for(int64_t &n : left)
+          n -= (int64_t)((double)n * part / all);
+        all -= part;
+      }
+      // files between the watermarks, less whatever the min cut took of this bucket
+      if(used + all < max_budget){
+        used += all;
+        left[t] = 0;
+        continue;
+      }
+      int64_t part = (all > 0)? (int64_t)((double)left[t] * std::max<int64_t>(max_budget - used, 0) / all) : 0;
+      cut.max_bucket = b;
+      cut.max_left = part;
+      left[t] -= part;
+      break;
+    }
+  }
+}
+
+bool TierEngine::link_streamed(const std::string &rel, const fs::path &target, bool replace){
+  // a file in the way is only replaced when it is the one that was just copied out
+  fs::path path = tiers.front().dir / rel;
+  struct stat info;
+  if(!replace && lstat(path.c_str(), &info) == 0 && !S_ISLNK(info.st_mode)){
+    Log("Cannot link " + path.string() + ": a file is in the way", 0);
+    return false;
+  }
+  boost::system::error_code ec;
+  create_directories(path.parent_path(), ec);
+  return links.link_at(path, target);
+}
+
+bool TierEngine::move_spooled(const MoveSpool::Record &r){
+  // move_file for a spooled move
+  CopyOptions copy = {copy_method(r.from, r.to), tiers[r.to].verify_mode, (enum HashAlgo)config.hash_algo, config.num_threads,
+    (tiers[r.to].move_threads > 0)? tiers[r.to].move_threads : config.move_threads};
+  File f(tiers[r.from].dir/r.rel, tiers[r.to].dir/r.rel, r.atime, r.mtime, copy);
+  f.keep_source = (r.to != 0 && r.from == 0);
+  f.over_link = (r.to == 0);
+  try{
+    if(!f.move()) return false;
+    write_meta(f.new_path.c_str(), r.meta, false);
+    if(r.to != 0 && !link_streamed(r.rel, f.new_path, r.from == 0) && f.keep_source)
+      remove(f.old_path);
+  }catch(const fs::filesystem_error &e){
+    Log(std::string("Error moving file: ") + e.what(), 0);
+    return false;
+  }
+  return true;
+}
+
+void TierEngine::run_spool(MoveSpool &spool, std::atomic<int64_t> &budget_bytes, std::atomic<long> &budget_files,
+std::atomic<size_t> &held){
+  // moves into one tier, as long as they fit in it and in the budget
+  if(!spool.rewind()) return;
+  std::vector<std::thread> threads;
+  for(int m = 0; m < config.move_threads; m++){
+    threads.emplace_back([&](){
+      IoPriority io_priority;
+      MoveSpool::Record r;
+      while(spool.next(r)){
+        if((config.move_budget && (budget_bytes += r.size) > config.move_budget)
+        || (config.move_budget_files && ++budget_files > config.move_budget_files)){
+          held++;
+          continue;
+        }
+        if(!capacity.reserve(r.from, r.to, r.alloc)){
+          held++;
+          continue;
+        }
+        io_priority.set(lower_io_priority(tiers[r.from].io_priority, tiers[r.to].io_priority));
+        bool moved = move_spooled(r);
+        capacity.release(r.from, r.to, r.alloc, moved);
+        metrics.moved(r.from, r.to, r.size, moved);
+      }
+    });
+  }
+  for(std::thread &t : threads)
+    t.join();
+}
@@ -0,0 +1,122 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+namespace fs = boost::filesystem;
+
+#define STREAM_BUCKETS 4096 // histogram resolution, each bucket ends up with about 1/STREAM_BUCKETS of the bytes
+#define NO_BUCKET ((size_t)-1)
+
+typedef std::pair<uint64_t, uint64_t> StreamKey; // SortKey's (hi, lo), hottest first
+
+class ByteHistogram{
+  /*
+   * Bytes by rank, in a fixed number of buckets, for STREAMING. Each
+   * bucket holds the files ranked after the previous bucket's key up to
+   * and including its own, with their bytes split by the tier they are
+   * in. A key not seen before starts a bucket of its own, and once there
+   * are twice STREAM_BUCKETS the neighbours are merged back down into
+   * buckets of about equal bytes, so memory stays fixed however many
+   * files go through while the buckets stay finest where the bytes are.
+   */
+private:
+  std::map<StreamKey, std::vector<int64_t>> buckets;
+  std::vector<StreamKey> bounds; // bucket keys, once frozen
+  size_t num_tiers;
+  int64_t total;
+  std::mutex lock;
+  void compact(void);
+public:
+  ByteHistogram(size_t num_tiers_){
+    num_tiers = num_tiers_;
+    total = 0;
+  }
+  struct Entry{
+    StreamKey key;
+    uint16_t tier;
+    int64_t size;
+  };
+  void add(const std::vector<Entry> &entries);
+  void freeze(std::vector<std::vector<int64_t>> &bytes);
+  size_t bucket_of(const StreamKey &key) const;
+  size_t size(void) const{ return bounds.size(); }
+};
+
+struct StreamCut{
+  /*
+   * Where one tier's share ends, in histogram buckets. Buckets before
+   * min_bucket go to the tier, files in the bucket itself only until
+   * min_left bytes of them have. Up to max_bucket (and max_left bytes in
+   * it) files already in the tier stay. NO_BUCKET means the tier takes
+   * everything that far.
+   */
+  size_t min_bucket;
+  size_t max_bucket;
+  std::atomic<int64_t> min_left;
+  std::atomic<int64_t> max_left;
+  StreamCut() : min_bucket(NO_BUCKET), max_bucket(NO_BUCKET), min_left(0), max_left(0){}
+  bool takes(size_t bucket, bool resident, int64_t size);
+};
+
+class MoveSpool{
+  /*
+   * The moves found by the classifying pass, written to an unlinked file
+   * next to the tiers instead of being kept in memory, and read back one
+   * at a time when they are made. Once a write fails the spool holds an
+   * unknown part of the moves, and rewind fails from then on.
+   */
+public:
+  struct Record{
+    uint16_t from;
+    uint16_t to;
+    int64_t size;
+    int64_t alloc;
+    int64_t atime;
+    int64_t mtime;
+    std::string meta; // packed xattr for the file's new location
+    std::string rel; // path within the tier
+  };
+private:
+  FILE *file;
+  std::mutex lock;
+  size_t records;
+  int64_t bytes;
+  int err; // of the first write that failed
+public:
+  MoveSpool() : file(NULL), records(0), bytes(0), err(0){}
+  ~MoveSpool(){ if(file) fclose(file); }
+  bool open(const fs::path &dir);
+  void add(const Record &r);
+  bool rewind(void);
+  bool next(Record &r);
+  size_t count(void) const{ return records; }
+  int64_t total_bytes(void) const{ return bytes; }
+  int error(void) const{ return err; }
+};
@@ -0,0 +1,99 @@
+#!/bin/bash
+# Mounts two tiers merged with --mount and reads, writes and renames a
+# file through it, the rename taking a file in the second tier into a
+# directory only the first tier has. Needs autotier built with
+# make FUSE=1, /dev/fuse, and root or fusermount3, and is skipped
+# without them.
+set -e
+AUTOTIER=${AUTOTIER:-./autotier}
+FAST=$(mktemp -d)
+SLOW=$(mktemp -d)
+MNT=$(mktemp -d)
+CONF=$(mktemp)
+LOG=$(mktemp)
+METRICS=$(mktemp -u)
+PID=
+cleanup(){
+  if [ -n "$PID" ]; then
+    kill "$PID" 2>/dev/null || true
+    wait "$PID" 2>/dev/null || true
+  fi
+  if mountpoint -q "$MNT"; then
+    fusermount3 -u "$MNT" 2>/dev/null || umount "$MNT"
+  fi
+  rm -rf "$FAST" "$SLOW" "$CONF" "$LOG" "$METRICS"
+  rmdir "$MNT"
+}
+trap cleanup EXIT
+if [ ! -c /dev/fuse ] || { [ "$(id -u)" != 0 ] && ! command -v fusermount3 > /dev/null; }; then
+  echo "skipped: no /dev/fuse, or neither root nor fusermount3"
+  exit 77
+fi
+cat > "$CONF" <<CONF
+[Global]
+LOG_LEVEL=1
+INDEX_PATH=none
+METRICS_PATH=$METRICS
+DAEMON_INTERVAL=3600
+[fast]
+DIR=$FAST
+WATERMARK=0
+[slow]
+DIR=$SLOW
+WATERMARK=100
+CONF
+
+# the first tier takes nothing, so the daemon's first pass leaves this where it is
+mkdir -p "$SLOW/data" "$FAST/data" "$FAST/inbox"
+echo "cold data" > "$SLOW/data/old"
+ln -s "$SLOW/data/old" "$FAST/data/old"
+
+"$AUTOTIER" -c "$CONF" -d -m "$MNT" > "$LOG" 2>&1 &
+PID=$!
+# mounted before the first pass, which is over once it has written the metrics
+for i in $(seq 50); do
+  mountpoint -q "$MNT" && [ -e "$METRICS" ] && break
+  if ! kill -0 "$PID" 2>/dev/null; then
+    if grep -q "without FUSE support" "$LOG"; then
+      echo "skipped: autotier was built without FUSE"
+      exit 77
+    fi
+    cat "$LOG"
+    echo "FAIL: the daemon exited before mounting"
+    exit 1
+  fi
+  sleep 0.2
+done
+if ! mountpoint -q "$MNT"; then
+  cat "$LOG"
+  echo "FAIL: $MNT was not mounted"
+  exit 1
+fi
+
+# read, wherever the file is
+if [ "$(cat "$MNT/data/old")" != "cold data" ]; then
+  echo "FAIL: cannot read a second tier file through the mount"
+  exit 1
+fi
+# write, new files land in the first tier
+echo "new data" > "$MNT/data/new"
+if [ "$(cat "$FAST/data/new")" != "new data" ] || [ "$(cat "$MNT/data/new")" != "new data" ]; then
+  echo "FAIL: a file written through the mount is not in the first tier"
+  exit 1
+fi
+# rename across tiers, keeping the file's inode number as seen through the mount
+ino=$(stat -c %i "$MNT/data/old")
+mv "$MNT/data/old" "$MNT/inbox/moved"
+if [ -e "$MNT/data/old" ] || [ "$(cat "$MNT/inbox/moved")" != "cold data" ]; then
+  echo "FAIL: rename through the mount"
+  exit 1
+fi
+if [ ! -f "$SLOW/inbox/moved" ] || [ ! -L "$FAST/inbox/moved" ] || [ -e "$FAST/data/old" ]; then
+  echo "FAIL: the renamed file or its link is not where it belongs"
+  exit 1
+fi
+if [ "$(stat -c %i "$MNT/inbox/moved")" != "$ino" ]; then
+  echo "FAIL: the inode number changed with the rename"
+  exit 1
+fi
+echo "ok"
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Promotes a file of 1 GiB, big enough for a resumable transfer, over the
+# first tier's link to it. The tiers must be on different filesystems so
+# the file is copied; set TEST_TIERS to two directories to pick them.
+set -e
+AUTOTIER=${AUTOTIER:-./autotier}
+read -r FAST SLOW <<< "${TEST_TIERS:-$(mktemp -d) $(mktemp -d -p /dev/shm)}"
+CONF=$(mktemp)
+trap 'rm -rf "$FAST/data" "$SLOW/data" "$CONF"; [ -n "$TEST_TIERS" ] || rm -rf "$FAST" "$SLOW"' EXIT
+if [ "$(stat -c %d "$FAST")" = "$(stat -c %d "$SLOW")" ]; then
+  echo "skipped: $FAST and $SLOW are on the same filesystem"
+  exit 77
+fi
+cat > "$CONF" <<CONF
+[Global]
+LOG_LEVEL=2
+INDEX_PATH=none
+[fast]
+DIR=$FAST
+WATERMARK=100
+[slow]
+DIR=$SLOW
+WATERMARK=100
+CONF
+
+mkdir -p "$SLOW/data"
+head -c 1M /dev/urandom > "$SLOW/data/big"
+truncate -s 1G "$SLOW/data/big"
+sum=$(md5sum < "$SLOW/data/big")
+# as an earlier run would have left it
+mkdir -p "$FAST/data"
+ln -s "$SLOW/data/big" "$FAST/data/big"
+
+"$AUTOTIER" -c "$CONF"
+
+if [ -L "$FAST/data/big" ] || [ ! -f "$FAST/data/big" ]; then
+  echo "FAIL: $FAST/data/big was not promoted"
+  exit 1
+fi
+if [ -e "$SLOW/data/big" ]; then
+  echo "FAIL: $SLOW/data/big was left behind"
+  exit 1
+fi
+if [ "$(md5sum < "$FAST/data/big")" != "$sum" ]; then
+  echo "FAIL: $FAST/data/big does not match its source"
+  exit 1
+fi
+if ls -A "$FAST/data" | grep -q autotier-part; then
+  echo "FAIL: partial copy left in $FAST/data"
+  exit 1
+fi
+echo "ok"
@@ -0,0 +1,302 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "transfer.hpp"
+#include "hash.hpp"
+#include "alert.hpp"
+#include "config.hpp"
+#include "metrics.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+class Transfer{
+private:
+  TransferHeader header;
+  std::vector<uint64_t> hashes;
+  std::vector<uint8_t> done;
+  std::mutex lock;
+public:
+  Transfer(const struct stat &src, enum HashAlgo algo);
+  bool resume(int fd);
+  bool is_done(uint32_t c) const{ return done[c / 8] & (1 << (c % 8)); }
+  size_t chunks_done(void) const;
+  uint32_t chunks(void) const{ return header.chunks; }
+  uint64_t chunk_size(void) const{ return header.chunk_size; }
+  void record(int fd, uint32_t c, uint64_t hash);
+  void save(int fd);
+};
+
+Transfer::Transfer(const struct stat &src, enum HashAlgo algo){
+  memset(&header, 0, sizeof(header));
+  header.magic = TRANSFER_MAGIC;
+  header.version = TRANSFER_VERSION;
+  header.hash_algo = algo;
+  header.src_ino = src.st_ino;
+  header.src_size = src.st_size;
+  header.src_mtime = src.st_mtim.tv_sec;
+  header.src_mtime_nsec = src.st_mtim.tv_nsec;
+  header.src_ctime = src.st_ctim.tv_sec;
+  header.src_ctime_nsec = src.st_ctim.tv_nsec;
+  // spread very large files over at most TRANSFER_MAX_CHUNKS chunks of whole tree leaves
+  uint64_t per_chunk = (src.st_size + TRANSFER_MAX_CHUNKS - 1) / TRANSFER_MAX_CHUNKS;
+  header.chunk_size = ((per_chunk + TREE_CHUNK_SZ - 1) / TREE_CHUNK_SZ) * TREE_CHUNK_SZ;
+  if(header.chunk_size == 0) header.chunk_size = TREE_CHUNK_SZ;
+  header.chunks = (src.st_size + header.chunk_size - 1) / header.chunk_size;
+  hashes.assign(header.chunks, 0);
+  done.assign((header.chunks + 7) / 8, 0);
+}
+
+bool Transfer::resume(int fd){
+  // only a record made for this exact source is trusted
+  std::vector<char> buff(sizeof(TransferHeader) + header.chunks * sizeof(uint64_t) + done.size());
+  ssize_t len = fgetxattr(fd, TRANSFER_XATTR, buff.data(), buff.size());
+  if(len != (ssize_t)buff.size()) return false;
+  TransferHeader stored;
+  memcpy(&stored, buff.data(), sizeof(stored));
+  if(memcmp(&stored, &header, sizeof(header)) != 0) return false;
+  memcpy(hashes.data(), buff.data() + sizeof(header), header.chunks * sizeof(uint64_t));
+  memcpy(done.data(), buff.data() + sizeof(header) + header.chunks * sizeof(uint64_t), done.size());
+  return true;
+}
+
+size_t Transfer::chunks_done() const{
+  size_t n = 0;
+  for(uint32_t c = 0; c < header.chunks; c++)
+    if(is_done(c)) n++;
+  return n;
+}
+
+void Transfer::record(int fd, uint32_t c, uint64_t hash){
+  std::lock_guard<std::mutex> guard(lock);
+  hashes[c] = hash;
+  done[c / 8] |= (1 << (c % 8));
+  save(fd);
+}
+
+void Transfer::save(int fd){
+  std::vector<char> buff(sizeof(header));
+  memcpy(buff.data(), &header, sizeof(header));
+  buff.insert(buff.end(), (char *)hashes.data(), (char *)(hashes.data() + hashes.size()));
+  buff.insert(buff.end(), done.begin(), done.end());
+  if(fsetxattr(fd, TRANSFER_XATTR, buff.data(), buff.size(), 0) == ERR)
+    error(SETX);
+}
+
+static int copy_chunk(int src_fd, int dst_fd, off_t offset, off_t len, enum CopyMethod method, Hasher *hash){
+  /*
+   * Offsets are explicit everywhere since every chunk thread shares the
+   * two fds. sendfile advances the shared output offset, so it is not
+   * used here. A source that ends before the chunk does has shrunk since
+   * the copy started, and fails it with ENODATA rather than leave a
+   * short chunk recorded as done.
+   */
+  if(!hash && method == COPY_RANGE){
+    off_t in = offset, out = offset, end = offset + len;
+    while(in < end){
+      ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, end - in, 0);
+      if(n == ERR && errno == EINTR) continue;
+      if(n == ERR && in == offset) break; // try the buffered copy instead
+      if(n == ERR) return errno;
+      if(n == 0) return ENODATA;
+    }
+    if(in == end) return 0;
+  }
+  void *buff;
+  if(posix_memalign(&buff, COPY_ALIGN, COPY_BUFF_SZ) != 0) return ENOMEM;
+  int err = 0;
+  for(off_t done = 0; done < len; ){
+    ssize_t n = pread(src_fd, buff, (len - done < COPY_BUFF_SZ)? len - done : COPY_BUFF_SZ, offset + done);
+    if(n == ERR && errno == EINTR) continue;
+    if(n == ERR){
+      err = errno;
+      break;
+    }
+    if(n == 0){
+      err = ENODATA;
+      break;
+    }
+    if(hash) hash->add(buff, n);
+    for(ssize_t w = 0; w < n; ){
+      ssize_t written = pwrite(dst_fd, (char *)buff + w, n - w, offset + done + w);
+      if(written == ERR && errno == EINTR) continue;
+      if(written == ERR){
+        err = errno;
+        break;
+      }
+      w += written;
+    }
+    if(err) break;
+    done += n;
+  }
+  posix_fadvise(src_fd, offset, len, POSIX_FADV_DONTNEED);
+  free(buff);
+  return err;
+}
+
+bool copy_target_free(const fs::path &src, const fs::path &dst, bool over_link){
+  struct stat dst_info, link_info, src_info;
+  if(lstat(dst.c_str(), &dst_info) == ERR) return errno == ENOENT;
+  // the link is matched by what it leads to, however its target was spelled
+  if(over_link && S_ISLNK(dst_info.st_mode) && stat(dst.c_str(), &link_info) == 0 && lstat(src.c_str(), &src_info) == 0
+  && link_info.st_dev == src_info.st_dev && link_info.st_ino == src_info.st_ino)
+    return true;
+  errno = EEXIST;
+  return false;
+}
+
+bool rename_copy(const fs::path &from, const fs::path &src, const fs::path &dst, bool over_link){
+  if(renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, dst.c_str(), RENAME_NOREPLACE) == 0) return true;
+  // EINVAL where the filesystem cannot refuse to replace
+  if(errno != EEXIST && errno != EINVAL && errno != ENOSYS) return false;
+  if(!copy_target_free(src, dst, over_link)) return false;
+  return rename(from.c_str(), dst.c_str()) == 0;
+}
+
+bool copy_resumable(const fs::path &src, const fs::path &dst, const CopyOptions &options, bool over_link){
+  int src_fd = open(src.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if(src_fd == ERR){
+    Log("Cannot open " + src.string() + ": " + strerror(errno),0);
+    return false;
+  }
+  struct stat info;
+  fs::path part = transfer_part_path(dst);
+  int dst_fd = ERR;
+  if(fstat(src_fd, &info) == ERR){
+    Log("Cannot stat " + src.string() + ": " + strerror(errno),0);
+    close(src_fd);
+    return false;
+  }
+  if(!copy_target_free(src, dst, over_link)){
+    Log("Cannot copy to " + dst.string() + ": " + strerror(errno),0);
+    close(src_fd);
+    return false;
+  }
+  if((dst_fd = open(part.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) == ERR){
+    Log("Cannot create " + part.string() + ": " + strerror(errno),0);
+    close(src_fd);
+    return false;
+  }
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_NOREUSE); // and each chunk is dropped once copied
+  Transfer transfer(info, options.hash);
+  bool resumed = transfer.resume(dst_fd);
+  // a whole-file clone is instant and needs no progress
+  if(!resumed && options.method == COPY_REFLINK && ftruncate(dst_fd, 0) == 0 && ioctl(dst_fd, FICLONE, src_fd) == 0){
+    close(src_fd);
+    close(dst_fd);
+    if(!rename_copy(part, src, dst, over_link)){
+      Log("Cannot rename " + part.string() + ": " + strerror(errno),0);
+      unlink(part.c_str());
+      return false;
+    }
+    return true;
+  }
+  if(resumed){
+    Log("Resuming " + src.string() + ", " + std::to_string(transfer.chunks_done()) + " of "
+      + std::to_string(transfer.chunks()) + " chunks already copied",1);
+  }else if(ftruncate(dst_fd, 0) == ERR || ftruncate(dst_fd, info.st_size) == ERR){
+    Log("Cannot size " + part.string() + ": " + strerror(errno),0);
+    close(src_fd);
+    close(dst_fd);
+    return false;
+  }else{
+    transfer.save(dst_fd);
+  }
+  bool full = (options.verify == VERIFY_FULL);
+  std::atomic<uint32_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&](){
+    for(uint32_t c = next++; c < transfer.chunks() && !failed; c = next++){
+      if(transfer.is_done(c)) continue;
+      off_t offset = (off_t)c * transfer.chunk_size();
+      off_t len = ((off_t)transfer.chunk_size() < info.st_size - offset)? (off_t)transfer.chunk_size() : info.st_size - offset;
+      Hasher hash(options.hash);
+      int err = copy_chunk(src_fd, dst_fd, offset, len, options.method, (full)? &hash : NULL);
+      uint64_t dst_hash = 0;
+      // the chunk is only recorded once it is on disk, and read back from there when verifying
+      if(!err && sync_file_range(dst_fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+      | SYNC_FILE_RANGE_WAIT_AFTER) == ERR && fdatasync(dst_fd) == ERR)
+        err = errno;
+      posix_fadvise(dst_fd, offset, len, POSIX_FADV_DONTNEED);
+      if(!err && full && (err = hash_range(dst_fd, options.hash, offset, offset + len, &dst_hash)) == 0 && dst_hash != hash.hash()){
+        Log("Chunk " + std::to_string(c) + " of " + dst.string() + " does not match its source!",0);
+        metrics.verify_failures++;
+        failed = true;
+        continue;
+      }
+      if(err){
+        Log("Copy error in chunk " + std::to_string(c) + " of " + dst.string() + ": " + strerror(err),0);
+        metrics.copy_failures++;
+        failed = true;
+        continue;
+      }
+      transfer.record(dst_fd, c, dst_hash);
+      metrics.bytes_copied += len;
+    }
+  };
+  uint64_t start = (metrics.enabled)? metrics_now() : 0;
+  size_t num_threads = (options.chunk_threads > 1)? options.chunk_threads : 1;
+  std::vector<std::thread> threads;
+  for(size_t t = 1; t < num_threads && t < transfer.chunks(); t++)
+    threads.emplace_back(worker);
+  worker();
+  for(std::thread &t : threads)
+    t.join();
+  bool ok = !failed && transfer.chunks_done() == transfer.chunks();
+  if(metrics.enabled){
+    // full verification is done chunk by chunk and counts as part of the copy
+    uint64_t copied = metrics_now();
+    if(ok) metrics.copy_latency.observe(copied - start);
+    start = copied;
+  }
+  if(ok && options.verify == VERIFY_SAMPLED){
+    bool match = false;
+    fdatasync(dst_fd);
+    posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+    ok = (sample_fds(src_fd, dst_fd, info.st_size, options.hash, &match) == 0 && match);
+    if(metrics.enabled) metrics.verify_latency.observe(metrics_now() - start);
+    if(!ok){
+      Log("Copy does not match its source!",0);
+      metrics.verify_failures++;
+      ftruncate(dst_fd, 0); // nothing in it can be trusted
+      fremovexattr(dst_fd, TRANSFER_XATTR);
+    }
+  }
+  if(ok) fremovexattr(dst_fd, TRANSFER_XATTR);
+  close(src_fd);
+  if(close(dst_fd) == ERR) ok = false;
+  // an unfinished transfer keeps its partial file for the next run
+  if(ok && !rename_copy(part, src, dst, over_link)){
+    Log("Cannot rename " + part.string() + ": " + strerror(errno),0);
+    ok = false;
+  }
+  return ok;
+}
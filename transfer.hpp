@@ -0,0 +1,77 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "copy.hpp"
+#include <boost/filesystem.hpp>
+#include <stdint.h>
+namespace fs = boost::filesystem;
+
+#define TRANSFER_MIN_SZ ((off_t)1 << 30) // smaller files are copied in one go
+#define TRANSFER_MAX_CHUNKS 256 // keeps the progress record inside one xattr block
+#define TRANSFER_SUFFIX ".autotier-part"
+#define TRANSFER_XATTR "user.autotier_transfer"
+#define TRANSFER_MAGIC 0x46585441 // "ATXF"
+#define TRANSFER_VERSION 2 // version 1 kept the source's mtime in seconds only
+
+struct TransferHeader{
+  /*
+   * Stored in TRANSFER_XATTR on the partial copy, followed by one hash
+   * per chunk and a bitmap of the chunks that are done.
+   */
+  uint32_t magic;
+  uint16_t version;
+  uint16_t hash_algo;
+  uint64_t src_ino;
+  uint64_t src_size;
+  int64_t src_mtime;
+  int64_t src_mtime_nsec;
+  int64_t src_ctime; // also changes when a rewrite puts the mtime back
+  int64_t src_ctime_nsec;
+  uint64_t chunk_size;
+  uint32_t chunks;
+  uint32_t reserved;
+};
+
+inline fs::path transfer_part_path(const fs::path &dst){
+  return dst.parent_path() / ("." + dst.filename().string() + TRANSFER_SUFFIX);
+}
+
+/*
+ * Whether a copy of src may be put at dst: nothing is there, or with
+ * over_link, only the first tier's link to src that a promotion lands
+ * on. Sets errno to EEXIST when something else is in the way.
+ */
+bool copy_target_free(const fs::path &src, const fs::path &dst, bool over_link);
+
+/*
+ * Renames from to dst, replacing nothing but what copy_target_free
+ * allows. Leaves errno set on failure.
+ */
+bool rename_copy(const fs::path &from, const fs::path &src, const fs::path &dst, bool over_link);
+
+/*
+ * Copies a large file chunk by chunk into a hidden partial file next to
+ * dst, recording each finished chunk, and renames it into place once
+ * every chunk is done. A transfer cut short resumes from the recorded
+ * chunks as long as the source did not change.
+ */
+bool copy_resumable(const fs::path &src, const fs::path &dst, const CopyOptions &options, bool over_link);
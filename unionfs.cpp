@@ -0,0 +1,573 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "unionfs.hpp"
+#include "alert.hpp"
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#include <set>
+#include <sys/statvfs.h>
+#include "crawler.hpp"
+#include "links.hpp"
+#include "transfer.hpp"
+#endif
+
+UnionFS::UnionFS(const std::vector<fs::path> &dirs_){
+  dirs = dirs_;
+  recording = true;
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fuse = NULL;
+}
+
+UnionFS::~UnionFS(){
+  unmount();
+  if(event_fd != ERR) ::close(event_fd);
+}
+
+int UnionFS::probe(const std::string &rel){
+  // a link in the first tier only counts when no tier has the file itself
+  bool link = false;
+  struct stat info;
+  for(size_t t = 0; t < dirs.size(); t++){
+    if(lstat((dirs[t] / rel).c_str(), &info) == ERR) continue;
+    if(t == 0 && S_ISLNK(info.st_mode)){
+      link = true;
+      continue;
+    }
+    if(S_ISREG(info.st_mode)){
+      std::lock_guard<std::mutex> guard(lock);
+      where[rel] = t;
+    }
+    return t;
+  }
+  if(link) return 0;
+  errno = ENOENT;
+  return ERR;
+}
+
+int UnionFS::locate(const std::string &rel, bool refresh){
+  if(!refresh){
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<std::string, uint16_t>::iterator itr = where.find(rel);
+    if(itr != where.end()) return itr->second;
+  }
+  return probe(rel);
+}
+
+int UnionFS::open(const std::string &rel, bool refresh){
+  // every call is paired with close(), whether the file was found or not
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    moved_cv.wait(guard, [this, &rel]{ return moving.count(rel) == 0; });
+    open_files[rel]++;
+  }
+  return locate(rel, refresh);
+}
+
+void UnionFS::close(const std::string &rel){
+  std::lock_guard<std::mutex> guard(lock);
+  std::unordered_map<std::string, int>::iterator itr = open_files.find(rel);
+  if(itr != open_files.end() && --itr->second == 0) open_files.erase(itr);
+}
+
+void UnionFS::forget(const std::string &rel){
+  std::lock_guard<std::mutex> guard(lock);
+  where.erase(rel);
+}
+
+void UnionFS::placed(const std::string &rel, uint16_t tier){
+  std::lock_guard<std::mutex> guard(lock);
+  where[rel] = tier;
+}
+
+bool UnionFS::claim(const std::string &rel){
+  std::lock_guard<std::mutex> guard(lock);
+  if(open_files.count(rel)) return false;
+  moving.insert(rel);
+  return true;
+}
+
+void UnionFS::release(const std::string &rel){
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    moving.erase(rel);
+  }
+  moved_cv.notify_all();
+}
+
+void UnionFS::record(const fs::path &path, enum WatchType type){
+  if(!recording) return;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending.push_back(WatchEvent{path, type});
+  }
+  uint64_t one = 1;
+  if(write(event_fd, &one, sizeof(one)) == ERR){} // already readable when it overflows
+}
+
+void UnionFS::drain(std::vector<WatchEvent> &events){
+  uint64_t count;
+  if(read(event_fd, &count, sizeof(count)) == ERR && errno == EAGAIN) return;
+  std::lock_guard<std::mutex> guard(lock);
+  events.insert(events.end(), pending.begin(), pending.end());
+  pending.clear();
+}
+
+#ifdef HAVE_FUSE
+
+struct Handle{
+  int fd;
+  std::string rel;
+  fs::path path;
+  bool written;
+};
+
+static UnionFS *self(void){
+  return (UnionFS *)fuse_get_context()->private_data;
+}
+
+static void own(const fs::path &path){
+  struct fuse_context *ctx = fuse_get_context();
+  if(lchown(path.c_str(), ctx->uid, ctx->gid) == ERR){} // best effort, like cp without -p
+}
+
+static fs::path in_first_tier(UnionFS *u, const std::string &rel){
+  // new entries go to the fastest tier, under a parent that may only exist further down
+  fs::path path = u->dir(0) / rel;
+  boost::system::error_code ec;
+  create_directories(path.parent_path(), ec);
+  return path;
+}
+
+static int union_getattr(const char *path, struct stat *info, struct fuse_file_info *fi){
+  if(fi && fi->fh) return (fstat(((Handle *)fi->fh)->fd, info) == ERR)? -errno : 0;
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->locate(rel);
+  if(t != ERR && lstat((u->dir(t) / rel).c_str(), info) == 0) return 0;
+  // moved since it was looked up
+  if((t = u->locate(rel, true)) == ERR) return -ENOENT;
+  return (lstat((u->dir(t) / rel).c_str(), info) == ERR)? -errno : 0;
+}
+
+static int union_readlink(const char *path, char *buff, size_t size){
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->locate(rel);
+  if(t == ERR) return -ENOENT;
+  ssize_t len = readlink((u->dir(t) / rel).c_str(), buff, size - 1);
+  if(len == ERR) return -errno;
+  buff[len] = '\0';
+  return 0;
+}
+
+static int union_mkdir(const char *path, mode_t mode){
+  fs::path dir = in_first_tier(self(), path + 1);
+  if(mkdir(dir.c_str(), mode) == ERR) return -errno;
+  own(dir);
+  return 0;
+}
+
+static int union_unlink(const char *path){
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->open(rel);
+  int err = 0;
+  if(t == ERR){
+    err = -ENOENT;
+  }else if(unlink((u->dir(t) / rel).c_str()) == ERR){
+    err = -errno;
+  }else{
+    struct stat info;
+    fs::path link = u->dir(0) / rel;
+    if(t != 0 && lstat(link.c_str(), &info) == 0 && S_ISLNK(info.st_mode)) unlink(link.c_str());
+    u->forget(rel);
+    u->record(u->dir(t) / rel, REMOVED);
+  }
+  u->close(rel);
+  return err;
+}
+
+static int union_rmdir(const char *path){
+  // the first tier last, it holds the links to everything below it
+  UnionFS *u = self();
+  int err = -ENOENT;
+  for(size_t t = u->tiers(); t-- > 0; ){
+    if(rmdir((u->dir(t) / (path + 1)).c_str()) == 0){
+      if(err == -ENOENT) err = 0;
+    }else if(errno != ENOENT){
+      err = -errno;
+    }
+  }
+  return err;
+}
+
+static int union_symlink(const char *target, const char *path){
+  fs::path link = in_first_tier(self(), path + 1);
+  if(symlink(target, link.c_str()) == ERR) return -errno;
+  own(link);
+  return 0;
+}
+
+static int union_rename(const char *from, const char *to, unsigned int flags){
+  if(flags) return -EINVAL; // callers fall back to a plain rename
+  UnionFS *u = self();
+  std::string rel = from + 1, new_rel = to + 1;
+  int t = u->open(rel);
+  int err = 0;
+  struct stat info;
+  if(t == ERR || lstat((u->dir(t) / rel).c_str(), &info) == ERR){
+    err = -ENOENT;
+  }else if(S_ISDIR(info.st_mode)){
+    // links below a directory point into it by full path, so only one that is whole in one tier can move
+    size_t copies = 0;
+    for(size_t d = 0; d < u->tiers(); d++)
+      copies += (lstat((u->dir(d) / rel).c_str(), &info) == 0);
+    if(copies > 1 || rename((u->dir(t) / rel).c_str(), (u->dir(t) / new_rel).c_str()) == ERR)
+      err = (copies > 1)? -EXDEV : -errno;
+  }else{
+    int old = u->locate(new_rel);
+    if(old != ERR && old != t && lstat((u->dir(old) / new_rel).c_str(), &info) == 0 && !S_ISDIR(info.st_mode))
+      unlink((u->dir(old) / new_rel).c_str()); // replaced, as it would be in one directory tree
+    fs::path dst = u->dir(t) / new_rel;
+    boost::system::error_code ec;
+    create_directories(dst.parent_path(), ec);
+    if(rename((u->dir(t) / rel).c_str(), dst.c_str()) == ERR){
+      err = -errno;
+    }else{
+      if(t != 0){
+        fs::path link = u->dir(0) / rel;
+        if(lstat(link.c_str(), &info) == 0 && S_ISLNK(info.st_mode)) unlink(link.c_str());
+        fs::path new_link = in_first_tier(u, new_rel);
+        unlink(new_link.c_str());
+        if(symlink(dst.c_str(), new_link.c_str()) == ERR)
+          Log("Cannot link " + new_link.string() + ": " + strerror(errno), 0);
+      }
+      u->forget(rel);
+      u->placed(new_rel, t);
+      u->record(u->dir(t) / rel, REMOVED);
+      u->record(dst, MODIFIED);
+    }
+  }
+  u->close(rel);
+  return err;
+}
+
+static int each_copy(const char *path, const std::function<int(const fs::path &)> &fn){
+  // a directory is changed in every tier that has it, a file where it is
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->locate(rel);
+  if(t == ERR) return -ENOENT;
+  struct stat info;
+  if(lstat((u->dir(t) / rel).c_str(), &info) == ERR) return -errno;
+  if(!S_ISDIR(info.st_mode)) return (fn(u->dir(t) / rel) == ERR)? -errno : 0;
+  int err = 0;
+  for(size_t d = 0; d < u->tiers(); d++)
+    if(lstat((u->dir(d) / rel).c_str(), &info) == 0 && fn(u->dir(d) / rel) == ERR) err = -errno;
+  return err;
+}
+
+static int union_chmod(const char *path, mode_t mode, struct fuse_file_info *fi){
+  if(fi && fi->fh) return (fchmod(((Handle *)fi->fh)->fd, mode) == ERR)? -errno : 0;
+  return each_copy(path, [mode](const fs::path &p){ return chmod(p.c_str(), mode); });
+}
+
+static int union_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi){
+  if(fi && fi->fh) return (fchown(((Handle *)fi->fh)->fd, uid, gid) == ERR)? -errno : 0;
+  return each_copy(path, [uid, gid](const fs::path &p){ return lchown(p.c_str(), uid, gid); });
+}
+
+static int union_utimens(const char *path, const struct timespec times[2], struct fuse_file_info *fi){
+  if(fi && fi->fh) return (futimens(((Handle *)fi->fh)->fd, times) == ERR)? -errno : 0;
+  return each_copy(path, [times](const fs::path &p){ return utimensat(AT_FDCWD, p.c_str(), times, AT_SYMLINK_NOFOLLOW); });
+}
+
+static int union_truncate(const char *path, off_t size, struct fuse_file_info *fi){
+  if(fi && fi->fh){
+    Handle *h = (Handle *)fi->fh;
+    if(ftruncate(h->fd, size) == ERR) return -errno;
+    h->written = true;
+    return 0;
+  }
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->open(rel);
+  int err = (t == ERR)? -ENOENT : 0;
+  if(!err && truncate((u->dir(t) / rel).c_str(), size) == ERR) err = -errno;
+  if(!err) u->record(u->dir(t) / rel, MODIFIED);
+  u->close(rel);
+  return err;
+}
+
+static int open_handle(UnionFS *u, const std::string &rel, int t, int flags, mode_t mode, struct fuse_file_info *fi){
+  Handle *h = new Handle{ERR, rel, u->dir(t) / rel, false};
+  h->fd = open(h->path.c_str(), flags, mode);
+  if(h->fd == ERR){
+    int err = errno;
+    delete h;
+    return -err;
+  }
+  fi->fh = (uint64_t)h;
+  return 0;
+}
+
+static int union_open(const char *path, struct fuse_file_info *fi){
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->open(rel);
+  int err = (t == ERR)? -ENOENT : open_handle(u, rel, t, fi->flags, 0, fi);
+  if(err == -ENOENT){
+    u->close(rel);
+    t = u->open(rel, true);
+    err = (t == ERR)? -ENOENT : open_handle(u, rel, t, fi->flags, 0, fi);
+  }
+  if(err){
+    u->close(rel);
+    return err;
+  }
+  u->record(((Handle *)fi->fh)->path, OPENED);
+  return 0;
+}
+
+static int union_create(const char *path, mode_t mode, struct fuse_file_info *fi){
+  UnionFS *u = self();
+  std::string rel = path + 1;
+  int t = u->open(rel);
+  bool created = (t == ERR);
+  if(created){
+    in_first_tier(u, rel);
+    t = 0;
+  }
+  int err = open_handle(u, rel, t, fi->flags | O_CREAT, mode, fi);
+  if(err){
+    u->close(rel);
+    return err;
+  }
+  Handle *h = (Handle *)fi->fh;
+  if(created){
+    own(h->path);
+    u->placed(rel, 0);
+  }
+  h->written = true;
+  return 0;
+}
+
+static int union_read_buf(const char *, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi){
+  // handed back as an fd, so the kernel splices it instead of copying through us
+  struct fuse_bufvec *src = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+  if(!src) return -ENOMEM;
+  *src = FUSE_BUFVEC_INIT(size);
+  src->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  src->buf[0].fd = ((Handle *)fi->fh)->fd;
+  src->buf[0].pos = offset;
+  *bufp = src;
+  return 0;
+}
+
+static int union_write_buf(const char *, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi){
+  Handle *h = (Handle *)fi->fh;
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+  dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  dst.buf[0].fd = h->fd;
+  dst.buf[0].pos = offset;
+  h->written = true;
+  return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+static int union_flush(const char *, struct fuse_file_info *fi){
+  // reports errors close() would, the fd itself stays open until release
+  int fd = dup(((Handle *)fi->fh)->fd);
+  if(fd == ERR) return -errno;
+  return (close(fd) == ERR)? -errno : 0;
+}
+
+static int union_release(const char *, struct fuse_file_info *fi){
+  UnionFS *u = self();
+  Handle *h = (Handle *)fi->fh;
+  close(h->fd);
+  if(h->written) u->record(h->path, MODIFIED);
+  u->close(h->rel);
+  delete h;
+  return 0;
+}
+
+static int union_fsync(const char *, int datasync, struct fuse_file_info *fi){
+  int fd = ((Handle *)fi->fh)->fd;
+  return (((datasync)? fdatasync(fd) : fsync(fd)) == ERR)? -errno : 0;
+}
+
+static int union_statfs(const char *, struct statvfs *out){
+  // tiers sharing a file system are only counted once
+  UnionFS *u = self();
+  std::set<dev_t> seen;
+  bool first = true;
+  for(size_t t = 0; t < u->tiers(); t++){
+    struct statvfs info;
+    struct stat dir_info;
+    if(stat(u->dir(t).c_str(), &dir_info) == ERR || !seen.insert(dir_info.st_dev).second
+    || statvfs(u->dir(t).c_str(), &info) == ERR) continue;
+    if(first){
+      *out = info;
+      first = false;
+      continue;
+    }
+    double scale = (double)info.f_frsize / out->f_frsize;
+    out->f_blocks += info.f_blocks * scale;
+    out->f_bfree += info.f_bfree * scale;
+    out->f_bavail += info.f_bavail * scale;
+    out->f_files += info.f_files;
+    out->f_ffree += info.f_ffree;
+    out->f_favail += info.f_favail;
+  }
+  return (first)? -EIO : 0;
+}
+
+static bool temporary(const char *name){
+  // partial copies and links not yet renamed into place
+  size_t len = strlen(name);
+  for(const char *suffix : {TRANSFER_SUFFIX, LINK_SUFFIX}){
+    size_t n = strlen(suffix);
+    if(name[0] == '.' && len > n && strcmp(name + len - n, suffix) == 0) return true;
+  }
+  return false;
+}
+
+static int union_readdir(const char *path, void *buff, fuse_fill_dir_t filler, off_t, struct fuse_file_info *,
+enum fuse_readdir_flags){
+  UnionFS *u = self();
+  std::set<std::string> names;
+  bool found = false;
+  for(size_t t = 0; t < u->tiers(); t++){
+    DirReader reader((u->dir(t) / (path + 1)).c_str());
+    if(reader.fd() == ERR) continue;
+    found = true;
+    const char *name;
+    unsigned char type;
+    uint64_t ino;
+    while(reader.next(name, type, ino))
+      if(!temporary(name)) names.insert(name);
+  }
+  if(!found) return -ENOENT;
+  filler(buff, ".", NULL, 0, (enum fuse_fill_dir_flags)0);
+  filler(buff, "..", NULL, 0, (enum fuse_fill_dir_flags)0);
+  for(const std::string &name : names)
+    if(filler(buff, name.c_str(), NULL, 0, (enum fuse_fill_dir_flags)0)) break;
+  return 0;
+}
+
+static int union_access(const char *path, int){
+  // permissions are checked by the kernel, see default_permissions
+  return (self()->locate(path + 1) == ERR)? -ENOENT : 0;
+}
+
+static void *union_init(struct fuse_conn_info *, struct fuse_config *cfg){
+  /*
+   * Inode numbers are FUSE's own, which follow a file through renames
+   * and moves between tiers, and with noforget last as long as the
+   * mount, as NFS file handles need. The backing files' numbers would
+   * change with every move and repeat between tiers on different
+   * filesystems.
+   */
+  cfg->use_ino = 0;
+  return fuse_get_context()->private_data;
+}
+
+static struct fuse_operations union_operations(void){
+  struct fuse_operations ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.init = union_init;
+  ops.getattr = union_getattr;
+  ops.readlink = union_readlink;
+  ops.mkdir = union_mkdir;
+  ops.unlink = union_unlink;
+  ops.rmdir = union_rmdir;
+  ops.symlink = union_symlink;
+  ops.rename = union_rename;
+  ops.chmod = union_chmod;
+  ops.chown = union_chown;
+  ops.truncate = union_truncate;
+  ops.utimens = union_utimens;
+  ops.open = union_open;
+  ops.create = union_create;
+  ops.read_buf = union_read_buf;
+  ops.write_buf = union_write_buf;
+  ops.flush = union_flush;
+  ops.release = union_release;
+  ops.fsync = union_fsync;
+  ops.statfs = union_statfs;
+  ops.readdir = union_readdir;
+  ops.access = union_access;
+  return ops;
+}
+
+#endif
+
+bool UnionFS::mount(const fs::path &at){
+#ifdef HAVE_FUSE
+  static struct fuse_operations ops = union_operations();
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  fuse_opt_add_arg(&args, "autotier");
+  fuse_opt_add_arg(&args, "-o");
+  // autotier runs as root, so the kernel has to check permissions for it
+  fuse_opt_add_arg(&args, "allow_other,default_permissions,noforget,fsname=autotier,subtype=autotier");
+  struct fuse *f = fuse_new(&args, &ops, sizeof(ops), this);
+  fuse_opt_free_args(&args);
+  if(!f){
+    Log("Cannot start FUSE.", 0);
+    return false;
+  }
+  if(fuse_mount(f, at.c_str()) != 0){
+    Log("Cannot mount " + at.string(), 0);
+    fuse_destroy(f);
+    return false;
+  }
+  fuse = f;
+  mountpoint = at;
+  loop = std::thread([f]{ fuse_loop_mt(f, 0); });
+  Log("Mounted all tiers on " + at.string(), 1);
+  return true;
+#else
+  Log("autotier was built without FUSE support, rebuild it with make FUSE=1 to use --mount.", 0);
+  return false;
+#endif
+}
+
+void UnionFS::unmount(){
+#ifdef HAVE_FUSE
+  if(!fuse) return;
+  struct fuse *f = (struct fuse *)fuse;
+  fuse_exit(f);
+  fuse_unmount(f); // wakes the loop
+  if(loop.joinable()) loop.join();
+  fuse_destroy(f);
+  fuse = NULL;
+  Log("Unmounted " + mountpoint.string(), 1);
+#endif
+}
@@ -0,0 +1,83 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "watch.hpp"
+#include <boost/filesystem.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+namespace fs = boost::filesystem;
+
+class UnionFS{
+  /*
+   * A FUSE mount showing every tier merged into one tree, for clients
+   * that cannot follow the first tier's symlinks, like NFS. Files are
+   * found through a table of where each one is instead of probing the
+   * tiers, reads and writes are spliced straight to the backing file,
+   * and opens are handed to the daemon as accesses, the same as the
+   * watcher's events. Only built with make FUSE=1; without it mount()
+   * says so and fails.
+   *
+   * The daemon claims a file before moving it. Opens wait while a file
+   * is claimed, and a file that is open cannot be claimed, so nothing
+   * is written to a copy that is about to be removed.
+   */
+private:
+  std::vector<fs::path> dirs;
+  std::mutex lock;
+  std::condition_variable moved_cv;
+  std::unordered_map<std::string, uint16_t> where; // relative path to tier
+  std::unordered_map<std::string, int> open_files; // relative path to open handles
+  std::unordered_set<std::string> moving;
+  std::vector<WatchEvent> pending;
+  bool recording;
+  int event_fd;
+  void *fuse; // struct fuse, only known to unionfs.cpp
+  std::thread loop;
+  fs::path mountpoint;
+  int probe(const std::string &rel);
+public:
+  UnionFS(const std::vector<fs::path> &dirs_);
+  ~UnionFS();
+  bool mount(const fs::path &at);
+  void unmount(void);
+  // called by the daemon
+  void placed(const std::string &rel, uint16_t tier);
+  bool claim(const std::string &rel);
+  void release(const std::string &rel);
+  void set_recording(bool on){ recording = on; }
+  int wake_fd(void) const{ return event_fd; }
+  void drain(std::vector<WatchEvent> &events);
+  // called by the FUSE callbacks
+  const fs::path &dir(uint16_t tier) const{ return dirs[tier]; }
+  size_t tiers(void) const{ return dirs.size(); }
+  int locate(const std::string &rel, bool refresh = false);
+  int open(const std::string &rel, bool refresh = false);
+  void close(const std::string &rel);
+  void forget(const std::string &rel);
+  void record(const fs::path &path, enum WatchType type);
+};
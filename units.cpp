@@ -0,0 +1,329 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "units.hpp"
+#include "crawl.hpp"
+#include "alert.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void PlacementUnits::clear(){
+  dir.clear();
+  first.clear();
+  members.clear();
+  tier.clear();
+  linked.clear();
+  size.clear();
+  alloc.clear();
+  atime.clear();
+  of.clear();
+}
+
+void PlacementUnits::build(const FileTable &files, const PathPool &paths, const std::vector<bool> &named, long max_files,
+int64_t max_size, const std::vector<fs::path> &tier_dirs, unsigned min_depth){
+  /*
+   * Directory ids are handed out parents first, so one pass from the
+   * end adds each subtree's totals into its parent and one from the
+   * start finds the topmost directory of each unit. The tier
+   * directories themselves are never a unit, nor any directory less
+   * than min_depth below them, which shared tiers split between nodes.
+   */
+  clear();
+  size_t num_dirs = paths.size();
+  std::vector<uint32_t> tree_files(num_dirs, 0);
+  std::vector<int64_t> tree_bytes(num_dirs, 0);
+  for(uint32_t i = 0; i < files.count(); i++){
+    if(files.flags[i] & FILE_REMOVED) continue;
+    tree_files[files.dir[i]]++;
+    tree_bytes[files.dir[i]] += files.size[i];
+  }
+  for(uint32_t d = num_dirs; d-- > 1; ){
+    tree_files[paths.parent(d)] += tree_files[d];
+    tree_bytes[paths.parent(d)] += tree_bytes[d];
+  }
+  bool by_size = max_files || max_size;
+  std::vector<uint32_t> unit_at(num_dirs, NO_UNIT);
+  std::vector<unsigned> depth(num_dirs, 0);
+  for(uint32_t d = 1; d < num_dirs; d++){
+    uint32_t above = unit_at[paths.parent(d)];
+    depth[d] = depth[paths.parent(d)] + 1;
+    if(above != NO_UNIT){
+      unit_at[d] = above;
+    }else if(tree_files[d] && depth[d] >= min_depth && ((d < named.size() && named[d])
+    || (by_size && (!max_files || tree_files[d] <= (uint64_t)max_files) && (!max_size || tree_bytes[d] <= max_size)))){
+      unit_at[d] = dir.size();
+      dir.push_back(d);
+    }
+  }
+  if(dir.empty()) return;
+
+  // members grouped by unit, in row order
+  of.assign(files.count(), NO_UNIT);
+  first.assign(dir.size() + 1, 0);
+  for(uint32_t i = 0; i < files.count(); i++){
+    if(files.flags[i] & FILE_REMOVED) continue;
+    of[i] = unit_at[files.dir[i]];
+    if(of[i] != NO_UNIT) first[of[i] + 1]++;
+  }
+  for(size_t u = 0; u < dir.size(); u++)
+    first[u + 1] += first[u];
+  members.resize(first.back());
+  std::vector<uint32_t> next(first.begin(), first.end() - 1);
+  for(uint32_t i = 0; i < files.count(); i++)
+    if(of[i] != NO_UNIT) members[next[of[i]]++] = i;
+
+  tier.assign(dir.size(), MIXED_TIERS);
+  linked.assign(dir.size(), false);
+  size.assign(dir.size(), 0);
+  alloc.assign(dir.size(), 0);
+  atime.assign(dir.size(), INT64_MIN);
+  for(uint32_t u = 0; u < dir.size(); u++){
+    tier[u] = files.tier[lead(u)];
+    for(uint32_t k = first[u]; k < first[u + 1]; k++){
+      uint32_t i = members[k];
+      if(files.tier[i] != tier[u]) tier[u] = MIXED_TIERS;
+      size[u] += files.size[i];
+      alloc[u] += files.alloc[i];
+      if(files.atime[i] > atime[u]) atime[u] = files.atime[i];
+    }
+    if(tier[u] == 0){
+      linked[u] = true; // the crawl does not follow symlinks, so the directory is there
+    }else if(tier[u] != MIXED_TIERS){
+      // one readlink per unit, instead of listing the first tier's directory
+      fs::path link = tier_dirs.front() / paths.path(dir[u]);
+      std::string target = (tier_dirs[tier[u]] / paths.path(dir[u])).string();
+      char buff[PATH_MAX];
+      ssize_t len = readlink(link.c_str(), buff, sizeof(buff));
+      linked[u] = len == (ssize_t)target.length() && target.compare(0, len, buff, len) == 0;
+    }
+  }
+}
+
+uint16_t PlacementUnits::from_tier(uint32_t u, const FileTable &files, uint16_t to) const{
+  // a unit spread over tiers moves from the first one that is not its destination
+  if(tier[u] != MIXED_TIERS) return tier[u];
+  for(uint32_t k = first[u]; k < first[u + 1]; k++)
+    if(files.tier[members[k]] != to) return files.tier[members[k]];
+  return to;
+}
+
+uint64_t PlacementUnits::score(enum ScoreModel model, const FileTable &files, uint32_t u, double half_life, int64_t now) const{
+  // as hot as its hottest file, so a working set moves up as soon as any of it is used
+  uint64_t best = 0;
+  for(uint32_t k = first[u]; k < first[u + 1]; k++){
+    uint64_t s = file_score(model, files, members[k], half_life, now);
+    if(s > best) best = s;
+  }
+  return best;
+}
+
+static fs::path unit_tmp(const fs::path &path){
+  // next to the unit's name in the first tier, hidden and left out of the crawl like a link's
+  return path.parent_path() / ("." + path.filename().string() + UNIT_SUFFIX);
+}
+
+static bool only_links(const fs::path &dir){
+  // whether a tree in the first tier holds nothing that removing it would lose
+  boost::system::error_code ec;
+  for(fs::recursive_directory_iterator itr(dir, ec), end; !ec && itr != end; itr.increment(ec)){
+    fs::file_type type = itr->symlink_status().type();
+    if(type != fs::directory_file && type != fs::symlink_file) return false;
+  }
+  return !ec;
+}
+
+static bool clear_tmp(const fs::path &tmp){
+  // left behind by a run that was interrupted, only ever links
+  struct stat info;
+  if(lstat(tmp.c_str(), &info) == ERR) return errno == ENOENT;
+  boost::system::error_code ec;
+  if(S_ISLNK(info.st_mode) || (S_ISDIR(info.st_mode) && only_links(tmp))){
+    remove_all(tmp, ec);
+    return !ec;
+  }
+  Log("Cannot place unit: " + tmp.string() + " is in the way", 0);
+  return false;
+}
+
+static bool swap_in(const fs::path &tmp, const fs::path &path){
+  // tmp takes path's place and what was there ends up at tmp, in one step where the filesystem can
+  if(renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, path.c_str(), RENAME_EXCHANGE) == 0) return true;
+  if(errno != EINVAL && errno != ENOSYS) return false;
+  fs::path old = tmp.string() + ".old";
+  if(rename(path.c_str(), old.c_str()) == ERR) return false;
+  if(rename(tmp.c_str(), path.c_str()) == ERR){
+    rename(old.c_str(), path.c_str());
+    return false;
+  }
+  return rename(old.c_str(), tmp.c_str()) == 0;
+}
+
+bool TierEngine::link_unit(uint32_t u, uint16_t t){
+  /*
+   * Makes a unit in a lower tier reachable through one link to its
+   * directory. A directory of links to its files, from when they were
+   * moved one by one, is swapped for the link and then removed. One
+   * that holds anything but links and directories is left as it is.
+   */
+  fs::path rel = paths.path(units.dir[u]);
+  fs::path link = tiers.front().dir / rel, tmp = unit_tmp(link);
+  fs::path target = tiers[t].dir / rel;
+  struct stat info;
+  bool placed = false;
+  boost::system::error_code ec;
+  if(lstat(link.c_str(), &info) == ERR){
+    create_directories(link.parent_path(), ec);
+    placed = symlink(target.c_str(), link.c_str()) == 0;
+  }else if(S_ISLNK(info.st_mode)){
+    placed = links.link_at(link, target);
+  }else if(S_ISDIR(info.st_mode) && only_links(link) && clear_tmp(tmp)){
+    if(symlink(target.c_str(), tmp.c_str()) == 0 && swap_in(tmp, link)){
+      placed = true;
+      // clients only see the link now, so nothing new can have been added since the check
+      if(only_links(tmp))
+        remove_all(tmp, ec);
+      else
+        Log("Leaving " + tmp.string() + ", files were added to it", 0);
+    }else{
+      unlink(tmp.c_str());
+    }
+  }
+  if(!placed){
+    Log("Cannot link " + link.string() + " to " + target.string() + ", its files stay linked one by one", 2);
+    return false;
+  }
+  units.linked[u] = true;
+  for(uint32_t k = units.first[u]; k < units.first[u + 1]; k++)
+    files.flags[units.members[k]] |= FILE_LINKED;
+  return true;
+}
+
+bool TierEngine::unlink_unit(uint32_t u){
+  // the other way around, for when the unit's files are about to be moved one by one
+  fs::path rel = paths.path(units.dir[u]);
+  fs::path link = tiers.front().dir / rel, tmp = unit_tmp(link);
+  if(!clear_tmp(tmp)) return false;
+  boost::system::error_code ec;
+  create_directory(tmp, ec);
+  size_t skip = rel.string().length() + 1;
+  for(uint32_t k = units.first[u]; k < units.first[u + 1] && !ec; k++){
+    uint32_t i = units.members[k];
+    std::string full = files.relative_path(i, paths).string();
+    fs::path path = tmp / full.substr(skip);
+    create_directories(path.parent_path(), ec);
+    if(!ec && symlink((tiers[files.tier[i]].dir / full).c_str(), path.c_str()) == ERR)
+      ec.assign(errno, boost::system::system_category());
+  }
+  if(ec || !swap_in(tmp, link)){
+    Log("Cannot expand " + link.string() + " into links to its files", 0);
+    remove_all(tmp, ec);
+    return false;
+  }
+  unlink(tmp.c_str()); // the old link
+  units.linked[u] = false;
+  return true;
+}
+
+bool TierEngine::rename_unit(uint32_t u, const Move &m){
+  /*
+   * The whole directory in one rename, with the first tier's link put
+   * in place or swapped out right after it. Only for a unit that is
+   * all in one tier on the destination's filesystem, and only if
+   * nothing but an empty directory is in the way there.
+   */
+  fs::path rel = paths.path(units.dir[u]);
+  fs::path src = tiers[m.from].dir / rel, dst = tiers[m.to].dir / rel;
+  fs::path link = tiers.front().dir / rel, tmp = unit_tmp(link);
+  std::vector<std::string> claimed;
+  for(uint32_t k = units.first[u]; k < units.first[u + 1] && mounted; k++){
+    std::string path = files.relative_path(units.members[k], paths).string();
+    if(!mounted->claim(path)) break;
+    claimed.push_back(path);
+  }
+  bool renamed = false;
+  if(!mounted || claimed.size() == units.first[u + 1] - units.first[u]){
+    boost::system::error_code ec;
+    create_directories(dst.parent_path(), ec);
+    if(m.from == 0){
+      if(clear_tmp(tmp) && symlink(dst.c_str(), tmp.c_str()) == 0){
+        renamed = rename(src.c_str(), dst.c_str()) == 0;
+        if(!renamed)
+          unlink(tmp.c_str());
+        else if(rename(tmp.c_str(), link.c_str()) == ERR)
+          Log("Cannot link " + link.string() + ": " + strerror(errno), 0);
+      }
+    }else if(m.to == 0){
+      if(clear_tmp(tmp) && rename(src.c_str(), tmp.c_str()) == 0){
+        renamed = swap_in(tmp, link);
+        if(renamed)
+          unlink(tmp.c_str()); // the old link
+        else
+          rename(tmp.c_str(), src.c_str());
+      }
+    }else if(rename(src.c_str(), dst.c_str()) == 0){
+      renamed = true;
+      links.link_at(link, dst);
+    }
+  }
+  for(const std::string &path : claimed){
+    if(renamed) mounted->placed(path, m.to);
+    mounted->release(path);
+  }
+  if(!renamed) return false;
+  for(uint32_t k = units.first[u]; k < units.first[u + 1]; k++){
+    uint32_t i = units.members[k];
+    files.tier[i] = m.to;
+    files.flags[i] |= FILE_LINKED; // a rename keeps the xattrs
+    metrics.moved(m.from, m.to, files.size[i], true);
+  }
+  units.tier[u] = m.to;
+  units.linked[u] = true;
+  Log("Moved " + src.string() + " to " + dst.string(), 2);
+  return true;
+}
+
+bool TierEngine::move_unit(const Move &m){
+  /*
+   * move_file for a unit: renamed at once if it can be, otherwise its
+   * files are moved one by one, each behind its own link in the first
+   * tier, and the links are folded back into one when all of them made
+   * it to a lower tier. Called from the mover's threads; no two hold
+   * the same unit.
+   */
+  uint32_t u = units.unit_of(m.file);
+  if(units.tier[u] == m.from && units.linked[u] && tiers[m.from].copy_to[m.to] == COPY_RENAME && rename_unit(u, m))
+    return true;
+  struct stat info;
+  fs::path link = tiers.front().dir / paths.path(units.dir[u]);
+  if(lstat(link.c_str(), &info) == 0 && S_ISLNK(info.st_mode) && !unlink_unit(u)) return false;
+  bool all = true;
+  for(uint32_t k = units.first[u]; k < units.first[u + 1]; k++){
+    uint32_t i = units.members[k];
+    if(files.tier[i] != m.to) all = move_file(Move{i, files.tier[i], m.to}) && all;
+  }
+  if(!all) return false;
+  units.tier[u] = m.to;
+  if(m.to != 0) link_unit(u, m.to);
+  return true;
+}
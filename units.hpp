@@ -0,0 +1,62 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "filetable.hpp"
+#include "score.hpp"
+#include <boost/filesystem.hpp>
+#include <stdint.h>
+#include <vector>
+namespace fs = boost::filesystem;
+
+#define NO_UNIT ((uint32_t)-1)
+#define MIXED_TIERS ((uint16_t)-1)
+#define UNIT_SUFFIX ".autotier-unit"
+
+class PlacementUnits{
+  /*
+   * Directories placed as a whole instead of file by file: the ones
+   * named by UNIT_DIR, and the topmost ones whose subtree stays within
+   * UNIT_MAX_FILES and UNIT_MAX_SIZE. A unit ranks as its hottest file,
+   * weighs as all of them, and lives in one tier; in a lower tier the
+   * first tier holds one symlink to its directory instead of one per
+   * file. Its first member row stands for it in the ranking and the
+   * move plan. Rebuilt for every placement.
+   */
+public:
+  std::vector<uint32_t> dir; // PathPool id of the unit's directory
+  std::vector<uint32_t> first; // into members, with one more for the end
+  std::vector<uint32_t> members; // FileTable rows, grouped by unit
+  std::vector<uint16_t> tier; // the one every member is in, MIXED_TIERS if they are spread out
+  std::vector<bool> linked; // reachable from the first tier as a whole
+  std::vector<int64_t> size;
+  std::vector<int64_t> alloc;
+  std::vector<int64_t> atime; // newest of its files'
+  std::vector<uint32_t> of; // by row, NO_UNIT for files placed alone
+  void clear(void);
+  void build(const FileTable &files, const PathPool &paths, const std::vector<bool> &named, long max_files,
+    int64_t max_size, const std::vector<fs::path> &tier_dirs, unsigned min_depth = 1);
+  size_t count(void) const{ return dir.size(); }
+  bool empty(void) const{ return dir.empty(); }
+  uint32_t unit_of(uint32_t row) const{ return (row < of.size())? of[row] : NO_UNIT; }
+  uint32_t lead(uint32_t u) const{ return members[first[u]]; }
+  uint16_t from_tier(uint32_t u, const FileTable &files, uint16_t to) const;
+  uint64_t score(enum ScoreModel model, const FileTable &files, uint32_t u, double half_life, int64_t now) const;
+};
@@ -0,0 +1,187 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "uring.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+MetaRing::MetaRing(unsigned depth_){
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = -1;
+  depth = 0;
+  to_submit = 0;
+  in_flight = 0;
+  getxattr_supported = false;
+  sq_ptr = cq_ptr = MAP_FAILED;
+  sqes = (struct io_uring_sqe *)MAP_FAILED;
+  int fd = syscall(__NR_io_uring_setup, depth_, &params);
+  if(fd < 0) return;
+  ring_fd = fd;
+  depth = params.sq_entries;
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(cq_size > sq_size) sq_size = cq_size;
+    cq_size = sq_size;
+  }
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ptr = sq_ptr;
+  else
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED){
+    teardown();
+    return;
+  }
+  char *sq = (char *)sq_ptr;
+  char *cq = (char *)cq_ptr;
+  sq_head = (unsigned *)(sq + params.sq_off.head);
+  sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + params.sq_off.array);
+  cq_head = (unsigned *)(cq + params.cq_off.head);
+  cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  probe();
+}
+
+MetaRing::~MetaRing(){
+  teardown();
+}
+
+void MetaRing::teardown(){
+  if(sqes != MAP_FAILED) munmap(sqes, depth * sizeof(struct io_uring_sqe));
+  if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+  if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+  sqes = (struct io_uring_sqe *)MAP_FAILED;
+  sq_ptr = cq_ptr = MAP_FAILED;
+  if(ring_fd != -1) close(ring_fd);
+  ring_fd = -1;
+}
+
+void MetaRing::probe(){
+  /*
+   * statx arrived in 5.6 and the xattr opcodes in 5.19. Without statx
+   * the ring is no use to the crawler; without getxattr the caller
+   * still reads xattrs synchronously.
+   */
+  size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *p = (struct io_uring_probe *)calloc(1, len);
+  bool statx_supported = false;
+  if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, p, IORING_OP_LAST) == 0){
+    statx_supported = p->last_op >= IORING_OP_STATX &&
+      (p->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    getxattr_supported = p->last_op >= IORING_OP_GETXATTR &&
+      (p->ops[IORING_OP_GETXATTR].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(p);
+  if(!statx_supported) teardown();
+}
+
+struct io_uring_sqe *MetaRing::get_sqe(){
+  unsigned tail = *sq_tail;
+  if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= depth)
+    return NULL;
+  unsigned index = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  return sqe;
+}
+
+bool MetaRing::queue_statx(int dirfd, const char *name, struct statx *buff, uint64_t user_data){
+  struct io_uring_sqe *sqe = get_sqe();
+  if(!sqe) return false;
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (uint64_t)(uintptr_t)name;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->addr2 = (uint64_t)(uintptr_t)buff;
+  sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+  sqe->user_data = user_data;
+  __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+  to_submit++;
+  return true;
+}
+
+bool MetaRing::queue_getxattr(const char *path, const char *attr, void *value, size_t len, uint64_t user_data){
+  if(!getxattr_supported) return false;
+  struct io_uring_sqe *sqe = get_sqe();
+  if(!sqe) return false;
+  sqe->opcode = IORING_OP_GETXATTR;
+  sqe->addr = (uint64_t)(uintptr_t)attr;
+  sqe->addr2 = (uint64_t)(uintptr_t)value;
+  sqe->addr3 = (uint64_t)(uintptr_t)path;
+  sqe->len = len;
+  sqe->user_data = user_data;
+  __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+  to_submit++;
+  return true;
+}
+
+int MetaRing::submit_and_wait(unsigned min_complete){
+  int ret;
+  do{
+    ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+  }while(ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+  if(ret >= 0){
+    unsigned submitted = ((unsigned)ret < to_submit)? ret : to_submit;
+    to_submit -= submitted;
+    in_flight += submitted;
+  }
+  return ret;
+}
+
+bool MetaRing::reap(uint64_t &user_data, int &res){
+  unsigned head = *cq_head;
+  if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    return false;
+  struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+  user_data = cqe->user_data;
+  res = cqe->res;
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+  if(in_flight) in_flight--;
+  return true;
+}
+
+void MetaRing::drain(){
+  /*
+   * Waits for every submitted request and drops the results, so nothing
+   * is left writing into the callers' buffers once the ring goes away.
+   * Requests queued but never submitted are simply discarded with it.
+   */
+  uint64_t user_data;
+  int res;
+  while(in_flight){
+    while(reap(user_data, res));
+    if(!in_flight) break;
+    if(syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+    && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      break;
+  }
+}
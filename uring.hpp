@@ -0,0 +1,69 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+
+#define DEFAULT_URING_DEPTH 128
+
+class MetaRing{
+  /*
+   * Minimal io_uring wrapper for metadata requests, talking to the
+   * kernel through the raw syscalls so no liburing is needed. Only one
+   * thread may use a ring. If the kernel has no io_uring, or no statx
+   * opcode, ok() is false and callers use the synchronous path.
+   */
+private:
+  int ring_fd;
+  unsigned depth;
+  unsigned to_submit;
+  unsigned in_flight; // submitted, not reaped yet
+  bool getxattr_supported;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct io_uring_sqe *get_sqe(void);
+  void probe(void);
+  void teardown(void);
+public:
+  MetaRing(unsigned depth_);
+  ~MetaRing();
+  bool ok(void) const{ return ring_fd != -1; }
+  bool can_getxattr(void) const{ return getxattr_supported; }
+  unsigned queue_depth(void) const{ return depth; }
+  bool queue_statx(int dirfd, const char *name, struct statx *buff, uint64_t user_data);
+  bool queue_getxattr(const char *path, const char *attr, void *value, size_t len, uint64_t user_data);
+  int submit_and_wait(unsigned min_complete);
+  bool reap(uint64_t &user_data, int &res);
+  void drain(void);
+};
@@ -0,0 +1,198 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "watch.hpp"
+#include "crawl.hpp"
+#include "crawler.hpp"
+#include "alert.hpp"
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#define FAN_EVENTS (FAN_OPEN | FAN_ACCESS | FAN_MODIFY | FAN_CLOSE_WRITE)
+#define IN_EVENTS (IN_OPEN | IN_ACCESS | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
+AccessWatcher::AccessWatcher(){
+  fan_fd = in_fd = wake_fd = -1;
+}
+
+AccessWatcher::~AccessWatcher(){
+  if(fan_fd != -1) close(fan_fd);
+  if(in_fd != -1) close(in_fd);
+}
+
+bool AccessWatcher::start(const std::vector<Tier> &tiers){
+  for(const Tier &t : tiers)
+    roots.push_back(t.dir);
+  fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC | O_NOATIME);
+  if(fan_fd != -1){
+    for(const fs::path &root : roots){
+      if(fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_EVENTS, AT_FDCWD, root.c_str()) == -1){
+        close(fan_fd);
+        fan_fd = -1;
+        break;
+      }
+    }
+  }
+  if(fan_fd != -1){
+    Log("Watching tiers with fanotify.", 2);
+    return true;
+  }
+  in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(in_fd == -1){
+    Log(std::string("Cannot watch tiers: ") + strerror(errno), 0);
+    return false;
+  }
+  for(const fs::path &root : roots)
+    add_watches(root);
+  Log("Watching tiers with inotify (" + std::to_string(watches.size()) + " directories).", 2);
+  return true;
+}
+
+void AccessWatcher::add_watches(const fs::path &dir){
+  if(in_fd == -1) return;
+  int wd = inotify_add_watch(in_fd, dir.c_str(), IN_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+  if(wd == -1){
+    if(errno == ENOSPC)
+      Log("Out of inotify watches, raise fs.inotify.max_user_watches. Not watching " + dir.string(), 0);
+    return;
+  }
+  watches[wd] = dir;
+  DirReader reader(dir.c_str());
+  const char *name;
+  unsigned char type;
+  uint64_t ino;
+  while(reader.next(name, type, ino)){
+    if(type == DT_DIR) add_watches(dir / name);
+  }
+}
+
+bool AccessWatcher::under_roots(const fs::path &path) const{
+  const std::string &str = path.string();
+  for(const fs::path &root : roots){
+    const std::string &r = root.string();
+    if(str.compare(0, r.length(), r) == 0 && (str.length() == r.length() || str[r.length()] == '/'))
+      return true;
+  }
+  return false;
+}
+
+bool AccessWatcher::poll(std::vector<WatchEvent> &events, int timeout_ms){
+  struct pollfd pfd[2];
+  pfd[0].fd = (fan_fd != -1)? fan_fd : in_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = wake_fd;
+  pfd[1].events = POLLIN;
+  if(pfd[0].fd == -1) return false;
+  int ret = ::poll(pfd, (wake_fd != -1)? 2 : 1, timeout_ms);
+  if(ret <= 0 || !(pfd[0].revents & POLLIN)) return false;
+  if(fan_fd != -1)
+    read_fanotify(events);
+  else
+    read_inotify(events);
+  return !events.empty();
+}
+
+void AccessWatcher::discard_own(const std::unordered_set<std::string> &touched, std::vector<WatchEvent> &kept){
+  /*
+   * Drops what our own moves caused and hands back the rest. fanotify
+   * already leaves out our pid, so its queue is left for the next poll.
+   * inotify events carry no pid, so those on the paths a pass touched
+   * are taken for its own; new directories are always kept.
+   */
+  if(fan_fd != -1) return;
+  std::vector<WatchEvent> events;
+  while(poll(events, 0)){
+    for(const WatchEvent &e : events)
+      if(e.type == CREATED_DIR || !touched.count(e.path.string())) kept.push_back(e);
+    events.clear();
+  }
+}
+
+void AccessWatcher::read_fanotify(std::vector<WatchEvent> &events){
+  char buff[WATCH_BUFF_SZ] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+  char path[PATH_MAX];
+  pid_t self = getpid();
+  ssize_t len;
+  while((len = read(fan_fd, buff, sizeof(buff))) > 0){
+    struct fanotify_event_metadata *meta = (struct fanotify_event_metadata *)buff;
+    for(; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)){
+      if(meta->mask & FAN_Q_OVERFLOW){
+        Log("fanotify queue overflowed, some accesses were missed.", 1);
+        continue;
+      }
+      if(meta->fd < 0) continue;
+      if(meta->pid != self){
+        std::string fd_link = "/proc/self/fd/" + std::to_string(meta->fd);
+        ssize_t path_len = readlink(fd_link.c_str(), path, sizeof(path) - 1);
+        if(path_len > 0){
+          path[path_len] = '\0';
+          fs::path p(path);
+          // events on the same file may have been merged, an open and its reads are one access
+          if(under_roots(p)){
+            if(meta->mask & (FAN_OPEN | FAN_ACCESS))
+              events.push_back(WatchEvent{p, (meta->mask & FAN_OPEN)? OPENED : ACCESSED});
+            if(meta->mask & (FAN_MODIFY | FAN_CLOSE_WRITE))
+              events.push_back(WatchEvent{p, MODIFIED});
+          }
+        }
+      }
+      close(meta->fd);
+    }
+  }
+}
+
+void AccessWatcher::read_inotify(std::vector<WatchEvent> &events){
+  char buff[WATCH_BUFF_SZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while((len = read(in_fd, buff, sizeof(buff))) > 0){
+    for(char *ptr = buff; ptr < buff + len; ){
+      struct inotify_event *ev = (struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + ev->len;
+      if(ev->mask & IN_Q_OVERFLOW){
+        Log("inotify queue overflowed, some accesses were missed.", 1);
+        continue;
+      }
+      if(ev->mask & IN_IGNORED){
+        watches.erase(ev->wd);
+        continue;
+      }
+      std::unordered_map<int, fs::path>::iterator dir = watches.find(ev->wd);
+      if(dir == watches.end() || ev->len == 0) continue;
+      fs::path p = dir->second / ev->name;
+      if(ev->mask & IN_ISDIR){
+        if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+          events.push_back(WatchEvent{p, CREATED_DIR});
+      }else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)){
+        events.push_back(WatchEvent{p, REMOVED});
+      }else if(ev->mask & IN_OPEN){
+        events.push_back(WatchEvent{p, OPENED});
+      }else if(ev->mask & IN_ACCESS){
+        events.push_back(WatchEvent{p, ACCESSED});
+      }else{
+        events.push_back(WatchEvent{p, MODIFIED});
+      }
+    }
+  }
+}
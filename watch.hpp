@@ -0,0 +1,65 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+namespace fs = boost::filesystem;
+
+#define WATCH_BUFF_SZ 65536
+
+class Tier; // forward declaration
+
+// OPENED also counts as ACCESSED, and is the only one that adds to a file's access count
+enum WatchType{OPENED, ACCESSED, MODIFIED, CREATED_DIR, REMOVED};
+
+struct WatchEvent{
+  fs::path path;
+  enum WatchType type;
+};
+
+class AccessWatcher{
+  /*
+   * Reports file accesses and modifications under the tier directories.
+   * fanotify is used when we have CAP_SYS_ADMIN since one mark covers a
+   * whole mount and events carry the pid, which lets autotier ignore its
+   * own copies. Otherwise every directory gets an inotify watch.
+   */
+private:
+  int fan_fd;
+  int in_fd;
+  int wake_fd; // another source of events, poll() returns when it is readable
+  std::vector<fs::path> roots;
+  std::unordered_map<int, fs::path> watches;
+  bool under_roots(const fs::path &path) const;
+  void read_fanotify(std::vector<WatchEvent> &events);
+  void read_inotify(std::vector<WatchEvent> &events);
+public:
+  AccessWatcher();
+  ~AccessWatcher();
+  bool start(const std::vector<Tier> &tiers);
+  void add_watches(const fs::path &dir);
+  void wake_on(int fd){ wake_fd = fd; }
+  bool poll(std::vector<WatchEvent> &events, int timeout_ms);
+  void discard_own(const std::unordered_set<std::string> &touched, std::vector<WatchEvent> &kept);
+  bool using_fanotify(void) const{ return fan_fd != -1; }
+};
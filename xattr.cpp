@@ -0,0 +1,142 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "xattr.hpp"
+#include "alert.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <sys/xattr.h>
+
+std::string pack_meta(int64_t last_atime, uint64_t priority, double heat, const char *pin){
+  MetaHeader header;
+  memset(&header, 0, sizeof(header));
+  header.version = META_VERSION;
+  header.pin_len = (pin)? strnlen(pin, META_PIN_SZ - 1) : 0;
+  header.last_atime = last_atime;
+  header.priority = priority;
+  header.heat = heat;
+  std::string value((const char *)&header, sizeof(header));
+  if(header.pin_len) value.append(pin, header.pin_len);
+  return value;
+}
+
+bool unpack_meta(const char *buff, ssize_t len, MetaValues &values){
+  MetaHeader header;
+  size_t header_len = sizeof(header);
+  if(len < 4) return false;
+  memcpy(&header.version, buff, sizeof(header.version));
+  if(header.version == 1) header_len = offsetof(MetaHeader, heat);
+  else if(header.version != META_VERSION) return false;
+  if(len < (ssize_t)header_len) return false;
+  memcpy(&header, buff, header_len);
+  if(header.pin_len >= META_PIN_SZ || header.pin_len > len - header_len) return false;
+  values.last_atime = header.last_atime;
+  values.priority = header.priority;
+  values.heat = header.heat;
+  values.have_atime = values.have_priority = true;
+  values.have_heat = (header.version >= 2);
+  values.legacy = false;
+  memcpy(values.pin, buff + header_len, header.pin_len);
+  values.pin[header.pin_len] = '\0';
+  return true;
+}
+
+static ssize_t get(int fd, const char *path, const char *name, void *value, size_t len){
+  return (fd != -1)? fgetxattr(fd, name, value, len) : getxattr(path, name, value, len);
+}
+
+void read_legacy_meta(int fd, const char *path, MetaValues &values){
+  ssize_t pin_len = get(fd, path, LEGACY_PIN_XATTR, values.pin, sizeof(values.pin) - 1);
+  values.pin[(pin_len > 0)? pin_len : 0] = '\0';
+  values.have_atime = get(fd, path, LEGACY_ATIME_XATTR, &values.last_atime, sizeof(values.last_atime)) > 0;
+  values.have_priority = get(fd, path, LEGACY_PRIORITY_XATTR, &values.priority, sizeof(values.priority)) > 0;
+  values.have_heat = false;
+  values.legacy = pin_len > 0 || values.have_atime || values.have_priority;
+}
+
+void read_meta(int fd, const char *path, MetaValues &values){
+  /*
+   * By fd when there is one, otherwise by path. The old xattrs are only
+   * looked at when the packed one is missing, so a migrated file costs
+   * a single call.
+   */
+  char buff[META_BUFF_SZ];
+  ssize_t len = get(fd, path, META_XATTR, buff, sizeof(buff));
+  if(len > 0 && unpack_meta(buff, len, values)) return;
+  read_legacy_meta(fd, path, values);
+}
+
+XattrWriter::XattrWriter(){
+  busy = false;
+}
+
+XattrWriter::~XattrWriter(){
+  wait();
+}
+
+bool write_meta(const char *path, const std::string &value, bool legacy){
+  if(setxattr(path, META_XATTR, value.data(), value.size(), 0) == -1){
+    error(SETX);
+    metrics.xattr_write_failures++;
+    return false;
+  }
+  metrics.xattr_writes++;
+  if(legacy){
+    removexattr(path, LEGACY_PIN_XATTR);
+    removexattr(path, LEGACY_ATIME_XATTR);
+    removexattr(path, LEGACY_PRIORITY_XATTR);
+  }
+  return true;
+}
+
+void XattrWriter::submit(std::vector<Record> &batch){
+  std::lock_guard<std::mutex> guard(lock);
+  batches.emplace_back();
+  batches.back().swap(batch);
+  if(!busy){
+    if(thread.joinable()) thread.join(); // already past its last use of the lock
+    busy = true;
+    thread = std::thread(&XattrWriter::run, this);
+  }
+}
+
+void XattrWriter::wait(){
+  std::unique_lock<std::mutex> guard(lock);
+  idle_cv.wait(guard, [this]{ return !busy; });
+  if(thread.joinable()) thread.join();
+}
+
+void XattrWriter::run(){
+  std::vector<Record> batch;
+  std::unique_lock<std::mutex> guard(lock);
+  while(!batches.empty()){
+    batch.swap(batches.front());
+    batches.pop_front();
+    guard.unlock();
+    for(const Record &r : batch)
+      write_meta(r.path.c_str(), r.value, r.legacy);
+    batch.clear();
+    guard.lock();
+  }
+  busy = false;
+  idle_cv.notify_all();
+}
@@ -0,0 +1,99 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+#define META_XATTR "user.autotier"
+#define META_VERSION 2 // version 1 had no heat
+#define META_PIN_SZ 4096
+#define META_BUFF_SZ (sizeof(MetaHeader) + META_PIN_SZ)
+#define META_BATCH_SZ 1024
+
+// written by older versions, read when META_XATTR is missing
+#define LEGACY_PIN_XATTR "user.autotier_pin"
+#define LEGACY_ATIME_XATTR "user.autotier_last_atime"
+#define LEGACY_PRIORITY_XATTR "user.autotier_priority"
+
+struct MetaHeader{
+  /*
+   * Start of META_XATTR, followed by pin_len bytes of pin. A record
+   * with a version this build does not know is treated as missing;
+   * version 1 records end before heat.
+   */
+  uint32_t version;
+  uint32_t pin_len;
+  int64_t last_atime;
+  uint64_t priority;
+  double heat;
+};
+
+struct MetaValues{
+  int64_t last_atime;
+  uint64_t priority;
+  double heat;
+  bool have_atime;
+  bool have_priority;
+  bool have_heat;
+  bool legacy; // came from the old one-value-per-xattr layout
+  char pin[META_PIN_SZ]; // c-string, empty when not pinned
+};
+
+std::string pack_meta(int64_t last_atime, uint64_t priority, double heat, const char *pin);
+bool unpack_meta(const char *buff, ssize_t len, MetaValues &values);
+void read_legacy_meta(int fd, const char *path, MetaValues &values);
+void read_meta(int fd, const char *path, MetaValues &values);
+bool write_meta(const char *path, const std::string &value, bool legacy);
+
+class XattrWriter{
+  /*
+   * Writes packed records on a background thread, so the index update
+   * or the daemon's event loop goes on while they trickle out. Records
+   * are handed over a batch at a time to keep the lock off the hot path.
+   * The thread only lives until the queue is empty. A record read from
+   * the old layout also has those xattrs removed.
+   */
+public:
+  struct Record{
+    std::string path;
+    std::string value;
+    bool legacy;
+  };
+private:
+  std::deque<std::vector<Record>> batches;
+  std::mutex lock;
+  std::condition_variable idle_cv;
+  bool busy;
+  std::thread thread;
+  void run(void);
+public:
+  XattrWriter();
+  ~XattrWriter();
+  void submit(std::vector<Record> &batch);
+  void wait(void);
+};
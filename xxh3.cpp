@@ -0,0 +1,409 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "xxh3.hpp"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define XXH3_NEON 1
+#endif
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define SECRET_CONSUME_RATE 8
+#define STRIPES_PER_BLOCK ((XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define BLOCK_LEN (XXH3_STRIPE_LEN * STRIPES_PER_BLOCK)
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_SIZE_MIN 136
+
+static const unsigned char secret[XXH3_SECRET_SIZE] __attribute__((aligned(64))) = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+// little endian loads, like the rest of autotier this assumes a little endian host
+static inline uint32_t read32(const unsigned char *p){
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read64(const unsigned char *p){
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b){
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h){
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  return h ^ (h >> 32);
+}
+
+static inline uint64_t avalanche(uint64_t h){
+  h ^= h >> 37;
+  h *= PRIME_MX1;
+  return h ^ (h >> 32);
+}
+
+static inline uint64_t rrmxmx(uint64_t h, uint64_t len){
+  h ^= rotl64(h, 49) ^ rotl64(h, 24);
+  h *= PRIME_MX2;
+  h ^= (h >> 35) + len;
+  h *= PRIME_MX2;
+  return h ^ (h >> 28);
+}
+
+static inline uint64_t mix16(const unsigned char *input, const unsigned char *sec){
+  return mul128_fold64(read64(input) ^ read64(sec), read64(input + 8) ^ read64(sec + 8));
+}
+
+static uint64_t hash_short(const unsigned char *input, size_t len){
+  if(len > 8){
+    uint64_t lo = read64(input) ^ (read64(secret + 24) ^ read64(secret + 32));
+    uint64_t hi = read64(input + len - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+    return avalanche(len + __builtin_bswap64(lo) + hi + mul128_fold64(lo, hi));
+  }
+  if(len >= 4){
+    uint64_t in = read32(input + len - 4) + ((uint64_t)read32(input) << 32);
+    return rrmxmx(in ^ (read64(secret + 8) ^ read64(secret + 16)), len);
+  }
+  if(len > 0){
+    uint32_t combined = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24)
+      | (uint32_t)input[len - 1] | ((uint32_t)len << 8);
+    return xxh64_avalanche(combined ^ (uint64_t)(read32(secret) ^ read32(secret + 4)));
+  }
+  return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+}
+
+static uint64_t hash_mid(const unsigned char *input, size_t len){
+  uint64_t acc = len * PRIME64_1;
+  if(len <= 128){
+    if(len > 32){
+      if(len > 64){
+        if(len > 96){
+          acc += mix16(input + 48, secret + 96);
+          acc += mix16(input + len - 64, secret + 112);
+        }
+        acc += mix16(input + 32, secret + 64);
+        acc += mix16(input + len - 48, secret + 80);
+      }
+      acc += mix16(input + 16, secret + 32);
+      acc += mix16(input + len - 32, secret + 48);
+    }
+    acc += mix16(input, secret);
+    acc += mix16(input + len - 16, secret + 16);
+    return avalanche(acc);
+  }
+  size_t rounds = len / 16;
+  for(size_t i = 0; i < 8; i++)
+    acc += mix16(input + 16 * i, secret + 16 * i);
+  acc = avalanche(acc);
+  for(size_t i = 8; i < rounds; i++)
+    acc += mix16(input + 16 * i, secret + 16 * (i - 8) + MIDSIZE_STARTOFFSET);
+  acc += mix16(input + len - 16, secret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET);
+  return avalanche(acc);
+}
+
+/*
+ * Stripe kernels. accumulate() runs `stripes` stripes against the secret
+ * starting at sec, scramble() ends a block.
+ */
+
+static void accumulate_scalar(uint64_t *acc, const unsigned char *input, const unsigned char *sec, size_t stripes){
+  for(size_t s = 0; s < stripes; s++){
+    const unsigned char *in = input + s * XXH3_STRIPE_LEN;
+    const unsigned char *key = sec + s * SECRET_CONSUME_RATE;
+    for(int i = 0; i < 8; i++){
+      uint64_t data = read64(in + 8 * i);
+      uint64_t data_key = data ^ read64(key + 8 * i);
+      acc[i ^ 1] += data;
+      acc[i] += (data_key & 0xffffffff) * (data_key >> 32);
+    }
+  }
+}
+
+static void scramble_scalar(uint64_t *acc, const unsigned char *sec){
+  for(int i = 0; i < 8; i++){
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= read64(sec + 8 * i);
+    acc[i] = a * PRIME32_1;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t *acc, const unsigned char *input, const unsigned char *sec, size_t stripes){
+  __m128i *xacc = (__m128i *)acc;
+  __m128i a[4];
+  for(int i = 0; i < 4; i++) a[i] = _mm_load_si128(xacc + i);
+  for(size_t s = 0; s < stripes; s++){
+    const __m128i *in = (const __m128i *)(input + s * XXH3_STRIPE_LEN);
+    const __m128i *key = (const __m128i *)(sec + s * SECRET_CONSUME_RATE);
+    for(int i = 0; i < 4; i++){
+      __m128i data = _mm_loadu_si128(in + i);
+      __m128i data_key = _mm_xor_si128(data, _mm_loadu_si128(key + i));
+      __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+      __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+      __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+      a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+    }
+  }
+  for(int i = 0; i < 4; i++) _mm_store_si128(xacc + i, a[i]);
+}
+
+__attribute__((target("sse2")))
+static void scramble_sse2(uint64_t *acc, const unsigned char *sec){
+  __m128i *xacc = (__m128i *)acc;
+  const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+  for(int i = 0; i < 4; i++){
+    __m128i a = _mm_load_si128(xacc + i);
+    a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+    a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)sec + i));
+    __m128i a_hi = _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1));
+    __m128i lo = _mm_mul_epu32(a, prime);
+    __m128i hi = _mm_mul_epu32(a_hi, prime);
+    _mm_store_si128(xacc + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+  }
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const unsigned char *input, const unsigned char *sec, size_t stripes){
+  __m256i *xacc = (__m256i *)acc;
+  __m256i a0 = _mm256_load_si256(xacc), a1 = _mm256_load_si256(xacc + 1);
+  for(size_t s = 0; s < stripes; s++){
+    const __m256i *in = (const __m256i *)(input + s * XXH3_STRIPE_LEN);
+    const __m256i *key = (const __m256i *)(sec + s * SECRET_CONSUME_RATE);
+    __m256i d0 = _mm256_loadu_si256(in), d1 = _mm256_loadu_si256(in + 1);
+    __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256(key));
+    __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256(key + 1));
+    __m256i p0 = _mm256_mul_epu32(k0, _mm256_shuffle_epi32(k0, _MM_SHUFFLE(0, 3, 0, 1)));
+    __m256i p1 = _mm256_mul_epu32(k1, _mm256_shuffle_epi32(k1, _MM_SHUFFLE(0, 3, 0, 1)));
+    a0 = _mm256_add_epi64(a0, _mm256_add_epi64(p0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+    a1 = _mm256_add_epi64(a1, _mm256_add_epi64(p1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+  }
+  _mm256_store_si256(xacc, a0);
+  _mm256_store_si256(xacc + 1, a1);
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t *acc, const unsigned char *sec){
+  __m256i *xacc = (__m256i *)acc;
+  const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+  for(int i = 0; i < 2; i++){
+    __m256i a = _mm256_load_si256(xacc + i);
+    a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+    a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)sec + i));
+    __m256i lo = _mm256_mul_epu32(a, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+    _mm256_store_si256(xacc + i, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+  }
+}
+#endif
+
+#ifdef XXH3_NEON
+static void accumulate_neon(uint64_t *acc, const unsigned char *input, const unsigned char *sec, size_t stripes){
+  uint64x2_t a[4];
+  for(int i = 0; i < 4; i++) a[i] = vld1q_u64(acc + 2 * i);
+  for(size_t s = 0; s < stripes; s++){
+    const unsigned char *in = input + s * XXH3_STRIPE_LEN;
+    const unsigned char *key = sec + s * SECRET_CONSUME_RATE;
+    for(int i = 0; i < 4; i++){
+      uint64x2_t data = vreinterpretq_u64_u8(vld1q_u8(in + 16 * i));
+      uint64x2_t data_key = veorq_u64(data, vreinterpretq_u64_u8(vld1q_u8(key + 16 * i)));
+      uint64x2_t product = vmull_u32(vmovn_u64(data_key), vshrn_n_u64(data_key, 32));
+      a[i] = vaddq_u64(a[i], vaddq_u64(product, vextq_u64(data, data, 1)));
+    }
+  }
+  for(int i = 0; i < 4; i++) vst1q_u64(acc + 2 * i, a[i]);
+}
+
+static void scramble_neon(uint64_t *acc, const unsigned char *sec){
+  const uint32x2_t prime = vdup_n_u32(PRIME32_1);
+  for(int i = 0; i < 4; i++){
+    uint64x2_t a = vld1q_u64(acc + 2 * i);
+    a = veorq_u64(a, vshrq_n_u64(a, 47));
+    a = veorq_u64(a, vreinterpretq_u64_u8(vld1q_u8(sec + 16 * i)));
+    uint64x2_t hi = vshlq_n_u64(vmull_u32(vshrn_n_u64(a, 32), prime), 32);
+    vst1q_u64(acc + 2 * i, vmlal_u32(hi, vmovn_u64(a), prime));
+  }
+}
+#endif
+
+struct Kernel{
+  void (*accumulate)(uint64_t *, const unsigned char *, const unsigned char *, size_t);
+  void (*scramble)(uint64_t *, const unsigned char *);
+  const char *name;
+};
+
+static Kernel pick_kernel(void){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return Kernel{accumulate_avx2, scramble_avx2, "avx2"};
+  if(__builtin_cpu_supports("sse2")) return Kernel{accumulate_sse2, scramble_sse2, "sse2"};
+#elif defined(XXH3_NEON)
+  return Kernel{accumulate_neon, scramble_neon, "neon"};
+#endif
+  return Kernel{accumulate_scalar, scramble_scalar, "scalar"};
+}
+
+static const Kernel kernel = pick_kernel();
+
+static const uint64_t init_acc[8] = {
+  PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+};
+
+static uint64_t merge_accs(const uint64_t *acc, uint64_t len){
+  uint64_t result = len * PRIME64_1;
+  const unsigned char *sec = secret + SECRET_MERGEACCS_START;
+  for(int i = 0; i < 4; i++)
+    result += mul128_fold64(acc[2 * i] ^ read64(sec + 16 * i), acc[2 * i + 1] ^ read64(sec + 16 * i + 8));
+  return avalanche(result);
+}
+
+void XXH3::reset(){
+  memcpy(acc, init_acc, sizeof(acc));
+  buffered = 0;
+  stripes_so_far = 0;
+  total_len = 0;
+}
+
+void XXH3::consume_stripes(uint64_t *accs, size_t &so_far, const unsigned char *input, size_t stripes) const{
+  if(STRIPES_PER_BLOCK - so_far <= stripes){
+    size_t to_end = STRIPES_PER_BLOCK - so_far;
+    kernel.accumulate(accs, input, secret + so_far * SECRET_CONSUME_RATE, to_end);
+    kernel.scramble(accs, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+    kernel.accumulate(accs, input + to_end * XXH3_STRIPE_LEN, secret, stripes - to_end);
+    so_far = stripes - to_end;
+  }else{
+    kernel.accumulate(accs, input, secret + so_far * SECRET_CONSUME_RATE, stripes);
+    so_far += stripes;
+  }
+}
+
+void XXH3::add(const void *data, size_t length){
+  /*
+   * At least one byte always stays buffered so hash() can see the last
+   * stripe, and the last consumed stripe is kept at the end of the
+   * buffer for when fewer than a stripe's worth remain.
+   */
+  const unsigned char *input = (const unsigned char *)data;
+  total_len += length;
+  if(buffered + length <= XXH3_BUFFER_SIZE){
+    memcpy(buffer + buffered, input, length);
+    buffered += length;
+    return;
+  }
+  if(buffered){
+    size_t fill = XXH3_BUFFER_SIZE - buffered;
+    memcpy(buffer + buffered, input, fill);
+    input += fill;
+    length -= fill;
+    consume_stripes(acc, stripes_so_far, buffer, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+    buffered = 0;
+  }
+  if(length > XXH3_BUFFER_SIZE){
+    while(length > XXH3_BUFFER_SIZE){
+      consume_stripes(acc, stripes_so_far, input, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+      input += XXH3_BUFFER_SIZE;
+      length -= XXH3_BUFFER_SIZE;
+    }
+    memcpy(buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN, input - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+  }
+  memcpy(buffer, input, length);
+  buffered = length;
+}
+
+uint64_t XXH3::hash() const{
+  if(total_len <= XXH3_MIDSIZE_MAX) return hash(buffer, total_len);
+  uint64_t accs[8] __attribute__((aligned(32)));
+  memcpy(accs, acc, sizeof(accs));
+  const unsigned char *last_acc_secret = secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - SECRET_LASTACC_START;
+  if(buffered >= XXH3_STRIPE_LEN){
+    size_t so_far = stripes_so_far;
+    consume_stripes(accs, so_far, buffer, (buffered - 1) / XXH3_STRIPE_LEN);
+    kernel.accumulate(accs, buffer + buffered - XXH3_STRIPE_LEN, last_acc_secret, 1);
+  }else{
+    unsigned char last[XXH3_STRIPE_LEN];
+    size_t catchup = XXH3_STRIPE_LEN - buffered;
+    memcpy(last, buffer + XXH3_BUFFER_SIZE - catchup, catchup);
+    memcpy(last + catchup, buffer, buffered);
+    kernel.accumulate(accs, last, last_acc_secret, 1);
+  }
+  return merge_accs(accs, total_len);
+}
+
+uint64_t XXH3::hash(const void *data, size_t len){
+  const unsigned char *input = (const unsigned char *)data;
+  if(len <= 16) return hash_short(input, len);
+  if(len <= XXH3_MIDSIZE_MAX) return hash_mid(input, len);
+  uint64_t accs[8] __attribute__((aligned(32)));
+  memcpy(accs, init_acc, sizeof(accs));
+  size_t blocks = (len - 1) / BLOCK_LEN;
+  for(size_t b = 0; b < blocks; b++){
+    kernel.accumulate(accs, input + b * BLOCK_LEN, secret, STRIPES_PER_BLOCK);
+    kernel.scramble(accs, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+  }
+  size_t stripes = ((len - 1) - BLOCK_LEN * blocks) / XXH3_STRIPE_LEN;
+  kernel.accumulate(accs, input + blocks * BLOCK_LEN, secret, stripes);
+  kernel.accumulate(accs, input + len - XXH3_STRIPE_LEN,
+    secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - SECRET_LASTACC_START, 1);
+  return merge_accs(accs, len);
+}
+
+const char *XXH3::kernel_name(){
+  return kernel.name;
+}
@@ -0,0 +1,52 @@
+/*
+    Copyright (C) 2019 Joshua Boudreau
+
+    This file is part of autotier.
+
+    autotier is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    autotier is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with autotier.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XXH3_STRIPE_LEN 64
+#define XXH3_SECRET_SIZE 192
+#define XXH3_BUFFER_SIZE 256 // four stripes
+#define XXH3_MIDSIZE_MAX 240
+
+class XXH3{
+  /*
+   * Streaming XXH3 64-bit with seed 0 and the default secret, giving the
+   * same result as XXH3_64bits() from the reference library. The stripe
+   * loop runs on AVX2, SSE2 or NEON when available, chosen once at
+   * startup; short inputs stay scalar.
+   */
+private:
+  uint64_t acc[8] __attribute__((aligned(32)));
+  unsigned char buffer[XXH3_BUFFER_SIZE] __attribute__((aligned(32)));
+  size_t buffered;
+  size_t stripes_so_far; // in the current block
+  uint64_t total_len;
+  void consume_stripes(uint64_t *accs, size_t &so_far, const unsigned char *input, size_t stripes) const;
+public:
+  XXH3(void){ reset(); }
+  void reset(void);
+  void add(const void *input, size_t length);
+  uint64_t hash(void) const;
+  static uint64_t hash(const void *input, size_t length);
+  static const char *kernel_name(void);
+};